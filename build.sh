@@ -1,12 +1,25 @@
 profile=0
 slow=0
 assert=0
+# build the light engine benchmark instead of the server
+bench=0
+# don't tune for the build machine, SIMD kernels are picked at runtime
+portable=0
 
 CFLAGS=""
 LIBS="-lz -lm -lpthread"
+OUT="blaze"
+
+if [ $bench == 1 ]; then
+    CFLAGS+=" -DLIGHT_BENCHMARK"
+    OUT="lightbench"
+fi
 
 if [ $slow == 0 ]; then
-    CFLAGS+=" -flto -O3 -march=native"
+    CFLAGS+=" -flto -O3"
+    if [ $portable == 0 ]; then
+        CFLAGS+=" -march=native"
+    fi
 fi
 
 if [ $assert == 0 ]; then
@@ -14,7 +27,7 @@ if [ $assert == 0 ]; then
 fi
 
 if [ $profile == 0 ]; then
-    cc $CFLAGS -o blaze src/*.c $LIBS
+    cc $CFLAGS -o $OUT src/*.c $LIBS
 elif [ $profile == 1 ]; then
     if [ ! -e "lib/tracy" ]; then
         # download Tracy if not present
@@ -43,5 +56,5 @@ elif [ $profile == 1 ]; then
 
     cc $CFLAGS -g -c src/*.c -I lib
     c++ $CFLAGS -g -std=c++11 -c lib/tracy/TracyClient.cpp
-    c++ $CFLAGS -g -o blaze *.o $LIBS
+    c++ $CFLAGS -g -o $OUT *.o $LIBS
 fi
@@ -11,6 +11,11 @@
 #include "buffer.h"
 #include "nbt.h"
 #include "chunk.h"
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 static void FillBufferFromFile(int fd, Cursor * cursor) {
     BeginTimings(ReadFile);
@@ -42,6 +47,214 @@ static void FillBufferFromFile(int fd, Cursor * cursor) {
     EndTimings(ReadFile);
 }
 
+// NOTE(traks): Block states in Anvil are stored as palette indices packed into
+// big-endian longs. Each long holds 64 / bitsPerBlock indices starting from the
+// least significant bits, and indices never straddle two longs. Below are
+// unpack kernels specialised per bits-per-block. They write all 4096 indices
+// of a section to a scratch buffer, which must have room for at least
+// UNPACK_PADDING extra entries, because the kernels may write a bit past the
+// end. The indices are validated and mapped through the palette afterwards.
+
+#define MIN_ANVIL_BITS_PER_BLOCK 4
+#define MAX_ANVIL_BITS_PER_BLOCK 15
+#define UNPACK_PADDING 32
+
+typedef void (* UnpackIndicesKernel)(u16 * restrict out, u8 * restrict longData);
+
+#define UNPACK_INDICES_SCALAR(bits) \
+static inline void UnpackIndicesScalar##bits(u16 * restrict out, u8 * restrict longData) { \
+    enum { blocksPerLong = 64 / (bits) }; \
+    u32 mask = ((u32) 1 << (bits)) - 1; \
+    for (i32 outIndex = 0; outIndex < 4096; outIndex += blocksPerLong) { \
+        u64 entry = ReadDirectU64(longData); \
+        longData += 8; \
+        for (i32 i = 0; i < blocksPerLong; i++) { \
+            out[outIndex + i] = (entry >> (i * (bits))) & mask; \
+        } \
+    } \
+}
+
+UNPACK_INDICES_SCALAR(4)
+UNPACK_INDICES_SCALAR(5)
+UNPACK_INDICES_SCALAR(6)
+UNPACK_INDICES_SCALAR(7)
+UNPACK_INDICES_SCALAR(8)
+UNPACK_INDICES_SCALAR(9)
+UNPACK_INDICES_SCALAR(10)
+UNPACK_INDICES_SCALAR(11)
+UNPACK_INDICES_SCALAR(12)
+UNPACK_INDICES_SCALAR(13)
+UNPACK_INDICES_SCALAR(14)
+UNPACK_INDICES_SCALAR(15)
+
+#ifdef CPU_X86_KERNELS
+
+// NOTE(traks): 4 and 8 bits per block are byte aligned, so we can just swap
+// the bytes of two longs at a time and widen nibbles/bytes to 16 bits
+TARGET_SSE4 static void UnpackIndicesSse4(u16 * restrict out, u8 * restrict longData) {
+    __m128i swapLongs = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    __m128i lowNibbles = _mm_set1_epi8(0x0f);
+    for (i32 outIndex = 0; outIndex < 4096; outIndex += 32) {
+        __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) longData), swapLongs);
+        longData += 16;
+        __m128i low = _mm_and_si128(bytes, lowNibbles);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), lowNibbles);
+        __m128i first = _mm_unpacklo_epi8(low, high);
+        __m128i second = _mm_unpackhi_epi8(low, high);
+        _mm_storeu_si128((__m128i *) (out + outIndex), _mm_cvtepu8_epi16(first));
+        _mm_storeu_si128((__m128i *) (out + outIndex + 8), _mm_cvtepu8_epi16(_mm_srli_si128(first, 8)));
+        _mm_storeu_si128((__m128i *) (out + outIndex + 16), _mm_cvtepu8_epi16(second));
+        _mm_storeu_si128((__m128i *) (out + outIndex + 24), _mm_cvtepu8_epi16(_mm_srli_si128(second, 8)));
+    }
+}
+
+TARGET_SSE4 static void UnpackIndicesSse8(u16 * restrict out, u8 * restrict longData) {
+    __m128i swapLongs = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    for (i32 outIndex = 0; outIndex < 4096; outIndex += 16) {
+        __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) longData), swapLongs);
+        longData += 16;
+        _mm_storeu_si128((__m128i *) (out + outIndex), _mm_cvtepu8_epi16(bytes));
+        _mm_storeu_si128((__m128i *) (out + outIndex + 8), _mm_cvtepu8_epi16(_mm_srli_si128(bytes, 8)));
+    }
+}
+
+// NOTE(traks): For the other widths, broadcast a long to all lanes and use a
+// byte shuffle to move the 32-bit window containing index i into lane i. This
+// also takes care of the byte swap. Then shift each lane by the remaining bit
+// offset and mask. At most 15 + 7 bits are needed, so the window is always
+// large enough. Up to 8 indices are extracted at a time.
+#define UNPACK_WINDOW_BYTE(bits, i, k) (((i) * (bits) / 8 + (k)) <= 7 ? 7 - ((i) * (bits) / 8 + (k)) : -128)
+#define UNPACK_WINDOW(bits, i) UNPACK_WINDOW_BYTE(bits, i, 0), UNPACK_WINDOW_BYTE(bits, i, 1), \
+        UNPACK_WINDOW_BYTE(bits, i, 2), UNPACK_WINDOW_BYTE(bits, i, 3)
+#define UNPACK_WINDOWS(bits, i) _mm256_setr_epi8( \
+        UNPACK_WINDOW(bits, i), UNPACK_WINDOW(bits, i + 1), UNPACK_WINDOW(bits, i + 2), UNPACK_WINDOW(bits, i + 3), \
+        UNPACK_WINDOW(bits, i + 4), UNPACK_WINDOW(bits, i + 5), UNPACK_WINDOW(bits, i + 6), UNPACK_WINDOW(bits, i + 7))
+#define UNPACK_SHIFTS(bits, i) _mm256_setr_epi32( \
+        (i) * (bits) % 8, ((i) + 1) * (bits) % 8, ((i) + 2) * (bits) % 8, ((i) + 3) * (bits) % 8, \
+        ((i) + 4) * (bits) % 8, ((i) + 5) * (bits) % 8, ((i) + 6) * (bits) % 8, ((i) + 7) * (bits) % 8)
+
+TARGET_AVX2 static inline __m128i UnpackWindowsAvx2(__m256i entry, __m256i windows, __m256i shifts, __m256i mask) {
+    __m256i indices = _mm256_shuffle_epi8(entry, windows);
+    indices = _mm256_and_si256(_mm256_srlv_epi32(indices, shifts), mask);
+    return _mm_packus_epi32(_mm256_castsi256_si128(indices), _mm256_extracti128_si256(indices, 1));
+}
+
+#define UNPACK_INDICES_AVX2(bits) \
+TARGET_AVX2 static void UnpackIndicesAvx2##bits(u16 * restrict out, u8 * restrict longData) { \
+    enum { blocksPerLong = 64 / (bits) }; \
+    __m256i mask = _mm256_set1_epi32(((u32) 1 << (bits)) - 1); \
+    __m256i windows0 = UNPACK_WINDOWS(bits, 0); \
+    __m256i shifts0 = UNPACK_SHIFTS(bits, 0); \
+    __m256i windows1 = UNPACK_WINDOWS(bits, 8); \
+    __m256i shifts1 = UNPACK_SHIFTS(bits, 8); \
+    for (i32 outIndex = 0; outIndex < 4096; outIndex += blocksPerLong) { \
+        u64 rawEntry; \
+        memcpy(&rawEntry, longData, 8); \
+        longData += 8; \
+        __m256i entry = _mm256_set1_epi64x(rawEntry); \
+        _mm_storeu_si128((__m128i *) (out + outIndex), UnpackWindowsAvx2(entry, windows0, shifts0, mask)); \
+        if (blocksPerLong > 8) { \
+            _mm_storeu_si128((__m128i *) (out + outIndex + 8), UnpackWindowsAvx2(entry, windows1, shifts1, mask)); \
+        } \
+    } \
+}
+
+UNPACK_INDICES_AVX2(5)
+UNPACK_INDICES_AVX2(6)
+UNPACK_INDICES_AVX2(7)
+UNPACK_INDICES_AVX2(9)
+UNPACK_INDICES_AVX2(10)
+UNPACK_INDICES_AVX2(11)
+UNPACK_INDICES_AVX2(12)
+
+#endif
+
+static UnpackIndicesKernel unpackIndicesKernels[MAX_ANVIL_BITS_PER_BLOCK + 1] = {
+    [4] = UnpackIndicesScalar4,
+    [5] = UnpackIndicesScalar5,
+    [6] = UnpackIndicesScalar6,
+    [7] = UnpackIndicesScalar7,
+    [8] = UnpackIndicesScalar8,
+    [9] = UnpackIndicesScalar9,
+    [10] = UnpackIndicesScalar10,
+    [11] = UnpackIndicesScalar11,
+    [12] = UnpackIndicesScalar12,
+    [13] = UnpackIndicesScalar13,
+    [14] = UnpackIndicesScalar14,
+    [15] = UnpackIndicesScalar15,
+};
+
+// NOTE(traks): Maps palette indices to block states and writes them straight
+// into the section's storage. The palette must be padded with zeros up to the
+// next power of 2, so out of bounds indices can be read without any checks.
+// Instead of checking every index, we return the largest index encountered and
+// let the caller validate it. Returns the number of non-air blocks.
+static i32 MapPaletteIndicesScalar(u16 * restrict blockStates, u16 * restrict indices, u32 * restrict palette, u32 * maxIndexOut) {
+    u32 maxIndex = 0;
+    i32 nonAirCount = 0;
+    for (i32 posIndex = 0; posIndex < 4096; posIndex++) {
+        u32 paletteIndex = indices[posIndex];
+        maxIndex = MAX(maxIndex, paletteIndex);
+        u32 blockState = palette[paletteIndex];
+        blockStates[posIndex] = blockState;
+        // TODO(traks): handle cave air and void air
+        nonAirCount += (blockState != 0);
+    }
+    *maxIndexOut = maxIndex;
+    return nonAirCount;
+}
+
+#ifdef CPU_X86_KERNELS
+
+TARGET_AVX2 static i32 MapPaletteIndicesAvx2(u16 * restrict blockStates, u16 * restrict indices, u32 * restrict palette, u32 * maxIndexOut) {
+    __m256i maxIndices = _mm256_setzero_si256();
+    __m256i zero = _mm256_setzero_si256();
+    i32 airCount = 0;
+    for (i32 posIndex = 0; posIndex < 4096; posIndex += 8) {
+        __m256i paletteIndices = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *) (indices + posIndex)));
+        maxIndices = _mm256_max_epu32(maxIndices, paletteIndices);
+        __m256i states = _mm256_i32gather_epi32((int *) palette, paletteIndices, 4);
+        // TODO(traks): handle cave air and void air
+        __m256i isAir = _mm256_cmpeq_epi32(states, zero);
+        airCount += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(isAir)));
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(states), _mm256_extracti128_si256(states, 1));
+        _mm_storeu_si128((__m128i *) (blockStates + posIndex), packed);
+    }
+    __m128i maxIndex = _mm_max_epu32(_mm256_castsi256_si128(maxIndices), _mm256_extracti128_si256(maxIndices, 1));
+    maxIndex = _mm_max_epu32(maxIndex, _mm_shuffle_epi32(maxIndex, 0x4e));
+    maxIndex = _mm_max_epu32(maxIndex, _mm_shuffle_epi32(maxIndex, 0xb1));
+    *maxIndexOut = _mm_cvtsi128_si32(maxIndex);
+    return 4096 - airCount;
+}
+
+#endif
+
+typedef i32 (* MapPaletteIndicesKernel)(u16 * restrict blockStates, u16 * restrict indices, u32 * restrict palette, u32 * maxIndexOut);
+
+static MapPaletteIndicesKernel mapPaletteIndices = MapPaletteIndicesScalar;
+
+void InitAnvilKernels(void) {
+#ifdef CPU_X86_KERNELS
+    if (cpuFeatures.hasSse4) {
+        unpackIndicesKernels[4] = UnpackIndicesSse4;
+        unpackIndicesKernels[8] = UnpackIndicesSse8;
+    }
+    // NOTE(traks): 13+ bits per block means 4 indices per long. Compilers
+    // already vectorise the scalar kernels well for those, so there's no
+    // separate SIMD variant for them.
+    if (cpuFeatures.hasAvx2) {
+        unpackIndicesKernels[5] = UnpackIndicesAvx25;
+        unpackIndicesKernels[6] = UnpackIndicesAvx26;
+        unpackIndicesKernels[7] = UnpackIndicesAvx27;
+        unpackIndicesKernels[9] = UnpackIndicesAvx29;
+        unpackIndicesKernels[10] = UnpackIndicesAvx210;
+        unpackIndicesKernels[11] = UnpackIndicesAvx211;
+        unpackIndicesKernels[12] = UnpackIndicesAvx212;
+        mapPaletteIndices = MapPaletteIndicesAvx2;
+    }
+#endif
+}
+
 static void UnpackStoredLight(u8 * target, u8 * source) {
     for (i32 i = 0; i < 2048; i++) {
         SetSectionLight(target, 2 * i, source[i] & 0xf);
@@ -269,7 +482,10 @@ void WorldLoadChunk(Chunk * chunk, MemoryArena * scratchArena) {
     i32 numSections = sectionList.size;
 
     u32 maxPaletteEntries = 4096;
-    u16 * paletteMap = MallocInArena(scratchArena, maxPaletteEntries * sizeof (u16));
+    // NOTE(traks): padded up to the largest bits-per-block, see
+    // MapPaletteIndices
+    u32 * paletteMap = MallocInArena(scratchArena, (1 << MAX_ANVIL_BITS_PER_BLOCK) * sizeof (u32));
+    u16 * paletteIndices = MallocInArena(scratchArena, (4096 + UNPACK_PADDING) * sizeof (u16));
     u8 sectionsWithBlocks[MAX_SECTION - MIN_SECTION + 1] = {0};
 
     if (numSections > LIGHT_SECTIONS_PER_CHUNK) {
@@ -351,12 +567,13 @@ void WorldLoadChunk(Chunk * chunk, MemoryArena * scratchArena) {
                 // NOTE(traks): Block data may be missing! The code below won't
                 // work in that case, so we need some special handling.
                 u32 blockState = paletteMap[0];
-                for (i32 posIndex = 0; posIndex < 4096; posIndex++) {
-                    SectionSetBlockState(blocks, posIndex, blockState);
-                }
 
                 // TODO(traks): handle cave air and void air
                 if (blockState != 0) {
+                    *blocks = CallocSectionBlocks();
+                    for (i32 posIndex = 0; posIndex < 4096; posIndex++) {
+                        blocks->blockStates[posIndex] = blockState;
+                    }
                     section->nonAirCount = 4096;
                 }
             } else {
@@ -364,42 +581,38 @@ void WorldLoadChunk(Chunk * chunk, MemoryArena * scratchArena) {
                 // NOTE(traks): Vanilla tweaks bits-per-block in this way. Note
                 // that in chunk storage, 9+ bits per block doesn't get rounded
                 // up to the maximum number of bits per block!
-                if (bitsPerBlock < 4) {
-                    bitsPerBlock = 4;
+                if (bitsPerBlock < MIN_ANVIL_BITS_PER_BLOCK) {
+                    bitsPerBlock = MIN_ANVIL_BITS_PER_BLOCK;
                 }
+                assert(bitsPerBlock <= MAX_ANVIL_BITS_PER_BLOCK);
                 u32 blocksPerLong = 64 / bitsPerBlock;
                 u32 expectedNumberOfLongs = (4096 + blocksPerLong - 1) / blocksPerLong;
-                u32 mask = ((u32) 1 << bitsPerBlock) - 1;
-                i32 bitOffset = 0;
 
                 if (blockData.size != expectedNumberOfLongs) {
                     LogInfo("Expected %d longs, but got %d", (i32) expectedNumberOfLongs, (i32) blockData.size);
                     goto bail;
                 }
 
-                u64 entry = NbtNextU64(&blockData);
+                u32 paddedPaletteSize = (u32) 1 << bitsPerBlock;
+                memset(paletteMap + paletteSize, 0, (paddedPaletteSize - paletteSize) * sizeof *paletteMap);
 
-                for (i32 posIndex = 0; posIndex < 4096; posIndex++) {
-                    if (bitOffset > 64 - bitsPerBlock) {
-                        entry = NbtNextU64(&blockData);
-                        bitOffset = 0;
-                    }
+                BeginTimings(UnpackBlockStates);
 
-                    u32 paletteIndex = (entry >> bitOffset) & mask;
-                    bitOffset += bitsPerBlock;
+                unpackIndicesKernels[bitsPerBlock](paletteIndices, blockData.listData);
 
-                    if (paletteIndex >= paletteSize) {
-                        LogInfo("Out of bounds palette index %d >= %d in section Y %d", paletteIndex, paletteSize, (i32) sectionY);
-                        goto bail;
-                    }
+                *blocks = CallocSectionBlocks();
+                u32 maxPaletteIndex;
+                section->nonAirCount = mapPaletteIndices(blocks->blockStates, paletteIndices, paletteMap, &maxPaletteIndex);
 
-                    u32 blockState = paletteMap[paletteIndex];
-                    SectionSetBlockState(blocks, posIndex, blockState);
+                EndTimings(UnpackBlockStates);
 
-                    // TODO(traks): handle cave air and void air
-                    if (blockState != 0) {
-                        section->nonAirCount++;
-                    }
+                if (maxPaletteIndex >= paletteSize) {
+                    LogInfo("Out of bounds palette index %d >= %d in section Y %d", maxPaletteIndex, paletteSize, (i32) sectionY);
+                    goto bail;
+                }
+
+                if (section->nonAirCount == 0) {
+                    FreeAndClearSectionBlocks(blocks);
                 }
             }
         }
@@ -430,7 +643,7 @@ void WorldLoadChunk(Chunk * chunk, MemoryArena * scratchArena) {
         }
     }
 
-    ChunkRecalculateMotionBlockingHeightMap(chunk);
+    ChunkRecalculateHeightMaps(chunk);
 
     if (cursor.error) {
         LogInfo("Failed to decipher NBT data");
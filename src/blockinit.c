@@ -78,6 +78,36 @@ static void CalculateBlockLightPropagation() {
     }
 }
 
+static void CalculateHeightMapTypes() {
+    for (i32 blockState = 0; blockState < serv->actual_block_state_count; blockState++) {
+        i32 blockType = serv->block_type_by_state[blockState];
+        block_properties * props = serv->block_properties_table + blockType;
+
+        i32 isAir = (blockType == BLOCK_AIR || blockType == BLOCK_CAVE_AIR || blockType == BLOCK_VOID_AIR);
+        // NOTE(traks): Vanilla uses the block's material for this. Having a
+        // collision box is a good approximation, except for snow layers, which
+        // never block motion in vanilla
+        i32 blocksMotion = (serv->collisionModelByState[blockState] != BLOCK_MODEL_EMPTY && blockType != BLOCK_SNOW);
+        i32 hasFluid = (get_water_level(blockState) != FLUID_LEVEL_NONE || blockType == BLOCK_LAVA);
+        i32 isLeaves = (props->type_tags & ((u32) 1 << BLOCK_TAG_LEAVES)) != 0;
+
+        u32 types = 0;
+        if (!isAir) {
+            types |= (u32) 1 << HEIGHT_MAP_WORLD_SURFACE;
+        }
+        if (blocksMotion) {
+            types |= (u32) 1 << HEIGHT_MAP_OCEAN_FLOOR;
+        }
+        if (blocksMotion || hasFluid) {
+            types |= (u32) 1 << HEIGHT_MAP_MOTION_BLOCKING;
+            if (!isLeaves) {
+                types |= (u32) 1 << HEIGHT_MAP_MOTION_BLOCKING_NO_LEAVES;
+            }
+        }
+        serv->heightMapTypesByState[blockState] = types;
+    }
+}
+
 static void
 register_block_property(int id, char * name, int value_count, char * * values) {
     block_property_spec prop_spec = {0};
@@ -3206,4 +3236,5 @@ init_block_data(void) {
     LogInfo("Block state count: %d (ceillog2 = %d)", serv->vanilla_block_state_count, CeilLog2U32(serv->vanilla_block_state_count));
 
     CalculateBlockLightPropagation();
+    CalculateHeightMapTypes();
 }
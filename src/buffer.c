@@ -128,6 +128,21 @@ void WriteVarU32(Cursor * cursor, u32 value) {
     }
 }
 
+void WritePaddedVarU32(Cursor * cursor, u32 value, i32 size) {
+    if (cursor->size - cursor->index < size) {
+        cursor->error = 1;
+        cursor->index = cursor->size;
+        return;
+    }
+    u8 * data = cursor->data + cursor->index;
+    for (i32 i = 0; i < size - 1; i++) {
+        data[i] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    data[size - 1] = value;
+    cursor->index += size;
+}
+
 void WriteVarU64(Cursor * cursor, u64 value) {
     for (;;) {
         if (cursor->index == cursor->size) {
@@ -163,6 +163,9 @@ BlockPos ReadBlockPos(Cursor * cursor);
 i32 ReadBool(Cursor * cursor);
 
 void WriteVarU32(Cursor * cursor, u32 value);
+// NOTE(traks): writes a VarInt of exactly the given size, padded with empty
+// continuation bytes. The value must fit.
+void WritePaddedVarU32(Cursor * cursor, u32 value, i32 size);
 void WriteVarU64(Cursor * cursor, u64 value);
 void WriteU8(Cursor * cursor, u8 value);
 void WriteU16(Cursor * cursor, u16 value);
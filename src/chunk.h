@@ -25,6 +25,7 @@ typedef struct {
 
 #define CHUNK_ATOMIC_FINISHED_LOAD ((u32) 0x1 << 0)
 #define CHUNK_ATOMIC_LOAD_SUCCESS ((u32) 0x1 << 1)
+#define CHUNK_ATOMIC_FINISHED_LIGHT ((u32) 0x1 << 2)
 
 #define CHUNK_LOADER_REQUESTING_UPDATE ((u32) 0x1 << 0)
 #define CHUNK_LOADER_FINISHED_LOAD ((u32) 0x1 << 1)
@@ -34,18 +35,32 @@ typedef struct {
 #define CHUNK_LOADER_READY ((u32) 0x1 << 5)
 #define CHUNK_LOADER_LIT_SELF ((u32) 0x1 << 6)
 #define CHUNK_LOADER_FULLY_LIT ((u32) 0x1 << 7)
+// NOTE(traks): a worker is lighting the chunk and exchanging light with its
+// neighbours. None of the chunks in the 3x3 area around it may be touched.
+#define CHUNK_LOADER_LIGHTING ((u32) 0x1 << 8)
 
 typedef struct {
     ChunkSection sections[SECTIONS_PER_CHUNK];
     LightSection lightSections[LIGHT_SECTIONS_PER_CHUNK];
-    // @NOTE(traks) index as zx
-    i16 motion_blocking_height_map[256];
+    // @NOTE(traks) index as [type][zx], see HeightMapType
+    i16 heightMaps[HEIGHT_MAP_COUNT][256];
 
     WorldChunkPos pos;
 
+    // NOTE(traks): changes whenever the blocks or light of the chunk change.
+    // Unique across all chunks ever loaded, so it identifies the contents of
+    // the chunk. Only accessed by the main thread.
+    u64 contentVersion;
+
     i64 lastBlockChangeTick;
     u32 changedBlockSections;
 
+    // NOTE(traks): light sections changed by block updates this tick, bits
+    // indexed the same way as lightSections
+    i64 lastLightChangeTick;
+    u32 changedSkyLightSections;
+    u32 changedBlockLightSections;
+
     // @TODO(traks) allow more block entities. Possibly use an internally
     // chained hashmap for this. The question is, where do we allocate this
     // hashmap in? We may need some more general-purpose allocator. Could
@@ -143,6 +158,13 @@ Chunk * GetChunkInternal(WorldChunkPos pos);
 // It is indexed as zx
 void CollectLoadedChunks(WorldChunkPos from, WorldChunkPos to, Chunk * * chunkArray);
 i32 CollectChangedChunks(WorldChunkPos from, WorldChunkPos to, Chunk * * chunkArray);
+i32 CollectLightChangedChunks(WorldChunkPos from, WorldChunkPos to, Chunk * * chunkArray);
+// NOTE(traks): iterate over all chunks with block changes this tick, in all
+// worlds. Returns NULL for chunks that are no longer loaded.
+i32 GetChangedChunkCount(void);
+Chunk * GetChangedChunk(i32 index);
+void ChunkMarkLightChanged(Chunk * chunk, u32 skyLightSections, u32 blockLightSections);
+void ChunkMarkContentChanged(Chunk * chunk);
 
 typedef struct {
     i32 oldState;
@@ -161,6 +183,8 @@ i32 ChunkGetBlockState(Chunk * ch, BlockPos pos);
 SetBlockResult WorldSetBlockState(WorldBlockPos pos, i32 blockState);
 i32 WorldGetBlockState(WorldBlockPos pos);
 void WorldLoadChunk(Chunk * chunk, MemoryArena * scratchArena);
+// NOTE(traks): picks the SIMD kernels for the CPU, see DetectCpuFeatures
+void InitAnvilKernels(void);
 
 static inline u8 GetSectionLight(u8 * lightArray, u32 posIndex) {
     assert(posIndex <= 0xfff);
@@ -175,14 +199,51 @@ static inline void SetSectionLight(u8 * lightArray, u32 posIndex, u8 light) {
 // @NOTE(traks) assumes all light sections are present in the chunk and assumes
 // all light values are equal to 0
 void LightChunk(Chunk * ch);
-void LightChunkAndExchangeWithNeighbours(Chunk * targetChunk);
+// NOTE(traks): Must be called from the main thread. Collects the target chunks
+// and those of their neighbours that have lit themselves into a 4x4 grid. The
+// target mask is indexed like the grid, relative to the origin. Targets must
+// lie in the 2x2 area at the origin.
+void CollectLightNeighbourhood(WorldChunkPos origin, u32 targetMask, Chunk * * chunkGrid);
+// NOTE(traks): Lights all target chunks in one go, so light crossing the edges
+// between them is only propagated once. Safe to call from any thread, provided
+// no one else reads or writes the chunks in the grid in the meantime.
+void LightChunksAndExchangeWithNeighbours(Chunk * * chunkGrid, u32 targetMask);
+#ifdef LIGHT_BENCHMARK
+// NOTE(traks): accumulated over all light jobs since the last reset
+typedef struct {
+    i64 phaseStartNanos;
+    i64 setupNanos;
+    i64 skySourceNanos;
+    i64 skyOwnNanos;
+    i64 skyNeighbourNanos;
+    i64 blockSourceNanos;
+    i64 blockOwnNanos;
+    i64 blockNeighbourNanos;
+    // NOTE(traks): block states are 2 bytes, light values 1 byte
+    i64 blockAccessCount;
+    i64 lightAccessCount;
+    i32 queueHighWater;
+} LightBenchmarkStats;
+
+extern LightBenchmarkStats lightBenchmarkStats;
+
+void RunLightBenchmark(void);
+#endif
+
+// NOTE(traks): Main thread only. Relights around the blocks changed this tick
+// (and earlier changes that had to wait for nearby light jobs).
+void UpdateLighting(void);
 
-void ChunkRecalculateMotionBlockingHeightMap(Chunk * ch);
+void ChunkRecalculateHeightMaps(Chunk * ch);
+void InitHeightMapKernels(void);
 
 void InitChunkSystem(void);
 void TickChunkSystem(void);
 
 void TickChunkLoader(void);
+// NOTE(traks): whether a chunk within the given chessboard distance is being lit
+// by a worker. Main thread only.
+i32 IsNearLightJob(WorldChunkPos pos, i32 distance);
 
 SectionBlocks CallocSectionBlocks(void);
 void FreeAndClearSectionBlocks(SectionBlocks * blocks);
@@ -127,6 +127,11 @@ static ChunkHashMap chunkIndex;
 static ChunkUpdateRequestList updateRequests;
 static _Atomic i64 sectionBlocksMemoryUsage;
 static _Atomic i64 sectionLightMemoryUsage;
+// NOTE(traks): set once the background queue rejects a load during the current
+// tick, so we don't keep hammering a full queue. Chunks that couldn't start
+// loading stay in the update request list and are retried next tick.
+static i32 backgroundQueueFull;
+static i32 deferredLoadCount;
 
 // NOTE(traks): jenkins one at a time
 static inline u32 HashU64(u64 key) {
@@ -235,6 +240,21 @@ static void FreeChunk(WorldChunkPos pos) {
 
     free(chunk);
     RemoveHashEntry(entry);
+
+    // NOTE(traks): Neighbours are no longer fully lit by all their neighbours.
+    // If we ever get loaded again, we will modify their light, which a worker
+    // can't do safely if they are ready to be used by the main thread.
+    for (i32 dx = -1; dx <= 1; dx++) {
+        for (i32 dz = -1; dz <= 1; dz++) {
+            WorldChunkPos neighbourPos = pos;
+            neighbourPos.x += dx;
+            neighbourPos.z += dz;
+            Chunk * neighbour = GetChunkInternal(neighbourPos);
+            if (neighbour != NULL) {
+                neighbour->loaderFlags &= ~(CHUNK_LOADER_FULLY_LIT | CHUNK_LOADER_READY);
+            }
+        }
+    }
 }
 
 static void PushUpdateRequest(ChunkHashEntry * entry) {
@@ -381,14 +401,52 @@ static void LoadChunkAsync(void * arg) {
     atomic_fetch_or_explicit(&chunk->atomicFlags, CHUNK_ATOMIC_FINISHED_LOAD, memory_order_release);
 }
 
+typedef struct {
+    Chunk * chunkGrid[4 * 4];
+    u32 targetMask;
+} LightJob;
+
+static void LightChunkAsync(void * arg) {
+    LightJob * job = arg;
+    LightChunksAndExchangeWithNeighbours(job->chunkGrid, job->targetMask);
+    for (i32 i = 0; i < 4 * 4; i++) {
+        if (job->targetMask & ((u32) 1 << i)) {
+            atomic_fetch_or_explicit(&job->chunkGrid[i]->atomicFlags, CHUNK_ATOMIC_FINISHED_LIGHT, memory_order_release);
+        }
+    }
+    free(job);
+}
+
+i32 IsNearLightJob(WorldChunkPos pos, i32 distance) {
+    for (i32 dx = -distance; dx <= distance; dx++) {
+        for (i32 dz = -distance; dz <= distance; dz++) {
+            WorldChunkPos otherPos = pos;
+            otherPos.x += dx;
+            otherPos.z += dz;
+            Chunk * other = GetChunkInternal(otherPos);
+            if (other != NULL && (other->loaderFlags & CHUNK_LOADER_LIGHTING)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static i32 NeedsLight(Chunk * chunk) {
+    i32 hasInterest = (chunk->interestCount > 0 || chunk->neighbourInterestCount > 0);
+    return hasInterest && (chunk->loaderFlags & CHUNK_LOADER_LOAD_SUCCESS) && !(chunk->loaderFlags & (CHUNK_LOADER_LIT_SELF | CHUNK_LOADER_LIGHTING));
+}
+
 static void UpdateChunk(ChunkHashEntry * entry) {
     Chunk * chunk = entry->chunk;
     if (chunk->interestCount == 0 && chunk->neighbourInterestCount == 0) {
         // TODO(traks): might want to keep the entry around for a little while
         // instead of aggressively unloading
         i32 chunkLoading = (chunk->loaderFlags & CHUNK_LOADER_STARTED_LOAD) && !(chunk->loaderFlags & CHUNK_LOADER_FINISHED_LOAD);
+        // NOTE(traks): a light job may be reading or writing our data
+        i32 chunkInUse = chunkLoading || IsNearLightJob(chunk->pos, 1);
 
-        if (!chunkLoading) {
+        if (!chunkInUse) {
             FreeChunk(UnpackWorldChunkPos(entry->packedPos));
             return;
         }
@@ -398,8 +456,14 @@ static void UpdateChunk(ChunkHashEntry * entry) {
     }
 
     if ((chunk->interestCount > 0 || chunk->neighbourInterestCount > 0) && !(chunk->loaderFlags & CHUNK_LOADER_STARTED_LOAD)) {
-        chunk->loaderFlags |= CHUNK_LOADER_STARTED_LOAD;
-        PushTaskToQueue(serv->backgroundQueue, LoadChunkAsync, chunk);
+        if (!backgroundQueueFull && PushTaskToQueue(serv->backgroundQueue, LoadChunkAsync, chunk)) {
+            chunk->loaderFlags |= CHUNK_LOADER_STARTED_LOAD;
+        } else {
+            // NOTE(traks): workers can't keep up, try again next tick
+            backgroundQueueFull = 1;
+            deferredLoadCount++;
+            PushUpdateRequest(entry);
+        }
     }
 
     if ((chunk->loaderFlags & CHUNK_LOADER_STARTED_LOAD) && !(chunk->loaderFlags & CHUNK_LOADER_FINISHED_LOAD)) {
@@ -418,8 +482,80 @@ static void UpdateChunk(ChunkHashEntry * entry) {
         }
     }
 
-    if ((chunk->loaderFlags & CHUNK_LOADER_LOAD_SUCCESS) && !(chunk->loaderFlags & CHUNK_LOADER_LIT_SELF)) {
-        LightChunkAndExchangeWithNeighbours(chunk);
+    if (NeedsLight(chunk)) {
+        // NOTE(traks): Light chunks in aligned 2x2 batches, so the light
+        // crossing the edges between them is only propagated once. Wait for
+        // the other chunks in the batch that are going to be loaded. Don't
+        // wait for chunks no one is interested in yet though. Players add
+        // interest a couple of chunks per tick, so that could take a while.
+        WorldChunkPos origin = chunk->pos;
+        origin.x &= ~1;
+        origin.z &= ~1;
+        u32 targetMask = 0;
+        i32 waitForBatch = 0;
+        i32 nearLightJob = 0;
+        for (i32 dz = 0; dz <= 1; dz++) {
+            for (i32 dx = 0; dx <= 1; dx++) {
+                WorldChunkPos otherPos = origin;
+                otherPos.x += dx;
+                otherPos.z += dz;
+                Chunk * other = GetChunkInternal(otherPos);
+                if (other == NULL) {
+                    continue;
+                }
+                if (NeedsLight(other)) {
+                    targetMask |= (u32) 1 << ((dz << 2) | dx);
+                    // NOTE(traks): Light jobs modify the light of all chunks
+                    // next to the chunks being lit, so the chunks of different
+                    // light jobs must be at least 3 chunks apart to not overlap.
+                    nearLightJob |= IsNearLightJob(otherPos, 2);
+                } else if ((other->interestCount > 0 || other->neighbourInterestCount > 0) && !(other->loaderFlags & CHUNK_LOADER_FINISHED_LOAD)) {
+                    waitForBatch = 1;
+                }
+            }
+        }
+
+        if (waitForBatch || nearLightJob) {
+            PushUpdateRequest(entry);
+        } else {
+            LightJob * job = malloc(sizeof *job);
+            job->targetMask = targetMask;
+            // NOTE(traks): Take the snapshot of the neighbourhood now. The
+            // neighbours in it can't be lit, unloaded or modified until we're
+            // done, because they aren't ready yet and we're lighting.
+            CollectLightNeighbourhood(origin, targetMask, job->chunkGrid);
+            // NOTE(traks): the job may be done and freed as soon as we push it
+            Chunk * chunkGrid[4 * 4];
+            memcpy(chunkGrid, job->chunkGrid, sizeof chunkGrid);
+            if (!backgroundQueueFull && PushTaskToQueue(serv->backgroundQueue, LightChunkAsync, job)) {
+                for (i32 i = 0; i < 4 * 4; i++) {
+                    if (targetMask & ((u32) 1 << i)) {
+                        Chunk * target = chunkGrid[i];
+                        target->loaderFlags |= CHUNK_LOADER_LIGHTING;
+                        // NOTE(traks): make sure the other targets poll for
+                        // the results too
+                        PackedWorldChunkPos packedTargetPos = PackWorldChunkPos(target->pos);
+                        PushUpdateRequest(FindChunkHashEntryOrEmpty(packedTargetPos, HashWorldChunkPos(packedTargetPos)));
+                    }
+                }
+            } else {
+                free(job);
+                backgroundQueueFull = 1;
+                PushUpdateRequest(entry);
+            }
+        }
+    }
+
+    if (chunk->loaderFlags & CHUNK_LOADER_LIGHTING) {
+        u32 atomicFlags = atomic_load_explicit(&chunk->atomicFlags, memory_order_acquire);
+        if (!(atomicFlags & CHUNK_ATOMIC_FINISHED_LIGHT)) {
+            // NOTE(traks): not yet lit, poll again later
+            PushUpdateRequest(entry);
+            return;
+        }
+
+        // NOTE(traks): publish the results of the light job
+        chunk->loaderFlags &= ~CHUNK_LOADER_LIGHTING;
         chunk->loaderFlags |= CHUNK_LOADER_LIT_SELF;
         // NOTE(traks): Update neighbours and the chunk itself, to check if
         // any are fully ready (fully lit by all neighbours)
@@ -459,28 +595,37 @@ checkNeighboursLitEnd:
             // TODO(traks): Should we be marking chunks with no interest (only
             // neighbour interest) also as ready?
             chunk->loaderFlags |= CHUNK_LOADER_READY;
+            // NOTE(traks): light may have changed while the chunk wasn't ready
+            ChunkMarkContentChanged(chunk);
         }
     }
 }
 
 void TickChunkLoader(void) {
-    i32 maxRemainingChunkUpdates = 64;
-    while (updateRequests.useCount > 0 && maxRemainingChunkUpdates > 0) {
+    backgroundQueueFull = 0;
+    // NOTE(traks): Chunk updates are cheap now that loading and lighting
+    // happen on the worker threads. Still limit the number of updates, because
+    // chunks waiting for workers requeue themselves.
+    i32 maxRemainingChunkUpdates = MIN(updateRequests.useCount, 1024);
+    while (maxRemainingChunkUpdates > 0) {
         ChunkHashEntry * entry = PopUpdateRequest();
         UpdateChunk(entry);
         maxRemainingChunkUpdates--;
-
-        // TODO(traks): Not ideal, but currently we need this because lighting
-        // chunks is very laggy
-        if (NanoTime() >= serv->currentTickStartNanos + 40000000LL) {
-            break;
-        }
     }
 
     if ((serv->current_tick % (10 * 20)) == 0) {
         i64 blocksMemory = atomic_load_explicit(&sectionBlocksMemoryUsage, memory_order_relaxed);
         i64 lightMemory = atomic_load_explicit(&sectionLightMemoryUsage, memory_order_relaxed);
         LogInfo("Section memory usage: %.0fMB (blocks), %.0fMB (light)", blocksMemory / 1000000.0, lightMemory / 1000000.0);
+
+        TaskQueueStats queueStats = GetTaskQueueStats(serv->backgroundQueue);
+        LogInfo("Background queue: %d/%d tasks, %llu push failures, oldest waiting %.1fms, max wait %.1fms, %d loads deferred",
+                queueStats.depth, queueStats.capacity,
+                (unsigned long long) queueStats.pushFailures,
+                queueStats.oldestWaitNanos / 1000000.0,
+                queueStats.maxWaitNanos / 1000000.0,
+                deferredLoadCount);
+        deferredLoadCount = 0;
     }
 }
 
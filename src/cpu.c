@@ -0,0 +1,46 @@
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <cpuid.h>
+#endif
+
+CpuFeatures cpuFeatures;
+
+void DetectCpuFeatures(void) {
+    CpuFeatures res = {0};
+
+#ifdef CPU_X86_KERNELS
+    u32 eax, ebx, ecx, edx;
+    if (__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+        memcpy(res.vendor, &ebx, 4);
+        memcpy(res.vendor + 4, &edx, 4);
+        memcpy(res.vendor + 8, &ecx, 4);
+    }
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        res.family = (eax >> 8) & 0xf;
+        res.model = (eax >> 4) & 0xf;
+        if (res.family == 0xf) {
+            res.family += (eax >> 20) & 0xff;
+        }
+        if (res.family >= 0x6) {
+            res.model |= ((eax >> 16) & 0xf) << 4;
+        }
+    }
+
+    // NOTE(traks): these also check whether the OS saves the YMM registers
+    __builtin_cpu_init();
+    res.hasSse4 = __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+    res.hasAvx2 = !!__builtin_cpu_supports("avx2");
+    res.hasBmi2 = !!__builtin_cpu_supports("bmi2");
+
+    i32 isAmd = strcmp(res.vendor, "AuthenticAMD") == 0 || strcmp(res.vendor, "HygonGenuine") == 0;
+    // NOTE(traks): Zen 3 is family 0x19
+    res.hasFastPext = res.hasBmi2 && (!isAmd || res.family >= 0x19);
+#endif
+
+    cpuFeatures = res;
+
+    LogInfo("CPU %s family 0x%x model 0x%x: sse4 %d, avx2 %d, bmi2 %d, fast pext %d",
+            res.vendor[0] ? res.vendor : "unknown", res.family, res.model,
+            res.hasSse4, res.hasAvx2, res.hasBmi2, res.hasFastPext);
+}
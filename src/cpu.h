@@ -0,0 +1,34 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "base.h"
+
+// NOTE(traks): SIMD kernels are compiled with target attributes instead of
+// relying on -march, so a portable build still contains them. Which kernels we
+// actually use is decided at startup based on the CPU we're running on.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CPU_X86_KERNELS
+#define TARGET_SSE4 __attribute__ ((target ("ssse3,sse4.1")))
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#define TARGET_BMI2 __attribute__ ((target ("bmi2")))
+#endif
+
+typedef struct {
+    char vendor[13];
+    i32 family;
+    i32 model;
+    // NOTE(traks): SSSE3 and SSE4.1 together
+    i32 hasSse4;
+    i32 hasAvx2;
+    i32 hasBmi2;
+    // NOTE(traks): pext is microcoded on AMD before Zen 3 and takes hundreds
+    // of cycles, even though BMI2 is reported as supported
+    i32 hasFastPext;
+} CpuFeatures;
+
+extern CpuFeatures cpuFeatures;
+
+// NOTE(traks): call once at startup, before anything that selects kernels
+void DetectCpuFeatures(void);
+
+#endif
@@ -1,17 +1,34 @@
-#include <immintrin.h>
+#include <stdlib.h>
 #include "shared.h"
 #include "chunk.h"
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 // NOTE(traks): Add a couple of extra entries because we may need 1 (or so) more
 // entry to ensure the tail and head aren't at the same position if the queue is
 // full.
-// TODO(traks): I doubt we're ever going to have all blocks in the 9 chunks
+// TODO(traks): I doubt we're ever going to have all blocks in the 16 chunks
 // enqueued. Is there some better theoretical limit? Another problem currently
 // is that blocks can be enqueued multiple times (can the limit ever be
 // exceeded?).
-#define LIGHT_QUEUE_SIZE (9 * 16 * 16 * 16 * LIGHT_SECTIONS_PER_CHUNK + 8)
-
-// #define MEASURE_BANDWIDTH
+#define LIGHT_QUEUE_SIZE (4 * 4 * 16 * 16 * 16 * LIGHT_SECTIONS_PER_CHUNK + 8)
+
+#ifdef LIGHT_BENCHMARK
+LightBenchmarkStats lightBenchmarkStats;
+
+// NOTE(traks): attributes the time since the end of the previous phase to the
+// given phase
+#define EndBenchmarkPhase(field) do { \
+    i64 phaseEnd = NanoTime(); \
+    lightBenchmarkStats.field += phaseEnd - lightBenchmarkStats.phaseStartNanos; \
+    lightBenchmarkStats.phaseStartNanos = phaseEnd; \
+} while (0)
+#else
+#define EndBenchmarkPhase(field)
+#endif
 
 typedef struct {
     // NOTE(traks): Holds the position we want to propagate further from. It is
@@ -25,10 +42,19 @@ typedef struct {
     // NOTE(traks): contains which positions to propagate from
     LightQueueEntry * entries;
     i32 writeIndex;
+    // NOTE(traks): positions whose light got cleared, and which may have
+    // spread light to their neighbours. Only used for incremental updates.
+    LightQueueEntry * removalEntries;
+    i32 removalWriteIndex;
+    i32 isSkyLight;
     // NOTE(traks): index as yzx
     u8 * lightSections[4 * 4 * 32];
     SectionBlocks blockSections[4 * 4 * 32];
-#ifdef MEASURE_BANDWIDTH
+    // NOTE(traks): what light sections point to outside the loaded area
+    u8 * sectionFullLight;
+    // NOTE(traks): index as zx, bits are light section indices
+    u32 changedSections[4 * 4];
+#ifdef LIGHT_BENCHMARK
     i64 blockAccessCount;
     i64 lightAccessCount;
 #endif
@@ -51,29 +77,46 @@ static inline i32 XYZToSectionIndex(i32 x, i32 y, i32 z) {
 }
 
 static inline i32 PosToSectionIndex(u32 pos) {
-    // TODO(traks): apparently very slow on Zen 2, perhaps detect the CPU
-    // version and flags or something at runtime and switch implementations
-    // based on that
-#ifdef __BMI2__
-    i32 res = _pext_u32(pos, 0x01f03030);
-#else
     i32 res = ((pos & 0x1f00000) >> 16) | ((pos & 0x3000) >> 10) | ((pos & 0x30) >> 4);
-#endif
     return res;
 }
 
 static inline i32 PosToSectionPosIndex(u32 pos) {
-    // TODO(traks): apparently very slow on Zen 2, perhaps detect the CPU
-    // version and flags or something at runtime and switch implementations
-    // based on that
-#ifdef __BMI2__
-    i32 res = _pext_u32(pos, 0x000f0f0f);
-#else
     i32 res = ((pos & 0xf0000) >> 8) | ((pos & 0xf00) >> 4) | (pos & 0xf);
-#endif
     return res;
 }
 
+#ifdef CPU_X86_KERNELS
+
+// NOTE(traks): Slightly faster than the shifts and masks above if pext is fast
+// on the CPU. It's very slow on Zen 1 and 2 though, see cpuFeatures.hasFastPext
+TARGET_BMI2 static inline i32 PosToSectionIndexPext(u32 pos) {
+    i32 res = _pext_u32(pos, 0x01f03030);
+    return res;
+}
+
+TARGET_BMI2 static inline i32 PosToSectionPosIndexPext(u32 pos) {
+    i32 res = _pext_u32(pos, 0x000f0f0f);
+    return res;
+}
+
+#endif
+
+// NOTE(traks): usePext should be a constant, so the branch disappears after
+// inlining
+__attribute__ ((always_inline))
+static inline void DecodePos(u32 pos, i32 usePext, i32 * sectionIndex, i32 * posIndex) {
+#ifdef CPU_X86_KERNELS
+    if (usePext) {
+        *sectionIndex = PosToSectionIndexPext(pos);
+        *posIndex = PosToSectionPosIndexPext(pos);
+        return;
+    }
+#endif
+    *sectionIndex = PosToSectionIndex(pos);
+    *posIndex = PosToSectionPosIndex(pos);
+}
+
 static inline i32 PosToX(u32 pos) {
     return pos & 0x3f;
 }
@@ -91,8 +134,23 @@ static inline LightQueueEntry PackEntry(u32 pos) {
     return res;
 }
 
+// NOTE(traks): removal entries keep the light value the position had before
+// it was cleared in the top 4 bits, which are unused by positions
+static inline LightQueueEntry PackRemovalEntry(u32 pos, i32 value) {
+    LightQueueEntry res = {.data = pos | ((u32) value << 28)};
+    return res;
+}
+
 static inline u32 GetEntryPos(LightQueueEntry entry) {
-    return entry.data;
+    return entry.data & 0x0fffffff;
+}
+
+static inline i32 GetEntryValue(LightQueueEntry entry) {
+    return entry.data >> 28;
+}
+
+static inline void MarkSectionChanged(LightQueue * queue, i32 sectionIndex) {
+    queue->changedSections[sectionIndex & 0xf] |= (u32) 1 << (sectionIndex >> 4);
 }
 
 static inline void LightQueuePush(LightQueue * queue, LightQueueEntry entry) {
@@ -108,13 +166,27 @@ static inline void LightQueuePush(LightQueue * queue, LightQueueEntry entry) {
     queue->writeIndex++;
 }
 
+static inline void LightQueuePushRemoval(LightQueue * queue, LightQueueEntry entry) {
+    i32 writeIndex = queue->removalWriteIndex;
+    if (writeIndex >= LIGHT_QUEUE_SIZE) {
+        // NOTE(traks): every position is cleared at most once, so this should
+        // be impossible
+        assert(0);
+        return;
+    }
+    queue->removalEntries[writeIndex] = entry;
+    queue->removalWriteIndex++;
+}
+
 // NOTE(traks): update a neighbour's light and push the neighbour to the
 // queue if further propagation is necessary
-static inline void PropagateLight(LightQueue * queue, u32 toPos, i32 dir, i32 fromState, i32 fromValue, i32 lightReduction) {
-    i32 sectionIndex = PosToSectionIndex(toPos);
-    i32 posIndex = PosToSectionPosIndex(toPos);
+__attribute__ ((always_inline))
+static inline void PropagateLight(LightQueue * queue, u32 toPos, i32 dir, i32 fromState, i32 fromValue, i32 lightReduction, i32 usePext) {
+    i32 sectionIndex;
+    i32 posIndex;
+    DecodePos(toPos, usePext, &sectionIndex, &posIndex);
     i32 storedValue = GetSectionLight(queue->lightSections[sectionIndex], posIndex);
-#ifdef MEASURE_BANDWIDTH
+#ifdef LIGHT_BENCHMARK
     queue->lightAccessCount++;
 #endif
     i32 spreadValue = fromValue - lightReduction;
@@ -129,7 +201,7 @@ static inline void PropagateLight(LightQueue * queue, u32 toPos, i32 dir, i32 fr
     i32 toState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
     i32 reductionOfState = serv->lightReductionByState[toState];
     spreadValue = fromValue - MAX(lightReduction, reductionOfState);
-#ifdef MEASURE_BANDWIDTH
+#ifdef LIGHT_BENCHMARK
     queue->blockAccessCount++;
 #endif
 
@@ -142,6 +214,7 @@ static inline void PropagateLight(LightQueue * queue, u32 toPos, i32 dir, i32 fr
     }
 
     SetSectionLight(queue->lightSections[sectionIndex], posIndex, spreadValue);
+    MarkSectionChanged(queue, sectionIndex);
 
     LightQueuePush(queue, PackEntry(toPos));
 }
@@ -151,14 +224,31 @@ static i32 GetNeighbourIndex(i32 dx, i32 dz) {
     return res;
 }
 
-static void PropagateLightFromNeighbour(LightQueue * queue, Chunk * * chunkGrid, i32 baseX, i32 baseZ, i32 addX, i32 addZ, i32 chunkDx, i32 chunkDz, i32 chunkDir) {
-    Chunk * from = chunkGrid[GetNeighbourIndex(chunkDx, chunkDz)];
+static i32 GridIndexToBaseX(i32 gridIndex) {
+    return (gridIndex & 0x3) << 4;
+}
+
+static i32 GridIndexToBaseZ(i32 gridIndex) {
+    return (gridIndex & 0xc) << 2;
+}
+
+// NOTE(traks): Spreads the light along the edge of a neighbouring chunk into
+// the target chunk at the given grid index
+static void PropagateLightFromNeighbour(LightQueue * queue, Chunk * * chunkGrid, i32 gridIndex, i32 chunkDx, i32 chunkDz, i32 chunkDir) {
+    i32 targetX = gridIndex & 0x3;
+    i32 targetZ = gridIndex >> 2;
+    Chunk * from = chunkGrid[GetNeighbourIndex(targetX + chunkDx, targetZ + chunkDz)];
     if (from == NULL) {
         // NOTE(traks): null chunks have max sky light to prevent propagating
         // into it. Don't propagate that max light out of it!
         return;
     }
 
+    i32 baseX = GridIndexToBaseX(gridIndex) + (chunkDx < 0 ? -1 : chunkDx * 16);
+    i32 baseZ = GridIndexToBaseZ(gridIndex) + (chunkDz < 0 ? -1 : chunkDz * 16);
+    i32 addX = (chunkDx == 0);
+    i32 addZ = (chunkDz == 0);
+
     i32 startY = LIGHT_SECTIONS_PER_CHUNK * 16 - 1;
     for (i32 y = startY; y >= 0; y--) {
         i32 x = baseX;
@@ -168,54 +258,207 @@ static void PropagateLightFromNeighbour(LightQueue * queue, Chunk * * chunkGrid,
             i32 posIndex = ((y & 0xf) << 8) | ((z & 0xf) << 4) | (x & 0xf);
             i32 value = GetSectionLight(queue->lightSections[sectionIndex], posIndex);
             i32 fromState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
+#ifdef LIGHT_BENCHMARK
+            queue->blockAccessCount++;
+            queue->lightAccessCount++;
+#endif
             u32 toPos = PosFromXYZ(x - chunkDx, y, z - chunkDz);
-            PropagateLight(queue, toPos, get_opposite_direction(chunkDir), fromState, value, 1);
+            PropagateLight(queue, toPos, get_opposite_direction(chunkDir), fromState, value, 1, 0);
             x += addX;
             z += addZ;
         }
     }
 }
 
-static void PropagateMaxSkyLightDown(LightQueue * queue) {
-    for (i32 z = 0; z < 16; z++) {
-        for (i32 x = 0; x < 16; x++) {
-            i32 fromState = 0;
-            for (i32 y = 16 * LIGHT_SECTIONS_PER_CHUNK - 1; y >= 0; y--) {
-                i32 sectionIndex = XYZToSectionIndex(x, y, z);
-                i32 posIndex = ((y & 0xf) << 8) | ((z & 0xf) << 4) | (x & 0xf);
-                i32 toState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
-#ifdef MEASURE_BANDWIDTH
-                queue->blockAccessCount++;
+// NOTE(traks): Light already spreads freely between the target chunks, so only
+// exchange light across the edges with the other chunks
+static void PropagateLightFromNeighbours(LightQueue * queue, Chunk * * chunkGrid, u32 targetMask) {
+    for (i32 gridIndex = 0; gridIndex < 4 * 4; gridIndex++) {
+        if (!(targetMask & ((u32) 1 << gridIndex))) {
+            continue;
+        }
+        i32 targetX = gridIndex & 0x3;
+        i32 targetZ = gridIndex >> 2;
+        i32 offsets[4][3] = {
+            {-1, 0, DIRECTION_NEG_X},
+            {1, 0, DIRECTION_POS_X},
+            {0, -1, DIRECTION_NEG_Z},
+            {0, 1, DIRECTION_POS_Z},
+        };
+        for (i32 i = 0; i < 4; i++) {
+            i32 neighbourIndex = GetNeighbourIndex(targetX + offsets[i][0], targetZ + offsets[i][1]);
+            if (targetMask & ((u32) 1 << neighbourIndex)) {
+                continue;
+            }
+            PropagateLightFromNeighbour(queue, chunkGrid, gridIndex, offsets[i][0], offsets[i][1], offsets[i][2]);
+        }
+    }
+}
+
+// NOTE(traks): Finds the lowest y such that the neighbouring column at x, z has
+// max sky light from there all the way to the top. Since the neighbour lit
+// itself already, this tells us below which height we may need to spread light
+// into it.
+static i32 FindNeighbourMaxSkyLightBottom(LightQueue * queue, i32 x, i32 z) {
+    i32 topY = 16 * LIGHT_SECTIONS_PER_CHUNK - 1;
+    if (queue->lightSections[XYZToSectionIndex(x, topY, z)] == queue->sectionFullLight) {
+        // NOTE(traks): not lit, don't propagate into it
+        return 0;
+    }
+
+    i32 res = topY + 1;
+    for (i32 y = topY; y >= 0; y--) {
+        i32 sectionIndex = XYZToSectionIndex(x, y, z);
+        i32 posIndex = ((y & 0xf) << 8) | ((z & 0xf) << 4) | (x & 0xf);
+#ifdef LIGHT_BENCHMARK
+        queue->lightAccessCount++;
 #endif
-                i32 reductionOfState = serv->lightReductionByState[toState];
-                if (reductionOfState > 0) {
-                    break;
-                }
-                if (!FindLightCanPropagate(fromState, toState, DIRECTION_NEG_Y)) {
-                    break;
-                }
+        if (GetSectionLight(queue->lightSections[sectionIndex], posIndex) != 15) {
+            break;
+        }
+        res = y;
+    }
+    return res;
+}
+
+// NOTE(traks): Sets max sky light for all blocks that can see the sky straight
+// up. Instead of going through every block of every column, we use the height
+// map to skip over the air at the top of each column. Only the blocks below
+// the height map need to be checked one by one. This also works well for
+// Skygrid maps, because most of the columns don't contain a single block.
+//
+// The light values are then written a layer at a time, with full sections
+// filled in one go. Finally, only the blocks that have a neighbour without max
+// sky light are pushed to the queue, rather than every block with max sky
+// light, see PushMaxSkyLightEdges. Other blocks can't spread light anywhere.
+//
+// Stores the lowest y with max sky light per column in bottoms, or topY + 1
+// if there is none.
+static void PropagateMaxSkyLightDown(LightQueue * queue, Chunk * chunk, i32 gridIndex, i16 * bottoms) {
+    i32 topY = 16 * LIGHT_SECTIONS_PER_CHUNK - 1;
+    i32 baseX = GridIndexToBaseX(gridIndex);
+    i32 baseZ = GridIndexToBaseZ(gridIndex);
+    i32 minBottom = topY + 1;
+    i32 maxBottom = 0;
+
+    for (i32 zx = 0; zx < 256; zx++) {
+        i32 x = zx & 0xf;
+        i32 z = zx >> 4;
+        // NOTE(traks): everything at or above the world surface height map is
+        // some kind of air. Air doesn't block sky light
+        i32 airStartY = chunk->heightMaps[HEIGHT_MAP_WORLD_SURFACE][zx] - MIN_WORLD_Y + 16;
+        i32 fromState = 0;
+        if (airStartY <= topY) {
+            i32 posIndex = ((airStartY & 0xf) << 8) | zx;
+            fromState = SectionGetBlockState(&queue->blockSections[XYZToSectionIndex(baseX + x, airStartY, baseZ + z)], posIndex);
+        }
+
+        i32 bottom = airStartY;
+        for (i32 y = airStartY - 1; y >= 0; y--) {
+            i32 sectionIndex = XYZToSectionIndex(baseX + x, y, baseZ + z);
+            i32 posIndex = ((y & 0xf) << 8) | zx;
+            i32 toState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
+#ifdef LIGHT_BENCHMARK
+            queue->blockAccessCount++;
+#endif
+            i32 reductionOfState = serv->lightReductionByState[toState];
+            if (reductionOfState > 0) {
+                break;
+            }
+            if (!FindLightCanPropagate(fromState, toState, DIRECTION_NEG_Y)) {
+                break;
+            }
+            bottom = y;
+            fromState = toState;
+        }
+
+        bottoms[zx] = bottom;
+        minBottom = MIN(minBottom, bottom);
+        maxBottom = MAX(maxBottom, bottom);
+    }
+
+    // NOTE(traks): write the light values top down, a layer at a time
+    for (i32 sectionY = LIGHT_SECTIONS_PER_CHUNK - 1; sectionY >= 0; sectionY--) {
+        i32 sectionMinY = sectionY << 4;
+        if (minBottom > sectionMinY + 15) {
+            // NOTE(traks): no sky light in this section and below
+            break;
+        }
+
+        u8 * lightArray = queue->lightSections[(sectionY << 4) | gridIndex];
+#ifdef LIGHT_BENCHMARK
+        queue->lightAccessCount += 4096;
+#endif
+        if (maxBottom <= sectionMinY) {
+            memset(lightArray, 15, 4096);
+            continue;
+        }
 
-                SetSectionLight(queue->lightSections[sectionIndex], posIndex, 15);
-                u32 toPos = PosFromXYZ(x, y, z);
-                LightQueuePush(queue, PackEntry(toPos));
-                fromState = toState;
+        for (i32 y = sectionMinY; y < sectionMinY + 16; y++) {
+            u8 * layer = lightArray + ((y & 0xf) << 8);
+            for (i32 zx = 0; zx < 256; zx++) {
+                layer[zx] = (bottoms[zx] <= y ? 15 : 0);
             }
         }
     }
 }
 
-static void PropagateLightFully(LightQueue * queue) {
+// NOTE(traks): Pushes the blocks with max sky light that have a neighbour
+// without max sky light. All target chunks should have gone through
+// PropagateMaxSkyLightDown first, so we know where their columns end.
+static void PushMaxSkyLightEdges(LightQueue * queue, i32 gridIndex, i16 * bottoms) {
+    i32 topY = 16 * LIGHT_SECTIONS_PER_CHUNK - 1;
+    i32 baseX = GridIndexToBaseX(gridIndex);
+    i32 baseZ = GridIndexToBaseZ(gridIndex);
+
+    // NOTE(traks): height from which neighbouring columns in neighbouring
+    // chunks have max sky light, indexed by the coordinate along the edge
+    i16 edgeBottoms[4][16];
+    for (i32 i = 0; i < 16; i++) {
+        edgeBottoms[0][i] = FindNeighbourMaxSkyLightBottom(queue, baseX - 1, baseZ + i);
+        edgeBottoms[1][i] = FindNeighbourMaxSkyLightBottom(queue, baseX + 16, baseZ + i);
+        edgeBottoms[2][i] = FindNeighbourMaxSkyLightBottom(queue, baseX + i, baseZ - 1);
+        edgeBottoms[3][i] = FindNeighbourMaxSkyLightBottom(queue, baseX + i, baseZ + 16);
+    }
+
+    for (i32 zx = 0; zx < 256; zx++) {
+        i32 x = zx & 0xf;
+        i32 z = zx >> 4;
+        i32 bottom = bottoms[zx];
+        if (bottom > topY) {
+            continue;
+        }
+
+        // NOTE(traks): Blocks below the highest neighbouring bottom have a
+        // neighbour without max sky light. The bottom block itself always
+        // needs to spread light down.
+        i32 pushEndY = bottom + 1;
+        pushEndY = MAX(pushEndY, x > 0 ? bottoms[zx - 1] : edgeBottoms[0][z]);
+        pushEndY = MAX(pushEndY, x < 15 ? bottoms[zx + 1] : edgeBottoms[1][z]);
+        pushEndY = MAX(pushEndY, z > 0 ? bottoms[zx - 16] : edgeBottoms[2][x]);
+        pushEndY = MAX(pushEndY, z < 15 ? bottoms[zx + 16] : edgeBottoms[3][x]);
+        pushEndY = MIN(pushEndY, topY + 1);
+
+        for (i32 y = bottom; y < pushEndY; y++) {
+            LightQueuePush(queue, PackEntry(PosFromXYZ(baseX + x, y, baseZ + z)));
+        }
+    }
+}
+
+__attribute__ ((always_inline))
+static inline void PropagateLightFullyWith(LightQueue * queue, i32 usePext) {
     i32 readIndex = 0;
     while (readIndex < queue->writeIndex) {
         LightQueueEntry entry = queue->entries[readIndex];
         readIndex++;
 
         u32 fromPos = GetEntryPos(entry);
-        i32 sectionIndex = PosToSectionIndex(fromPos);
-        i32 posIndex = PosToSectionPosIndex(fromPos);
+        i32 sectionIndex;
+        i32 posIndex;
+        DecodePos(fromPos, usePext, &sectionIndex, &posIndex);
         i32 fromState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
         i32 value = GetSectionLight(queue->lightSections[sectionIndex], posIndex);
-#ifdef MEASURE_BANDWIDTH
+#ifdef LIGHT_BENCHMARK
         queue->blockAccessCount++;
         queue->lightAccessCount++;
 #endif
@@ -223,144 +466,172 @@ static void PropagateLightFully(LightQueue * queue) {
         // TODO(traks): The order in which we propagate light may be important
         // for performance. It shouldn't depend on whatever the order of the
         // direction enum is.
-        i32 shift[] = {-0x10000, 0x10000, -0x100, 0x100, -0x1, 0x1};
-        PropagateLight(queue, fromPos - 0x10000, DIRECTION_NEG_Y, fromState, value, 1);
-        PropagateLight(queue, fromPos + 0x10000, DIRECTION_POS_Y, fromState, value, 1);
-        PropagateLight(queue, fromPos - 0x100, DIRECTION_NEG_Z, fromState, value, 1);
-        PropagateLight(queue, fromPos + 0x100, DIRECTION_POS_Z, fromState, value, 1);
-        PropagateLight(queue, fromPos - 0x1, DIRECTION_NEG_X, fromState, value, 1);
-        PropagateLight(queue, fromPos + 0x1, DIRECTION_POS_X, fromState, value, 1);
+        PropagateLight(queue, fromPos - 0x10000, DIRECTION_NEG_Y, fromState, value, 1, usePext);
+        PropagateLight(queue, fromPos + 0x10000, DIRECTION_POS_Y, fromState, value, 1, usePext);
+        PropagateLight(queue, fromPos - 0x100, DIRECTION_NEG_Z, fromState, value, 1, usePext);
+        PropagateLight(queue, fromPos + 0x100, DIRECTION_POS_Z, fromState, value, 1, usePext);
+        PropagateLight(queue, fromPos - 0x1, DIRECTION_NEG_X, fromState, value, 1, usePext);
+        PropagateLight(queue, fromPos + 0x1, DIRECTION_POS_X, fromState, value, 1, usePext);
     }
 
+#ifdef LIGHT_BENCHMARK
+    lightBenchmarkStats.queueHighWater = MAX(lightBenchmarkStats.queueHighWater, queue->writeIndex);
+#endif
+
     // NOTE(traks): reset write index for the next round
     queue->writeIndex = 0;
 }
 
-static void DoSkyLight(LightQueue * queue, Chunk * * chunkGrid) {
-    BeginTimings(InitSkyLightReferences);
+// NOTE(traks): Only the main propagation loop is compiled for both position
+// decoders. Everywhere else the shifts and masks are fine.
+static void PropagateLightFullyScalar(LightQueue * queue) {
+    PropagateLightFullyWith(queue, 0);
+}
+
+#ifdef CPU_X86_KERNELS
+TARGET_BMI2 static void PropagateLightFullyPext(LightQueue * queue) {
+    PropagateLightFullyWith(queue, 1);
+}
+#endif
 
+static void PropagateLightFully(LightQueue * queue) {
+#ifdef CPU_X86_KERNELS
+    if (cpuFeatures.hasFastPext) {
+        PropagateLightFullyPext(queue);
+        return;
+    }
+#endif
+    PropagateLightFullyScalar(queue);
+}
+
+static void SetLightSectionReferences(LightQueue * queue, Chunk * * chunkGrid, i32 skyLight) {
     for (i32 zx = 0; zx < 16; zx++) {
         Chunk * chunk = chunkGrid[zx];
         if (chunk == NULL) {
             continue;
         }
         for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
-            queue->lightSections[(sectionIndex << 4) | zx] = chunk->lightSections[sectionIndex].skyLight;
+            LightSection * section = chunk->lightSections + sectionIndex;
+            queue->lightSections[(sectionIndex << 4) | zx] = skyLight ? section->skyLight : section->blockLight;
         }
     }
+    queue->isSkyLight = skyLight;
+}
 
+static void DoSkyLight(LightQueue * queue, Chunk * * chunkGrid, u32 targetMask) {
+    BeginTimings(InitSkyLightReferences);
+    SetLightSectionReferences(queue, chunkGrid, 1);
     EndTimings(InitSkyLightReferences);
 
     BeginTimings(PrepareSkyLightSources);
-    i64 skyStartTime = NanoTime();
-    PropagateMaxSkyLightDown(queue);
+    i16 bottoms[4 * 4][256];
+    for (i32 gridIndex = 0; gridIndex < 4 * 4; gridIndex++) {
+        if (targetMask & ((u32) 1 << gridIndex)) {
+            PropagateMaxSkyLightDown(queue, chunkGrid[gridIndex], gridIndex, bottoms[gridIndex]);
+        }
+    }
+    for (i32 gridIndex = 0; gridIndex < 4 * 4; gridIndex++) {
+        if (targetMask & ((u32) 1 << gridIndex)) {
+            PushMaxSkyLightEdges(queue, gridIndex, bottoms[gridIndex]);
+        }
+    }
     EndTimings(PrepareSkyLightSources);
+    EndBenchmarkPhase(skySourceNanos);
 
     BeginTimings(PropagateOwnSkyLight);
     PropagateLightFully(queue);
     EndTimings(PropagateOwnSkyLight);
+    EndBenchmarkPhase(skyOwnNanos);
 
     BeginTimings(PrepareNeighbourSkyLightSources);
-    PropagateLightFromNeighbour(queue, chunkGrid, -1, 0, 0, 1, -1, 0, DIRECTION_NEG_X);
-    PropagateLightFromNeighbour(queue, chunkGrid, 16, 0, 0, 1, 1, 0, DIRECTION_POS_X);
-    PropagateLightFromNeighbour(queue, chunkGrid, 0, -1, 1, 0, 0, -1, DIRECTION_NEG_Z);
-    PropagateLightFromNeighbour(queue, chunkGrid, 0, 16, 1, 0, 0, 1, DIRECTION_POS_Z);
+    PropagateLightFromNeighbours(queue, chunkGrid, targetMask);
     EndTimings(PrepareNeighbourSkyLightSources);
 
     BeginTimings(PropagateNeighbourSkyLight);
     PropagateLightFully(queue);
-    i64 skyEndTime = NanoTime();
     EndTimings(PropagateNeighbourSkyLight);
+    EndBenchmarkPhase(skyNeighbourNanos);
 
-#ifdef MEASURE_BANDWIDTH
-    LogInfo("[Sky] Bw: %.0fMB/s, Dedup: %.0fMB/s (+Block = %.0f%%, +Light = %.0f%%)",
-            (queue->blockAccessCount * 2.0 + queue->lightAccessCount) / (f64) (skyEndTime - skyStartTime) * 1000.0,
-            (2 * 4096 * 24 + 4096 * 26) / (f64) (skyEndTime - skyStartTime) * 1000.0,
-            100 * queue->blockAccessCount / (f64) (4096 * 24),
-            100 * queue->lightAccessCount / (f64) (4096 * 26));
-#endif
 }
 
-static void DoBlockLight(LightQueue * queue, Chunk * * chunkGrid) {
+static void DoBlockLight(LightQueue * queue, Chunk * * chunkGrid, u32 targetMask) {
     BeginTimings(InitBlockLightReferences);
-
-    for (i32 zx = 0; zx < 16; zx++) {
-        Chunk * chunk = chunkGrid[zx];
-        if (chunk == NULL) {
-            continue;
-        }
-        for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
-            queue->lightSections[(sectionIndex << 4) | zx] = chunk->lightSections[sectionIndex].blockLight;
-        }
-    }
-
+    SetLightSectionReferences(queue, chunkGrid, 0);
     EndTimings(InitBlockLightReferences);
 
     BeginTimings(PrepareBlockLightSources);
-    i64 blockStartTime = NanoTime();
 
     // NOTE(traks): prepare block light sources for propagation
-    for (i32 y = 16; y < 16 + WORLD_HEIGHT; y++) {
-        for (i32 zx = 0; zx < 16 * 16; zx++) {
-            i32 sectionIndex = (y & 0xff0) | 0;
-            i32 posIndex = ((y & 0xf) << 8) | zx;
-            i32 blockState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
-#ifdef MEASURE_BANDWIDTH
-            queue->blockAccessCount++;
+    for (i32 gridIndex = 0; gridIndex < 4 * 4; gridIndex++) {
+        if (!(targetMask & ((u32) 1 << gridIndex))) {
+            continue;
+        }
+        i32 baseX = GridIndexToBaseX(gridIndex);
+        i32 baseZ = GridIndexToBaseZ(gridIndex);
+        for (i32 y = 16; y < 16 + WORLD_HEIGHT; y++) {
+            for (i32 zx = 0; zx < 16 * 16; zx++) {
+                i32 sectionIndex = (y & 0xff0) | gridIndex;
+                i32 posIndex = ((y & 0xf) << 8) | zx;
+                i32 blockState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
+#ifdef LIGHT_BENCHMARK
+                queue->blockAccessCount++;
 #endif
-            i32 emitted = serv->emittedLightByState[blockState];
-            if (emitted > 0) {
-                SetSectionLight(queue->lightSections[sectionIndex], posIndex, emitted);
-                u32 pos = PosFromXYZ(zx & 0xf, y, zx >> 4);
-                LightQueuePush(queue, PackEntry(pos));
+                i32 emitted = serv->emittedLightByState[blockState];
+                if (emitted > 0) {
+                    SetSectionLight(queue->lightSections[sectionIndex], posIndex, emitted);
+                    u32 pos = PosFromXYZ(baseX + (zx & 0xf), y, baseZ + (zx >> 4));
+                    LightQueuePush(queue, PackEntry(pos));
+                }
             }
         }
     }
 
     EndTimings(PrepareBlockLightSources);
+    EndBenchmarkPhase(blockSourceNanos);
 
     BeginTimings(PropagateOwnBlockLight);
     PropagateLightFully(queue);
     EndTimings(PropagateOwnBlockLight);
+    EndBenchmarkPhase(blockOwnNanos);
 
     BeginTimings(PrepareNeighbourBlockLightSources);
-    PropagateLightFromNeighbour(queue, chunkGrid, -1, 0, 0, 1, -1, 0, DIRECTION_NEG_X);
-    PropagateLightFromNeighbour(queue, chunkGrid, 16, 0, 0, 1, 1, 0, DIRECTION_POS_X);
-    PropagateLightFromNeighbour(queue, chunkGrid, 0, -1, 1, 0, 0, -1, DIRECTION_NEG_Z);
-    PropagateLightFromNeighbour(queue, chunkGrid, 0, 16, 1, 0, 0, 1, DIRECTION_POS_Z);
+    PropagateLightFromNeighbours(queue, chunkGrid, targetMask);
     EndTimings(PrepareNeighbourBlockLightSources);
 
     BeginTimings(PropagateNeighbourBlockLight);
     PropagateLightFully(queue);
-    i64 blockEndTime = NanoTime();
     EndTimings(PropagateNeighbourBlockLight);
+    EndBenchmarkPhase(blockNeighbourNanos);
 
-#ifdef MEASURE_BANDWIDTH
-    LogInfo("[Block] Bw: %.0fMB/s, Dedup: %.0fMB/s (+Block = %.0f%%, +Light = %.0f%%)",
-            (queue->blockAccessCount * 2.0 + queue->lightAccessCount) / (f64) (blockEndTime - blockStartTime) * 1000.0,
-            (2 * 4096 * 24 + 4096 * 26) / (f64) (blockEndTime - blockStartTime) * 1000.0,
-            100 * queue->blockAccessCount / (f64) (4096 * 24),
-            100 * queue->lightAccessCount / (f64) (4096 * 26));
-#endif
 }
 
-static void LoadChunkGrid(Chunk * targetChunk, Chunk * * chunkGrid) {
-    chunkGrid[0] = targetChunk;
-#ifdef MEASURE_BANDWIDTH
-    return;
-#endif
-    for (i32 dz = -1; dz <= 1; dz++) {
-        for (i32 dx = -1; dx <= 1; dx++) {
-            if (dx == 0 && dz == 0) {
-                continue;
-            }
-            WorldChunkPos mid = targetChunk->pos;
-            WorldChunkPos pos = mid;
+void CollectLightNeighbourhood(WorldChunkPos origin, u32 targetMask, Chunk * * chunkGrid) {
+    for (i32 dz = -1; dz <= 2; dz++) {
+        for (i32 dx = -1; dx <= 2; dx++) {
+            i32 index = GetNeighbourIndex(dx, dz);
+            chunkGrid[index] = NULL;
+
+            WorldChunkPos pos = origin;
             pos.x += dx;
             pos.z += dz;
-            i32 index = GetNeighbourIndex(dx, dz);
+            if (targetMask & ((u32) 1 << index)) {
+                chunkGrid[index] = GetChunkInternal(pos);
+                continue;
+            }
+
+            // NOTE(traks): Only take chunks next to a target chunk, others
+            // may be in use by other light jobs
+            i32 nextToTarget = 0;
+            for (i32 targetIndex = 0; targetIndex < 4 * 4; targetIndex++) {
+                i32 targetDx = targetIndex & 0x3;
+                i32 targetDz = targetIndex >> 2;
+                if ((targetMask & ((u32) 1 << targetIndex)) && ABS(targetDx - dx) <= 1 && ABS(targetDz - dz) <= 1) {
+                    nextToTarget = 1;
+                }
+            }
+
             Chunk * neighbour = GetChunkInternal(pos);
-            if (neighbour != NULL && (neighbour->loaderFlags & CHUNK_LOADER_LIT_SELF)) {
+            if (nextToTarget && neighbour != NULL && (neighbour->loaderFlags & CHUNK_LOADER_LIT_SELF)) {
                 // NOTE(traks): the neighbouring chunk lit itself, so we can
                 // exchange light with it
                 chunkGrid[index] = neighbour;
@@ -369,53 +640,43 @@ static void LoadChunkGrid(Chunk * targetChunk, Chunk * * chunkGrid) {
     }
 }
 
-void LightChunkAndExchangeWithNeighbours(Chunk * targetChunk) {
-    // TODO(traks): this takes in the order of 1 ms per call. In the past I
-    // tried filling empty sections at the top of the world for extra speed.
-    // However, that doesn't work well for Skygrid maps. Consider propagating a
-    // column at a time using the chunk's heightmap first, before doing general
-    // propagation.
-    //
-    // Here's another interesting approach. Per section we compute a layer that
-    // we stack 16 times. This has the major benefit of being able to set
-    // multiple bytes at once (instead of doing work per nibble if e.g. iterate
-    // through column until hit height map, then move to next column). Moreover,
-    // this also handles things like Skygrid well, while the empty-section
-    // approach fails miserably.
-    //
-    // Can probably go even faster by setting up a nice data structure to figure
-    // out at which Y levels which columns start their height map. Then don't
-    // even need to do per section I imagine.
-    //
-    // Should implement a fully functioning lighting engine before diving in
-    // deep though.
-
-    BeginTimings(LightChunk);
-
-    BeginTimings(LoadChunkGrid);
-
-    Chunk * chunkGrid[4 * 4] = {0};
-    LoadChunkGrid(targetChunk, chunkGrid);
-
-    EndTimings(LoadChunkGrid);
-
-    BeginTimings(InitQueue);
+typedef struct {
+    LightQueueEntry entries[LIGHT_QUEUE_SIZE];
+    u8 sectionFullLight[4096];
+    // NOTE(traks): only allocated for the main thread, which does incremental
+    // light updates
+    LightQueueEntry * removalEntries;
+} LightWorkspace;
+
+// NOTE(traks): Lighting runs on the worker threads. Each worker gets its own
+// workspace the first time it lights a chunk, and keeps it around for the next
+// chunks. It's way too large for the stack.
+static _Thread_local LightWorkspace * lightWorkspace;
+
+static LightWorkspace * GetLightWorkspace(void) {
+    if (lightWorkspace == NULL) {
+        lightWorkspace = malloc(sizeof *lightWorkspace);
+        if (lightWorkspace == NULL) {
+            LogInfo("Failed to allocate light workspace");
+            exit(1);
+        }
+        memset(lightWorkspace->sectionFullLight, 0xff, sizeof lightWorkspace->sectionFullLight);
+        lightWorkspace->removalEntries = NULL;
+    }
+    return lightWorkspace;
+}
 
-    LightQueue lightQueue = {0};
-    // NOTE(traks): keep the entries array out of the queue struct, so it isn't
-    // zero-initialised above. Zero initialising the entry array can be very
-    // slow: hundreds of microseconds for 2^20 entries.
-    LightQueueEntry allEntries[LIGHT_QUEUE_SIZE];
-    lightQueue.entries = allEntries;
+static void InitLightQueue(LightQueue * queue, LightWorkspace * workspace, Chunk * * chunkGrid) {
+    *queue = (LightQueue) {0};
+    queue->entries = workspace->entries;
+    queue->sectionFullLight = workspace->sectionFullLight;
 
     // NOTE(traks): set up section references for easy access
     SectionBlocks sectionAir = {0};
-    u8 sectionFullLight[4096];
-    memset(sectionFullLight, 0xff, 4096);
 
-    for (i32 i = 0; i < (i32) ARRAY_SIZE(lightQueue.blockSections); i++) {
-        lightQueue.blockSections[i] = sectionAir;
-        lightQueue.lightSections[i] = sectionFullLight;
+    for (i32 i = 0; i < (i32) ARRAY_SIZE(queue->blockSections); i++) {
+        queue->blockSections[i] = sectionAir;
+        queue->lightSections[i] = workspace->sectionFullLight;
     }
 
     for (i32 zx = 0; zx < 16; zx++) {
@@ -427,40 +688,323 @@ void LightChunkAndExchangeWithNeighbours(Chunk * targetChunk) {
         for (i32 sectionIndex = 0; sectionIndex < SECTIONS_PER_CHUNK; sectionIndex++) {
             SectionBlocks blocks = chunk->sections[sectionIndex].blocks;
             i32 gridIndex = ((sectionIndex + 1) << 4) | zx;
-            lightQueue.blockSections[gridIndex] = blocks;
+            queue->blockSections[gridIndex] = blocks;
         }
     }
+}
 
-    EndTimings(InitQueue);
+void LightChunksAndExchangeWithNeighbours(Chunk * * chunkGrid, u32 targetMask) {
+    // TODO(traks): Sky light sources are set up per column and layer now (see
+    // PropagateMaxSkyLightDown), but the propagation itself still goes block
+    // by block. Propagating a whole layer at a time might be faster too.
 
-#ifdef MEASURE_BANDWIDTH
-    LogInfo("Chunk: %d, %d", targetChunk->pos.x, targetChunk->pos.z);
+    // NOTE(traks): Positions wrap around every 4 chunks. Light spreads at most
+    // 15 blocks, so light spreading out of the 2x2 area at the origin stays in
+    // the ring of chunks around it and never wraps around into the other side.
+    assert((targetMask & ~(u32) 0x33) == 0);
+
+    BeginTimings(LightChunk);
+#ifdef LIGHT_BENCHMARK
+    lightBenchmarkStats.phaseStartNanos = NanoTime();
 #endif
 
-    DoSkyLight(&lightQueue, chunkGrid);
-#ifdef MEASURE_BANDWIDTH
-    lightQueue.blockAccessCount = 0;
-    lightQueue.lightAccessCount = 0;
+    BeginTimings(InitQueue);
+
+    LightQueue lightQueue;
+    InitLightQueue(&lightQueue, GetLightWorkspace(), chunkGrid);
+
+    EndTimings(InitQueue);
+
+    EndBenchmarkPhase(setupNanos);
+
+    DoSkyLight(&lightQueue, chunkGrid, targetMask);
+    DoBlockLight(&lightQueue, chunkGrid, targetMask);
+
+#ifdef LIGHT_BENCHMARK
+    lightBenchmarkStats.blockAccessCount += lightQueue.blockAccessCount;
+    lightBenchmarkStats.lightAccessCount += lightQueue.lightAccessCount;
 #endif
-    DoBlockLight(&lightQueue, chunkGrid);
 
     EndTimings(LightChunk);
 }
 
+// NOTE(traks): Clears the light of a neighbour if it may have gotten its light
+// from the position that was just cleared. Otherwise the neighbour's light does
+// not depend on the removed light, and it becomes a source for propagating
+// light back into the cleared area.
+static inline void RemoveNeighbourLight(LightQueue * queue, u32 toPos, i32 fromValue, i32 maxValueSpreads) {
+    i32 sectionIndex = PosToSectionIndex(toPos);
+    u8 * lightArray = queue->lightSections[sectionIndex];
+    if (lightArray == queue->sectionFullLight) {
+        // NOTE(traks): not in a chunk we can modify
+        return;
+    }
+
+    i32 posIndex = PosToSectionPosIndex(toPos);
+    i32 storedValue = GetSectionLight(lightArray, posIndex);
+    if (storedValue == 0) {
+        return;
+    }
+
+    // NOTE(traks): Light is reduced by at least 1 while propagating, except for
+    // max sky light going down. Positions with a lower value may have gotten
+    // their light from us. Doesn't hurt to clear a bit too much.
+    i32 dependent = storedValue < fromValue || (maxValueSpreads && storedValue == 15);
+    i32 emitted = 0;
+    if (dependent && !queue->isSkyLight) {
+        i32 toState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
+        emitted = serv->emittedLightByState[toState];
+    }
+
+    if (!dependent || emitted >= storedValue) {
+        LightQueuePush(queue, PackEntry(toPos));
+        return;
+    }
+
+    SetSectionLight(lightArray, posIndex, emitted);
+    MarkSectionChanged(queue, sectionIndex);
+    LightQueuePushRemoval(queue, PackRemovalEntry(toPos, storedValue));
+    if (emitted > 0) {
+        LightQueuePush(queue, PackEntry(toPos));
+    }
+}
+
+static void RemoveLightFully(LightQueue * queue) {
+    for (i32 readIndex = 0; readIndex < queue->removalWriteIndex; readIndex++) {
+        LightQueueEntry entry = queue->removalEntries[readIndex];
+        u32 fromPos = GetEntryPos(entry);
+        i32 value = GetEntryValue(entry);
+
+        i32 maxSkyLightDown = queue->isSkyLight && value == 15;
+        RemoveNeighbourLight(queue, fromPos - 0x10000, value, maxSkyLightDown);
+        RemoveNeighbourLight(queue, fromPos + 0x10000, value, 0);
+        RemoveNeighbourLight(queue, fromPos - 0x100, value, 0);
+        RemoveNeighbourLight(queue, fromPos + 0x100, value, 0);
+        RemoveNeighbourLight(queue, fromPos - 0x1, value, 0);
+        RemoveNeighbourLight(queue, fromPos + 0x1, value, 0);
+    }
+
+    queue->removalWriteIndex = 0;
+}
+
+static inline void PushIfLit(LightQueue * queue, u32 pos) {
+    i32 sectionIndex = PosToSectionIndex(pos);
+    u8 * lightArray = queue->lightSections[sectionIndex];
+    if (lightArray != queue->sectionFullLight && GetSectionLight(lightArray, PosToSectionPosIndex(pos)) > 0) {
+        LightQueuePush(queue, PackEntry(pos));
+    }
+}
+
+// NOTE(traks): same as PropagateMaxSkyLightDown, but for a single column that
+// may already be lit
+static void ReseedSkyColumn(LightQueue * queue, i32 x, i32 z) {
+    i32 fromState = 0;
+    for (i32 y = 16 * LIGHT_SECTIONS_PER_CHUNK - 1; y >= 0; y--) {
+        i32 sectionIndex = XYZToSectionIndex(x, y, z);
+        i32 posIndex = ((y & 0xf) << 8) | ((z & 0xf) << 4) | (x & 0xf);
+        i32 toState = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
+        if (serv->lightReductionByState[toState] > 0) {
+            break;
+        }
+        if (!FindLightCanPropagate(fromState, toState, DIRECTION_NEG_Y)) {
+            break;
+        }
+
+        if (GetSectionLight(queue->lightSections[sectionIndex], posIndex) != 15) {
+            SetSectionLight(queue->lightSections[sectionIndex], posIndex, 15);
+            MarkSectionChanged(queue, sectionIndex);
+            LightQueuePush(queue, PackEntry(PosFromXYZ(x, y, z)));
+        }
+        fromState = toState;
+    }
+}
+
+static inline u32 ChangeToQueuePos(WorldBlockPos pos) {
+    return PosFromXYZ(pos.x & 0xf, pos.y - MIN_WORLD_Y + 16, pos.z & 0xf);
+}
+
+// NOTE(traks): The standard two-phase approach. First clear the light of the
+// changed positions and of everything that may have gotten light from them.
+// Then propagate light back in from the edges of the cleared area, from light
+// sources inside it and from the changed positions themselves.
+static void UpdateLightAroundChanges(LightQueue * queue, WorldBlockPos * changes, i32 changeCount) {
+    for (i32 i = 0; i < changeCount; i++) {
+        u32 pos = ChangeToQueuePos(changes[i]);
+        i32 sectionIndex = PosToSectionIndex(pos);
+        i32 posIndex = PosToSectionPosIndex(pos);
+        i32 value = GetSectionLight(queue->lightSections[sectionIndex], posIndex);
+        if (value > 0) {
+            SetSectionLight(queue->lightSections[sectionIndex], posIndex, 0);
+            MarkSectionChanged(queue, sectionIndex);
+            LightQueuePushRemoval(queue, PackRemovalEntry(pos, value));
+        }
+    }
+
+    RemoveLightFully(queue);
+
+    u64 reseededColumns[4] = {0};
+    for (i32 i = 0; i < changeCount; i++) {
+        u32 pos = ChangeToQueuePos(changes[i]);
+        i32 sectionIndex = PosToSectionIndex(pos);
+        i32 posIndex = PosToSectionPosIndex(pos);
+
+        if (queue->isSkyLight) {
+            i32 zx = posIndex & 0xff;
+            if (!(reseededColumns[zx >> 6] & ((u64) 1 << (zx & 0x3f)))) {
+                reseededColumns[zx >> 6] |= (u64) 1 << (zx & 0x3f);
+                ReseedSkyColumn(queue, zx & 0xf, zx >> 4);
+            }
+        } else {
+            i32 state = SectionGetBlockState(&queue->blockSections[sectionIndex], posIndex);
+            i32 emitted = serv->emittedLightByState[state];
+            if (emitted > GetSectionLight(queue->lightSections[sectionIndex], posIndex)) {
+                SetSectionLight(queue->lightSections[sectionIndex], posIndex, emitted);
+                MarkSectionChanged(queue, sectionIndex);
+                LightQueuePush(queue, PackEntry(pos));
+            }
+        }
+
+        // NOTE(traks): light may be able to pass through the changed position
+        // now, so have the neighbours try again
+        PushIfLit(queue, pos - 0x10000);
+        PushIfLit(queue, pos + 0x10000);
+        PushIfLit(queue, pos - 0x100);
+        PushIfLit(queue, pos + 0x100);
+        PushIfLit(queue, pos - 0x1);
+        PushIfLit(queue, pos + 0x1);
+    }
+
+    PropagateLightFully(queue);
+}
+
+static void UpdateChunkLight(Chunk * chunk, WorldBlockPos * changes, i32 changeCount) {
+    // NOTE(traks): Light spreads at most 15 blocks horizontally, so changes in
+    // the centre chunk never affect anything outside the 3x3 area.
+    Chunk * chunkGrid[4 * 4];
+    CollectLightNeighbourhood(chunk->pos, 1, chunkGrid);
+
+    LightWorkspace * workspace = GetLightWorkspace();
+    if (workspace->removalEntries == NULL) {
+        workspace->removalEntries = malloc(LIGHT_QUEUE_SIZE * sizeof *workspace->removalEntries);
+        if (workspace->removalEntries == NULL) {
+            LogInfo("Failed to allocate light removal queue");
+            exit(1);
+        }
+    }
+
+    LightQueue lightQueue;
+    InitLightQueue(&lightQueue, workspace, chunkGrid);
+    lightQueue.removalEntries = workspace->removalEntries;
+
+    u32 changedSkyLight[4 * 4];
+    SetLightSectionReferences(&lightQueue, chunkGrid, 1);
+    UpdateLightAroundChanges(&lightQueue, changes, changeCount);
+    memcpy(changedSkyLight, lightQueue.changedSections, sizeof changedSkyLight);
+    memset(lightQueue.changedSections, 0, sizeof lightQueue.changedSections);
+
+    SetLightSectionReferences(&lightQueue, chunkGrid, 0);
+    UpdateLightAroundChanges(&lightQueue, changes, changeCount);
+
+    for (i32 zx = 0; zx < 4 * 4; zx++) {
+        if (chunkGrid[zx] != NULL) {
+            ChunkMarkLightChanged(chunkGrid[zx], changedSkyLight[zx], lightQueue.changedSections[zx]);
+        }
+    }
+}
+
+typedef struct {
+    WorldBlockPos * entries;
+    i32 count;
+    i32 size;
+} PendingLightChanges;
+
+// NOTE(traks): Block changes whose light still needs updating. Changes near a
+// chunk that's being lit by a worker have to wait until the worker is done,
+// so these can stick around for a couple of ticks.
+static PendingLightChanges pendingLightChanges;
+
+static void AddPendingLightChange(WorldBlockPos pos) {
+    PendingLightChanges * pending = &pendingLightChanges;
+    if (pending->count >= pending->size) {
+        i32 newSize = MAX(2 * pending->size, 1024);
+        WorldBlockPos * newEntries = realloc(pending->entries, newSize * sizeof *newEntries);
+        if (newEntries == NULL) {
+            LogInfo("Failed to grow pending light changes");
+            exit(1);
+        }
+        pending->entries = newEntries;
+        pending->size = newSize;
+    }
+    pending->entries[pending->count] = pos;
+    pending->count++;
+}
+
 void UpdateLighting(void) {
-    // @TODO(traks) further implementation
-    /*
-    for (i32 bucketIndex = 0; bucketIndex < ARRAY_SIZE(chunk_map); bucketIndex++) {
-        chunk_bucket * bucket = chunk_map + bucketIndex;
-        for (i32 chunkIndex = 0; chunkIndex < bucket->size; chunkIndex++) {
-            Chunk * ch = bucket->chunks + chunkIndex;
-            for (i32 sectionIndex = 0; sectionIndex < SECTIONS_PER_CHUNK; sectionIndex++) {
-                ChunkSection * section = ch->sections + sectionIndex;
-                if (section->lastChangeTick == serv->current_tick) {
-                    // @NOTE(traks) chunk section has changed blocks
+    BeginTimings(CollectLightChanges);
+
+    i32 changedChunkCount = GetChangedChunkCount();
+    for (i32 chunkIndex = 0; chunkIndex < changedChunkCount; chunkIndex++) {
+        Chunk * chunk = GetChangedChunk(chunkIndex);
+        if (chunk == NULL) {
+            continue;
+        }
+        for (i32 sectionIndex = 0; sectionIndex < SECTIONS_PER_CHUNK; sectionIndex++) {
+            if (!(chunk->changedBlockSections & ((u32) 1 << sectionIndex))) {
+                continue;
+            }
+            ChunkSection * section = chunk->sections + sectionIndex;
+            for (i32 i = 0; i < section->changedBlockSetMask + 1; i++) {
+                if (section->changedBlockSet[i] != 0) {
+                    BlockPos posInSection = SectionIndexToPos(section->changedBlockSet[i] & 0xfff);
+                    WorldBlockPos pos = {
+                        .worldId = chunk->pos.worldId,
+                        .x = chunk->pos.x * 16 + posInSection.x,
+                        .y = (sectionIndex + MIN_SECTION) * 16 + posInSection.y,
+                        .z = chunk->pos.z * 16 + posInSection.z,
+                    };
+                    AddPendingLightChange(pos);
                 }
             }
         }
     }
-    */
+
+    EndTimings(CollectLightChanges);
+
+    BeginTimings(RelightChunks);
+
+    // NOTE(traks): Changes for the same chunk are next to each other, so we
+    // can update all of them at once. Keep the ones that have to wait at the
+    // start of the array.
+    PendingLightChanges * pending = &pendingLightChanges;
+    i32 keepCount = 0;
+    i32 runStart = 0;
+    while (runStart < pending->count) {
+        WorldChunkPos chunkPos = WorldBlockPosChunk(pending->entries[runStart]);
+        i32 runEnd = runStart + 1;
+        while (runEnd < pending->count) {
+            WorldChunkPos otherPos = WorldBlockPosChunk(pending->entries[runEnd]);
+            if (otherPos.worldId != chunkPos.worldId || otherPos.x != chunkPos.x || otherPos.z != chunkPos.z) {
+                break;
+            }
+            runEnd++;
+        }
+
+        Chunk * chunk = GetChunkInternal(chunkPos);
+        if (chunk == NULL || !(chunk->loaderFlags & CHUNK_LOADER_LIT_SELF)) {
+            // NOTE(traks): chunk got unloaded, its light will be computed from
+            // scratch if it's loaded again
+        } else if (IsNearLightJob(chunkPos, 2)) {
+            // NOTE(traks): the worker may be touching the light of our
+            // neighbours
+            memmove(pending->entries + keepCount, pending->entries + runStart, (runEnd - runStart) * sizeof *pending->entries);
+            keepCount += runEnd - runStart;
+        } else {
+            UpdateChunkLight(chunk, pending->entries + runStart, runEnd - runStart);
+        }
+
+        runStart = runEnd;
+    }
+    pending->count = keepCount;
+
+    EndTimings(RelightChunks);
 }
@@ -0,0 +1,361 @@
+#ifdef LIGHT_BENCHMARK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "shared.h"
+#include "chunk.h"
+
+// NOTE(traks): Standing benchmark for the light engine. Build with bench=1 in
+// build.sh. We generate a couple of fixed 4x4 areas of chunks, light the outer
+// chunks once, and then repeatedly light the 2x2 chunks in the middle with all
+// of their neighbours present, which is the common case on a running server.
+// They're lit both one chunk at a time and as a single batch. Results
+// are printed as one JSON object per line, so they can be diffed or plotted
+// between engine changes.
+
+#define BENCHMARK_WARMUP_RUNS 3
+#define BENCHMARK_RUNS 30
+
+typedef i32 (* FixtureBlockGenerator)(i32 x, i32 y, i32 z);
+
+typedef struct {
+    char * name;
+    FixtureBlockGenerator generateBlock;
+    i32 growTrees;
+} LightFixture;
+
+static u32 FixtureHash(i32 a, i32 b, i32 c) {
+    u32 x = 0x9e3779b1;
+    i32 values[] = {a, b, c};
+    for (i32 i = 0; i < 3; i++) {
+        x = (x ^ (u32) values[i]) * 0x85ebca6b;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35;
+        x ^= x >> 16;
+    }
+    return x;
+}
+
+static i32 FixtureTerrainHeight(i32 x, i32 z) {
+    return 60 + FixtureHash(x >> 2, z >> 2, 0) % 8 + FixtureHash(x, z, 1) % 2;
+}
+
+static i32 GenerateSurvivalBlock(i32 x, i32 y, i32 z) {
+    i32 height = FixtureTerrainHeight(x, z);
+    if (y == MIN_WORLD_Y) {
+        return get_default_block_state(BLOCK_BEDROCK);
+    } else if (y < height - 3) {
+        return get_default_block_state(BLOCK_STONE);
+    } else if (y < height - 1) {
+        return get_default_block_state(BLOCK_DIRT);
+    } else if (y == height - 1) {
+        return get_default_block_state(height >= 63 ? BLOCK_GRASS_BLOCK : BLOCK_SAND);
+    } else if (y < 63) {
+        return get_default_block_state(BLOCK_WATER);
+    } else if (y == height && FixtureHash(x, y, z) % 150 == 0) {
+        return get_default_block_state(BLOCK_TORCH);
+    }
+    return get_default_block_state(BLOCK_AIR);
+}
+
+static i32 GenerateSkygridBlock(i32 x, i32 y, i32 z) {
+    if ((x & 3) != 0 || (y & 3) != 0 || (z & 3) != 0) {
+        return get_default_block_state(BLOCK_AIR);
+    }
+    i32 types[] = {BLOCK_STONE, BLOCK_GLASS, BLOCK_OAK_LEAVES, BLOCK_GLOWSTONE, BLOCK_DIRT, BLOCK_OAK_LOG};
+    return get_default_block_state(types[FixtureHash(x, y, z) % ARRAY_SIZE(types)]);
+}
+
+static i32 GenerateCavesBlock(i32 x, i32 y, i32 z) {
+    if (y >= 0) {
+        return GenerateSurvivalBlock(x, y, z);
+    }
+    if (y == MIN_WORLD_Y) {
+        return get_default_block_state(BLOCK_BEDROCK);
+    }
+    i32 layer = (y - MIN_WORLD_Y) % 12;
+    if (layer >= 3 && layer <= 5 && ((z & 7) < 3 || (x % 9 + 9) % 9 < 3)) {
+        if (layer == 3 && FixtureHash(x, y, z) % 40 == 0) {
+            return get_default_block_state(BLOCK_TORCH);
+        }
+        return get_default_block_state(BLOCK_CAVE_AIR);
+    }
+    return get_default_block_state(BLOCK_STONE);
+}
+
+// NOTE(traks): every block emits light and none lets it through, the worst
+// case for block light sources
+static i32 GenerateGlowstoneBlock(i32 x, i32 y, i32 z) {
+    return get_default_block_state(BLOCK_GLOWSTONE);
+}
+
+static void GrowFixtureTrees(Chunk * chunk) {
+    i32 logState = get_default_block_state(BLOCK_OAK_LOG);
+    i32 leavesState = get_default_block_state(BLOCK_OAK_LEAVES);
+    for (i32 tree = 0; tree < 3; tree++) {
+        i32 x = 2 + FixtureHash(chunk->pos.x, chunk->pos.z, tree) % 12;
+        i32 z = 2 + FixtureHash(chunk->pos.z, chunk->pos.x, tree) % 12;
+        i32 height = FixtureTerrainHeight(chunk->pos.x * 16 + x, chunk->pos.z * 16 + z);
+        if (height < 63) {
+            continue;
+        }
+        for (i32 dy = 3; dy < 7; dy++) {
+            for (i32 dz = -2; dz <= 2; dz++) {
+                for (i32 dx = -2; dx <= 2; dx++) {
+                    i32 y = height + dy;
+                    i32 sectionIndex = (y >> 4) - MIN_SECTION;
+                    SectionSetBlockState(&chunk->sections[sectionIndex].blocks, SectionPosToIndex((BlockPos) {x + dx, y & 0xf, z + dz}), leavesState);
+                }
+            }
+        }
+        for (i32 y = height; y < height + 5; y++) {
+            i32 sectionIndex = (y >> 4) - MIN_SECTION;
+            SectionSetBlockState(&chunk->sections[sectionIndex].blocks, SectionPosToIndex((BlockPos) {x, y & 0xf, z}), logState);
+        }
+    }
+}
+
+static Chunk * CreateFixtureChunk(LightFixture * fixture, i32 chunkX, i32 chunkZ) {
+    Chunk * chunk = calloc(1, sizeof *chunk);
+    if (chunk == NULL) {
+        LogInfo("Failed to allocate fixture chunk");
+        exit(1);
+    }
+    chunk->pos = (WorldChunkPos) {.worldId = 1, .x = chunkX, .z = chunkZ};
+
+    for (i32 sectionIndex = 0; sectionIndex < SECTIONS_PER_CHUNK; sectionIndex++) {
+        SectionBlocks * blocks = &chunk->sections[sectionIndex].blocks;
+        i32 minY = (sectionIndex + MIN_SECTION) * 16;
+        for (i32 index = 0; index < 4096; index++) {
+            BlockPos pos = SectionIndexToPos(index);
+            i32 blockState = fixture->generateBlock(chunkX * 16 + pos.x, minY + pos.y, chunkZ * 16 + pos.z);
+            SectionSetBlockState(blocks, index, blockState);
+        }
+    }
+
+    if (fixture->growTrees) {
+        GrowFixtureTrees(chunk);
+    }
+
+    for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
+        chunk->lightSections[sectionIndex].skyLight = CallocSectionLight();
+        chunk->lightSections[sectionIndex].blockLight = CallocSectionLight();
+    }
+
+    // NOTE(traks): the height map calculation skips empty sections, so keep
+    // the non-air counts in sync with the generated blocks
+    for (i32 sectionIndex = 0; sectionIndex < SECTIONS_PER_CHUNK; sectionIndex++) {
+        ChunkSection * section = chunk->sections + sectionIndex;
+        for (i32 index = 0; index < 4096; index++) {
+            section->nonAirCount += (SectionGetBlockState(&section->blocks, index) != 0);
+        }
+    }
+
+    ChunkRecalculateHeightMaps(chunk);
+    return chunk;
+}
+
+static void CopyChunkLight(Chunk * chunk, u8 * target, i32 toChunk) {
+    for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
+        LightSection * section = chunk->lightSections + sectionIndex;
+        u8 * sky = target + (2 * sectionIndex) * 4096;
+        u8 * block = sky + 4096;
+        if (toChunk) {
+            memcpy(section->skyLight, sky, 4096);
+            memcpy(section->blockLight, block, 4096);
+        } else {
+            memcpy(sky, section->skyLight, 4096);
+            memcpy(block, section->blockLight, 4096);
+        }
+    }
+}
+
+static void ClearChunkLight(Chunk * chunk) {
+    for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
+        memset(chunk->lightSections[sectionIndex].skyLight, 0, 4096);
+        memset(chunk->lightSections[sectionIndex].blockLight, 0, 4096);
+    }
+}
+
+// NOTE(traks): Collects the chunks around the origin that are targets or lit,
+// like CollectLightNeighbourhood does for loaded chunks. Area and lit are
+// indexed as zx in the same 4x4 layout the light engine uses.
+static void CollectFixtureGrid(Chunk * * area, i32 * lit, i32 originX, i32 originZ, u32 targetMask, Chunk * * chunkGrid) {
+    for (i32 dz = -1; dz <= 2; dz++) {
+        for (i32 dx = -1; dx <= 2; dx++) {
+            i32 gridIndex = ((dz & 0x3) << 2) | (dx & 0x3);
+            chunkGrid[gridIndex] = NULL;
+            i32 areaX = originX + dx;
+            i32 areaZ = originZ + dz;
+            if (areaX < -1 || areaX > 2 || areaZ < -1 || areaZ > 2) {
+                continue;
+            }
+
+            i32 nextToTarget = 0;
+            for (i32 targetIndex = 0; targetIndex < 4 * 4; targetIndex++) {
+                i32 targetDx = targetIndex & 0x3;
+                i32 targetDz = targetIndex >> 2;
+                if ((targetMask & ((u32) 1 << targetIndex)) && ABS(targetDx - dx) <= 1 && ABS(targetDz - dz) <= 1) {
+                    nextToTarget = 1;
+                }
+            }
+
+            i32 areaIndex = ((areaZ & 0x3) << 2) | (areaX & 0x3);
+            if ((targetMask & ((u32) 1 << gridIndex)) || (nextToTarget && lit[areaIndex])) {
+                chunkGrid[gridIndex] = area[areaIndex];
+            }
+        }
+    }
+}
+
+// NOTE(traks): Single mode stores the final light of all chunks in resultLight,
+// batch mode checks whether it ends up with the same light
+static void RunFixtureMode(LightFixture * fixture, Chunk * * area, u8 * savedLight, u8 * resultLight, i32 batched) {
+    i32 lightSize = LIGHT_SECTIONS_PER_CHUNK * 2 * 4096;
+    LightBenchmarkStats total = {0};
+    i64 totalNanos = 0;
+    i64 minNanos = 0;
+    for (i32 run = 0; run < BENCHMARK_WARMUP_RUNS + BENCHMARK_RUNS; run++) {
+        i32 lit[4 * 4];
+        for (i32 i = 0; i < 4 * 4; i++) {
+            CopyChunkLight(area[i], savedLight + i * lightSize, 1);
+            lit[i] = 1;
+        }
+        // NOTE(traks): the 2x2 chunks in the middle are the ones we light
+        i32 centre[] = {0x0, 0x1, 0x4, 0x5};
+        for (i32 i = 0; i < 4; i++) {
+            ClearChunkLight(area[centre[i]]);
+            lit[centre[i]] = 0;
+        }
+
+        lightBenchmarkStats = (LightBenchmarkStats) {0};
+        i64 startTime = NanoTime();
+        if (batched) {
+            Chunk * chunkGrid[4 * 4];
+            CollectFixtureGrid(area, lit, 0, 0, 0x33, chunkGrid);
+            LightChunksAndExchangeWithNeighbours(chunkGrid, 0x33);
+        } else {
+            for (i32 i = 0; i < 4; i++) {
+                Chunk * chunkGrid[4 * 4];
+                CollectFixtureGrid(area, lit, centre[i] & 0x3, centre[i] >> 2, 1, chunkGrid);
+                LightChunksAndExchangeWithNeighbours(chunkGrid, 1);
+                lit[centre[i]] = 1;
+            }
+        }
+        i64 runNanos = NanoTime() - startTime;
+
+        if (run < BENCHMARK_WARMUP_RUNS) {
+            continue;
+        }
+
+        totalNanos += runNanos;
+        minNanos = (minNanos == 0 ? runNanos : MIN(minNanos, runNanos));
+        total.setupNanos += lightBenchmarkStats.setupNanos;
+        total.skySourceNanos += lightBenchmarkStats.skySourceNanos;
+        total.skyOwnNanos += lightBenchmarkStats.skyOwnNanos;
+        total.skyNeighbourNanos += lightBenchmarkStats.skyNeighbourNanos;
+        total.blockSourceNanos += lightBenchmarkStats.blockSourceNanos;
+        total.blockOwnNanos += lightBenchmarkStats.blockOwnNanos;
+        total.blockNeighbourNanos += lightBenchmarkStats.blockNeighbourNanos;
+        total.blockAccessCount += lightBenchmarkStats.blockAccessCount;
+        total.lightAccessCount += lightBenchmarkStats.lightAccessCount;
+        total.queueHighWater = MAX(total.queueHighWater, lightBenchmarkStats.queueHighWater);
+    }
+
+    i32 lightMatches = 1;
+    for (i32 i = 0; i < 4 * 4; i++) {
+        u8 * chunkResult = resultLight + i * lightSize;
+        if (batched) {
+            u8 * light = malloc(lightSize);
+            CopyChunkLight(area[i], light, 0);
+            lightMatches &= (memcmp(light, chunkResult, lightSize) == 0);
+            free(light);
+        } else {
+            CopyChunkLight(area[i], chunkResult, 0);
+        }
+    }
+
+    // NOTE(traks): all numbers are for lighting the 4 chunks in the middle
+    f64 runs = BENCHMARK_RUNS;
+    f64 bytesPerRun = (2.0 * total.blockAccessCount + total.lightAccessCount) / runs;
+    printf("{\"fixture\": \"%s\", \"mode\": \"%s\", \"runs\": %d, \"avg_ms\": %.4f, \"min_ms\": %.4f, "
+            "\"setup_ms\": %.4f, \"sky_sources_ms\": %.4f, \"sky_own_ms\": %.4f, \"sky_neighbour_ms\": %.4f, "
+            "\"block_sources_ms\": %.4f, \"block_own_ms\": %.4f, \"block_neighbour_ms\": %.4f, "
+            "\"block_reads\": %.0f, \"light_accesses\": %.0f, \"traffic_mb\": %.3f, \"traffic_mb_per_s\": %.0f, "
+            "\"queue_high_water\": %d, \"light_matches_single\": %d}\n",
+            fixture->name, batched ? "batch" : "single", BENCHMARK_RUNS, totalNanos / runs / 1e6, minNanos / 1e6,
+            total.setupNanos / runs / 1e6, total.skySourceNanos / runs / 1e6,
+            total.skyOwnNanos / runs / 1e6, total.skyNeighbourNanos / runs / 1e6,
+            total.blockSourceNanos / runs / 1e6, total.blockOwnNanos / runs / 1e6,
+            total.blockNeighbourNanos / runs / 1e6,
+            total.blockAccessCount / runs, total.lightAccessCount / runs,
+            bytesPerRun / 1e6, bytesPerRun / (totalNanos / runs) * 1e3,
+            total.queueHighWater, lightMatches);
+    fflush(stdout);
+}
+
+static void RunFixture(LightFixture * fixture) {
+    // NOTE(traks): index as zx in the same 4x4 layout the light engine uses
+    Chunk * area[4 * 4] = {0};
+    for (i32 dz = -1; dz <= 2; dz++) {
+        for (i32 dx = -1; dx <= 2; dx++) {
+            area[((dz & 0x3) << 2) | (dx & 0x3)] = CreateFixtureChunk(fixture, dx, dz);
+        }
+    }
+
+    // NOTE(traks): light the outer chunks in a fixed order, each exchanging
+    // light with the ones lit before it, as the chunk loader would
+    i32 lit[4 * 4] = {0};
+    for (i32 dz = -1; dz <= 2; dz++) {
+        for (i32 dx = -1; dx <= 2; dx++) {
+            if (dx >= 0 && dx <= 1 && dz >= 0 && dz <= 1) {
+                continue;
+            }
+            Chunk * chunkGrid[4 * 4];
+            CollectFixtureGrid(area, lit, dx, dz, 1, chunkGrid);
+            LightChunksAndExchangeWithNeighbours(chunkGrid, 1);
+            lit[((dz & 0x3) << 2) | (dx & 0x3)] = 1;
+        }
+    }
+
+    // NOTE(traks): keep the light of the outer chunks around, so every run
+    // starts from the same state
+    i32 lightSize = LIGHT_SECTIONS_PER_CHUNK * 2 * 4096;
+    u8 * savedLight = malloc(4 * 4 * lightSize);
+    for (i32 i = 0; i < 4 * 4; i++) {
+        CopyChunkLight(area[i], savedLight + i * lightSize, 0);
+    }
+
+    u8 * resultLight = malloc(4 * 4 * lightSize);
+    RunFixtureMode(fixture, area, savedLight, resultLight, 0);
+    RunFixtureMode(fixture, area, savedLight, resultLight, 1);
+
+    free(resultLight);
+    free(savedLight);
+    for (i32 i = 0; i < 4 * 4; i++) {
+        Chunk * chunk = area[i];
+        for (i32 sectionIndex = 0; sectionIndex < SECTIONS_PER_CHUNK; sectionIndex++) {
+            FreeAndClearSectionBlocks(&chunk->sections[sectionIndex].blocks);
+        }
+        for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
+            FreeSectionLight(chunk->lightSections[sectionIndex].skyLight);
+            FreeSectionLight(chunk->lightSections[sectionIndex].blockLight);
+        }
+        free(chunk);
+    }
+}
+
+void RunLightBenchmark(void) {
+    LightFixture fixtures[] = {
+        {"survival", GenerateSurvivalBlock, 1},
+        {"skygrid", GenerateSkygridBlock, 0},
+        {"caves", GenerateCavesBlock, 1},
+        {"glowstone", GenerateGlowstoneBlock, 0},
+    };
+
+    for (i32 i = 0; i < (i32) ARRAY_SIZE(fixtures); i++) {
+        RunFixture(fixtures + i);
+    }
+}
+
+#endif
@@ -17,6 +17,7 @@
 #include "buffer.h"
 #include "chunk.h"
 #include "network.h"
+#include "cpu.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
 #include <mach/mach_time.h>
@@ -624,7 +625,7 @@ static void
 server_tick(void) {
     BeginTimings(ServerTick);
 
-    TickInitialConnections();
+    AcceptNewPlayers();
 
     // run scheduled block updates
     BeginTimings(ScheduledUpdates);
@@ -684,11 +685,24 @@ server_tick(void) {
         serv->tab_list_size++;
     }
 
+    if (serv->tab_list_added_count > 0 || serv->tab_list_removed_count > 0) {
+        UpdateStatusResponse();
+    }
+
     EndTimings(UpdateTabList);
 
+    BeginTimings(UpdateLighting);
+    UpdateLighting();
+    EndTimings(UpdateLighting);
+
     BeginTimings(SendPlayers);
 
-    for (int i = 0; i < (i32) ARRAY_SIZE(serv->entities); i++) {
+    // NOTE(traks): players earlier in line get first pick of the chunk encode
+    // budget, so start somewhere else every tick
+    i32 firstPlayerIndex = ScheduleChunkEncodes();
+
+    for (int n = 0; n < (i32) ARRAY_SIZE(serv->entities); n++) {
+        int i = (firstPlayerIndex + n) % (i32) ARRAY_SIZE(serv->entities);
         entity_base * entity = serv->entities + i;
         if (entity->type != ENTITY_PLAYER) {
             continue;
@@ -704,6 +718,10 @@ server_tick(void) {
         send_packets_to_player(entity, &tick_arena);
     }
 
+    ReleaseBroadcastPackets();
+    WakeNetworkThreads();
+    TickNetwork();
+
     EndTimings(SendPlayers);
 
     // clear global messages
@@ -1175,6 +1193,11 @@ main(void) {
 
     LogInfo("Running Blaze");
 
+    DetectCpuFeatures();
+    InitAnvilKernels();
+    InitHeightMapKernels();
+    InitChunkPacketKernels();
+
     // Ignore SIGPIPE so the server doesn't crash (by getting signals) if a
     // client decides to abruptly close its end of the connection.
     signal(SIGPIPE, SIG_IGN);
@@ -1200,7 +1223,9 @@ main(void) {
     // an infinite loop
     // signal(SIGINT, OnSigInt);
 
+#ifndef LIGHT_BENCHMARK
     InitNetwork();
+#endif
 
     serv = calloc(sizeof * serv, 1);
     if (serv == NULL) {
@@ -1257,6 +1282,13 @@ main(void) {
     init_dimension_types();
     init_biomes();
 
+#ifdef LIGHT_BENCHMARK
+    RunLightBenchmark();
+    return 0;
+#endif
+
+    InitJoinPackets();
+
     // @NOTE(traks) chunk sections assume that no changes happen in tick 0, so
     // initialise tick number to something larger than 0 to be safe
     serv->current_tick = 10;
@@ -4,50 +4,2380 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <zlib.h>
 #include "shared.h"
 #include "buffer.h"
+#include "chunk.h"
+#include "network.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#define NETWORK_EPOLL
+#define NETWORK_LINK_INFO
+#else
+#include <poll.h>
+#endif
 
 #define CLIENT_SHOULD_TERMINATE ((u32) 1 << 0)
 #define CLIENT_DID_TRANSFER_TO_PLAYER ((u32) 1 << 1)
+#define CLIENT_SOCKET_READABLE ((u32) 1 << 2)
+#define CLIENT_SOCKET_WRITABLE ((u32) 1 << 3)
+
+// NOTE(traks): what a socket registered for events belongs to. The owner is
+// stored in the upper bits of the event data, the client index in the lower
+// bits.
+enum SocketOwner {
+    SOCKET_OWNER_SERVER,
+    SOCKET_OWNER_CLIENT,
+};
+
+// NOTE(traks): set by the network thread if the connection broke
+#define CONNECTION_CLOSED ((u32) 1 << 0)
+// NOTE(traks): set by the tick thread once it's done with the connection
+#define CONNECTION_RELEASED ((u32) 1 << 1)
+
+// NOTE(traks): only accessed by the network thread
+#define CONNECTION_READABLE ((u32) 1 << 0)
+#define CONNECTION_WRITABLE ((u32) 1 << 1)
+#define CONNECTION_COMPRESSION ((u32) 1 << 2)
+// NOTE(traks): set if decoded packets didn't fit in the inbound ring
+#define CONNECTION_INBOUND_FULL ((u32) 1 << 3)
+
+// NOTE(traks): the actual number of network threads depends on the number of
+// cores, since the network threads do all the packet compression
+#define MAX_NETWORK_THREADS (16)
+
+// NOTE(traks): largest serverbound packet after decompression we accept. Must
+// fit in the largest inbound ring.
+#define MAX_SERVERBOUND_PACKET_SIZE (1 << 17)
+
+// NOTE(traks): Player connections buffer data in fixed-size blocks from a
+// shared pool. Blocks are only held while there's data in them, so idle
+// connections take up little memory. Must be a power of 2, since a block also
+// serves as a player's receive ring.
+#define CONNECTION_BLOCK_SIZE (1 << 16)
+// NOTE(traks): free blocks the pool holds on to for reuse, the rest goes back
+// to the system
+#define MAX_FREE_CONNECTION_BLOCKS (256)
+
+// NOTE(traks): must be powers of 2, and large enough to hold the largest
+// packet (before decompression) we accept
+#define PLAYER_RECEIVE_RING_SIZE CONNECTION_BLOCK_SIZE
+#define CLIENT_RECEIVE_RING_SIZE (1 << 10)
+
+// NOTE(traks): bytes we read from a player's socket per tick. Anything beyond
+// that stays in the socket until the next tick, so a single player can't keep
+// the network thread busy.
+#define MAX_RECEIVE_BYTES_PER_TICK (1 << 16)
+
+#define PACKET_RING_WRAP ((u32) 0xffffffff)
+
+// NOTE(traks): Ring sizes of the packet queues, must be powers of 2. A record
+// can take up at most half a ring, so the largest inbound ring must fit the
+// largest decoded packet, and the largest outbound ring a full tick's worth of
+// packets.
+#define MIN_INBOUND_RING_SIZE (1 << 12)
+#define MAX_INBOUND_RING_SIZE (1 << 18)
+#define MIN_OUTBOUND_RING_SIZE (1 << 14)
+#define MAX_OUTBOUND_RING_SIZE (1 << 21)
+// NOTE(traks): number of checks in a row the producer must find its ring
+// empty before it moves on to a smaller ring
+#define PACKET_RING_SHRINK_CHECKS (100)
+
+// NOTE(traks): Compression levels. Regular packets are small and frequent, so
+// use the fastest level for those. The level of bulk packets starts at zlib's
+// default and moves between the bounds based on the network thread's load.
+#define REGULAR_COMPRESSION_LEVEL (1)
+#define MIN_BULK_COMPRESSION_LEVEL (1)
+#define MAX_BULK_COMPRESSION_LEVEL (9)
+#define INITIAL_BULK_COMPRESSION_LEVEL (6)
+#define COMPRESSION_POLICY_WINDOW_NANOS ((i64) 1000000000)
+
+// NOTE(traks): Internal headers of records in packet batches that refer to a
+// shared chunk packet, followed by a pointer to it. Internal headers of regular
+// packets never equal these. A fill record is followed by the regular chunk
+// packet, which the network thread compresses and stores in the shared chunk
+// packet, unless another network thread got there first.
+#define PACKET_RECORD_FILL_CACHE (0x40)
+#define PACKET_RECORD_CACHED (0x20)
+// NOTE(traks): record that refers to a broadcast packet, followed by a pointer
+// to it
+#define PACKET_RECORD_BROADCAST (0x60)
+
+// NOTE(traks): limit on the compressed data in the chunk packet cache. Chunk
+// packets compress to around 10-40KiB.
+#define CHUNK_PACKET_CACHE_MAX_BYTES ((i64) 64 << 20)
+// NOTE(traks): power of 2
+#define CHUNK_PACKET_CACHE_BUCKETS (4096)
+
+// NOTE(traks): must be a power of 2
+#define MAX_SEND_SEGMENTS (256)
+// NOTE(traks): Clientbound packets are at most 1MiB, since a batch is at most
+// half the largest outbound ring. Compressed or not, such a packet spans at
+// most this many send blocks, and thus takes up at most this many segments.
+#define MAX_SEGMENTS_PER_PACKET (4 + (1 << 20) / SEND_BLOCK_DATA_SIZE)
+// NOTE(traks): limit on the send queue of a single connection, including
+// shared chunk packets. A full send queue holds up the outbound ring, which
+// in turn slows down chunk sending.
+#define MAX_SEND_QUEUE_BYTES (1 << 20)
+// NOTE(traks): limit on the send blocks of all connections together.
+// Connections with an empty send queue can always get a block though, so
+// every connection can make progress.
+#define MAX_BUFFERED_OUTPUT_BYTES ((i64) 256 << 20)
+// NOTE(traks): room we want for compressed data in the current send block,
+// before starting a new block for it
+#define MIN_DEFLATE_OUTPUT_SIZE (256)
+
+// NOTE(traks): segments we pass to a single writev call
+#define MAX_SEND_IOVECS (64)
+
+enum ProtocolState {
+    PROTOCOL_HANDSHAKE,
+    PROTOCOL_AWAIT_STATUS_REQUEST,
+    PROTOCOL_AWAIT_PING_REQUEST,
+    PROTOCOL_AWAIT_HELLO,
+    PROTOCOL_JOIN_WHEN_SENT,
+};
+
+typedef struct {
+    u8 * data;
+    i32 cursor;
+    i32 size;
+} Buffer;
+
+// NOTE(traks): Data received from a socket. Packets are read straight from the
+// ring, so we never have to move data around. Packets can wrap around the end
+// of the ring though.
+typedef struct {
+    u8 * data;
+    // NOTE(traks): not modded by the size, so allowed to wrap around
+    u32 readPos;
+    u32 writePos;
+    // NOTE(traks): power of 2
+    u32 size;
+} ReceiveRing;
+
+typedef struct {
+    int socket;
+    u32 flags;
+
+    ReceiveRing receiveRing;
+    Buffer sendBuf;
+
+    int protocolState;
+    unsigned char username[16];
+    int usernameSize;
+} Client;
+
+// NOTE(traks): Single producer, single consumer queue of variable-size
+// records. Each record is a 4 byte size followed by the data, padded to 4
+// bytes. Records are contiguous in memory: if a record doesn't fit at the end
+// of the ring, we write a wrap marker and put the record at the start.
+typedef struct PacketRing PacketRing;
+struct PacketRing {
+    // NOTE(traks): not modded by the size, so allowed to wrap around. The
+    // producer owns the write position, the consumer the others. The consumer
+    // can hold on to records it consumed, and frees them up by moving the
+    // read position.
+    _Atomic u32 writePos;
+    _Atomic u32 readPos;
+    _Atomic u32 consumedPos;
+    // NOTE(traks): only accessed by the producer. Where the record passed to
+    // BeginPacketRingWrite starts.
+    u32 reservedPos;
+    // NOTE(traks): the ring the producer moved on to. Set once the producer
+    // won't write to this ring anymore.
+    PacketRing * _Atomic next;
+    // NOTE(traks): power of 2
+    u32 size;
+    u8 data[];
+};
+
+// NOTE(traks): Packet rings that grow when records don't fit and shrink when
+// they're idle, so idle connections take up little memory. Rings aren't
+// resized in place, since the other side may be using them. Instead the
+// producer starts writing to a new ring, and the consumer moves on to it once
+// it consumed everything in the old ring. The consumer frees the old ring
+// once it's done with the records in it. Positions carry over from one ring
+// to the next, so they're comparable across rings.
+typedef struct {
+    // NOTE(traks): only accessed by the producer
+    PacketRing * writeRing;
+    i32 idleChecks;
+    u32 recentMaxDataSize;
+
+    // NOTE(traks): only accessed by the consumer. The oldest ring with
+    // records that aren't freed up yet, and the ring it consumes from.
+    PacketRing * readRing;
+    PacketRing * consumeRing;
+
+    // NOTE(traks): the consumer's consumed position, for the producer
+    _Atomic u32 publishedConsumedPos;
+    // NOTE(traks): memory of all rings, for reporting
+    _Atomic i32 memory;
+    u32 minSize;
+    u32 maxSize;
+} PacketQueue;
+
+typedef struct NetworkThread NetworkThread;
+typedef struct ChunkPacket ChunkPacket;
+
+// NOTE(traks): a pool block holding finalised packet data of a connection
+typedef struct {
+    i32 used;
+    // NOTE(traks): segments in the send queue that point into the block
+    i32 segmentCount;
+    u8 data[];
+} SendBlock;
+
+#define SEND_BLOCK_DATA_SIZE ((i32) (CONNECTION_BLOCK_SIZE - sizeof (SendBlock)))
+
+// NOTE(traks): A piece of finalised packet data waiting to be sent. Points
+// into one of the connection's send blocks, into a shared chunk packet or
+// broadcast packet we hold a reference to, or if none is set, into the
+// outbound ring.
+typedef struct {
+    u8 * data;
+    i32 size;
+    SendBlock * block;
+    ChunkPacket * chunkPacket;
+    BroadcastPacket * broadcastPacket;
+    // NOTE(traks): the outbound ring can be freed up to here once the segment
+    // is sent, since segments after it only point into later batches
+    u32 outboundRelease;
+} SendSegment;
+
+struct PlayerConnection {
+    int socket;
+    _Atomic u32 atomicFlags;
+    NetworkThread * thread;
+
+    // NOTE(traks): decoded serverbound packets, from the network thread to the
+    // tick thread
+    PacketQueue inbound;
+    // NOTE(traks): batches of clientbound packets, from the tick thread to the
+    // network thread. Packets are in the internal format of begin_packet and
+    // finish_packet, so the network thread still has to compress them.
+    PacketQueue outbound;
+
+    // NOTE(traks): everything below is only accessed by the network thread
+    u32 flags;
+    ReceiveRing receiveRing;
+    i32 tickReceivedBytes;
+    // NOTE(traks): Finalised packet data ready to be sent, as a queue of
+    // segments we hand to writev. Data we write ourselves goes into send
+    // blocks, the last of which we're writing into. Data is never moved around
+    // after it's written, and shared chunk packets aren't copied at all.
+    SendBlock * sendBlock;
+    SendSegment sendSegments[MAX_SEND_SEGMENTS];
+    u32 sendSegmentHead;
+    u32 sendSegmentTail;
+    i32 sendQueueBytes;
+    // NOTE(traks): segments that point into the outbound ring
+    i32 outboundSegmentCount;
+    // NOTE(traks): how far into the batch at the front of the outbound ring we
+    // have finalised packets
+    i32 outboundBatchIndex;
+    i64 totalSentBytes;
+    // NOTE(traks): number of sends in a row after which data was left in the
+    // send buffer
+    i32 sendStallStreak;
+
+    // NOTE(traks): link statistics for the tick thread, see PlayerLinkStats
+    _Atomic i64 deliveredBytes;
+    _Atomic i32 unsentBytes;
+    _Atomic i32 publishedStallStreak;
+    _Atomic i32 rttMicros;
+    // NOTE(traks): pool blocks the connection holds, for reporting
+    _Atomic i32 pooledBytes;
+};
+
+struct NetworkThread {
+    pthread_t thread;
+#ifdef NETWORK_EPOLL
+    int epollFd;
+#else
+    struct pollfd pollFds[MAX_PLAYERS + 1];
+#endif
+    int wakeReadFd;
+    int wakeWriteFd;
+
+    pthread_mutex_t mutex;
+    // NOTE(traks): connections handed to the thread, protected by the mutex
+    PlayerConnection * newConnections[MAX_PLAYERS];
+    i32 newConnectionCount;
+
+    // NOTE(traks): only accessed by the network thread
+    PlayerConnection * connections[MAX_PLAYERS];
+    i32 connectionCount;
+    // NOTE(traks): reset before every packet instead of setting up zlib's
+    // state (hundreds of KiB) again for every packet
+    z_stream deflateStream;
+    z_stream bulkDeflateStream;
+    z_stream inflateStream;
+
+    // NOTE(traks): If the thread spends a lot of time compressing, it's the
+    // bottleneck, so compress bulk packets faster. If sends stall while the
+    // thread has time to spare, bandwidth is the bottleneck, so compress
+    // better.
+    i32 bulkLevel;
+    i64 policyWindowStart;
+    i64 windowDeflateNanos;
+    i32 windowSendStalls;
+
+    // NOTE(traks): statistics, reset by the tick thread when it logs them
+    _Atomic i64 bytesBeforeCompression;
+    _Atomic i64 bytesAfterCompression;
+    _Atomic i64 deflateNanos;
+    _Atomic i64 packetsBelowThreshold;
+    _Atomic i32 reportedBulkLevel;
+
+    // NOTE(traks): only accessed by the tick thread
+    i32 assignedCount;
+};
+
+// NOTE(traks): a compressed chunk packet shared by all players
+struct ChunkPacket {
+    // NOTE(traks): only accessed by the tick thread
+    u64 packedPos;
+    u64 contentVersion;
+    ChunkPacket * hashNext;
+    ChunkPacket * lruPrev;
+    ChunkPacket * lruNext;
+
+    // NOTE(traks): one reference for the cache and one for every packet
+    // record that refers to the packet
+    _Atomic i32 refCount;
+    // NOTE(traks): the network thread that claims the packet compresses it.
+    // Once filled, the fields below are no longer modified.
+    _Atomic i32 fillState;
+    u8 * data;
+    i32 size;
+    i32 uncompressedSize;
+};
+
+struct BroadcastPacket {
+    // NOTE(traks): one for the creator and one for every packet record that
+    // refers to the packet
+    _Atomic i32 refCount;
+    i32 size;
+    // NOTE(traks): finalised packets, ready to be sent as is
+    u8 data[];
+};
+
+typedef struct {
+    // NOTE(traks): only accessed by the tick thread
+    ChunkPacket * buckets[CHUNK_PACKET_CACHE_BUCKETS];
+    // NOTE(traks): most recently used at the head
+    ChunkPacket * lruHead;
+    ChunkPacket * lruTail;
+    i64 hits;
+    i64 misses;
+    // NOTE(traks): packets that were still being compressed when requested,
+    // but that network threads found in the cache afterwards
+    _Atomic i64 lateHits;
+
+    // NOTE(traks): compressed data of all chunk packets still in memory,
+    // including evicted ones that are still referred to
+    _Atomic i64 memoryUsage;
+} ChunkPacketCache;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    // NOTE(traks): free blocks, linked through their first bytes. Protected
+    // by the mutex.
+    void * freeList;
+    i32 freeCount;
+
+    _Atomic i32 allocatedBlocks;
+    // NOTE(traks): memory in send blocks, limited to MAX_BUFFERED_OUTPUT_BYTES
+    _Atomic i64 sendBlockBytes;
+} ConnectionBlockPool;
+
+// NOTE(traks): a client that finished logging in, waiting for the tick
+// thread to create its player entity
+typedef struct {
+    int socket;
+    unsigned char username[16];
+    int usernameSize;
+} PendingJoin;
+
+typedef struct {
+    // NOTE(traks): everything up to the login mutex is only accessed by the
+    // login thread
+    Client * * clientArray;
+    i32 clientArraySize;
+    int serverSocket;
+    i32 serverSocketReadable;
+#ifdef NETWORK_EPOLL
+    int epollFd;
+#endif
+    pthread_t loginThread;
+
+    // NOTE(traks): protects the status response and the pending joins
+    pthread_mutex_t loginMutex;
+    u8 statusResponse[2048];
+    i32 statusResponseSize;
+    PendingJoin pendingJoins[64];
+    i32 pendingJoinCount;
+
+    NetworkThread * networkThreads;
+    i32 networkThreadCount;
+    ChunkPacketCache chunkPacketCache;
+    ConnectionBlockPool blockPool;
+
+    // NOTE(traks): only accessed by the tick thread
+    z_stream broadcastDeflateStream;
+    i64 broadcastRecords;
+} Network;
+
+static Network network;
+
+static void ReleaseChunkPacket(ChunkPacket * packet) {
+    if (atomic_fetch_sub_explicit(&packet->refCount, 1, memory_order_acq_rel) == 1) {
+        atomic_fetch_sub_explicit(&network.chunkPacketCache.memoryUsage, packet->size, memory_order_relaxed);
+        free(packet->data);
+        free(packet);
+    }
+}
+
+enum ChunkPacketFillState {
+    CHUNK_PACKET_EMPTY,
+    CHUNK_PACKET_FILLING,
+    CHUNK_PACKET_FILLED,
+};
+
+static ChunkPacket * ReadChunkPacketRecord(Cursor * cursor) {
+    ChunkPacket * packet;
+    memcpy(&packet, cursor->data + cursor->index + 1, sizeof packet);
+    cursor->index += 1 + sizeof packet;
+    return packet;
+}
+
+void ReleaseBroadcastPacket(BroadcastPacket * packet) {
+    if (atomic_fetch_sub_explicit(&packet->refCount, 1, memory_order_acq_rel) == 1) {
+        free(packet);
+    }
+}
+
+static BroadcastPacket * ReadBroadcastPacketRecord(Cursor * cursor) {
+    BroadcastPacket * packet;
+    memcpy(&packet, cursor->data + cursor->index + 1, sizeof packet);
+    cursor->index += 1 + sizeof packet;
+    return packet;
+}
+
+static i32 IsChunkPacketFilled(ChunkPacket * packet) {
+    return atomic_load_explicit(&packet->fillState, memory_order_acquire) == CHUNK_PACKET_FILLED;
+}
+
+// NOTE(traks): returns whether the calling network thread should fill the
+// packet
+static i32 ClaimChunkPacket(ChunkPacket * packet) {
+    i32 expected = CHUNK_PACKET_EMPTY;
+    return atomic_compare_exchange_strong_explicit(&packet->fillState, &expected, CHUNK_PACKET_FILLING, memory_order_relaxed, memory_order_relaxed);
+}
+
+static u32 PacketRingRecordSize(u32 dataSize) {
+    return 4 + ((dataSize + 3) & ~(u32) 3);
+}
+
+// NOTE(traks): Returns where the record data should be written, or NULL if
+// there's no room for it. Call CommitPacketRingWrite once the data is written.
+// The record may end up smaller than the size passed in here.
+static u8 * BeginPacketRingWrite(PacketRing * ring, u32 dataSize) {
+    u32 recordSize = PacketRingRecordSize(dataSize);
+    if (dataSize > ring->size / 2) {
+        return NULL;
+    }
+
+    u32 writePos = atomic_load_explicit(&ring->writePos, memory_order_relaxed);
+    u32 readPos = atomic_load_explicit(&ring->readPos, memory_order_acquire);
+    u32 freeSize = ring->size - (writePos - readPos);
+    u32 offset = writePos & (ring->size - 1);
+    u32 contiguous = ring->size - offset;
+
+    if (contiguous < recordSize) {
+        // NOTE(traks): skip to the start of the ring. The consumer only finds
+        // out about the skip once the record is committed, so it doesn't count
+        // as queued data before then.
+        if (freeSize < contiguous + recordSize) {
+            return NULL;
+        }
+        memcpy(ring->data + offset, &(u32) {PACKET_RING_WRAP}, 4);
+        writePos += contiguous;
+        offset = 0;
+    } else if (freeSize < recordSize) {
+        return NULL;
+    }
+
+    ring->reservedPos = writePos;
+    return ring->data + offset + 4;
+}
+
+static void CommitPacketRingWrite(PacketRing * ring, u32 dataSize) {
+    u32 writePos = ring->reservedPos;
+    memcpy(ring->data + (writePos & (ring->size - 1)), &dataSize, 4);
+    atomic_store_explicit(&ring->writePos, writePos + PacketRingRecordSize(dataSize), memory_order_release);
+}
+
+// NOTE(traks): returns the data of the first record that isn't consumed yet,
+// or NULL if there is none
+static u8 * PeekPacketRing(PacketRing * ring, u32 * dataSize) {
+    u32 consumedPos = atomic_load_explicit(&ring->consumedPos, memory_order_relaxed);
+    for (;;) {
+        u32 writePos = atomic_load_explicit(&ring->writePos, memory_order_acquire);
+        if (consumedPos == writePos) {
+            return NULL;
+        }
+
+        u32 offset = consumedPos & (ring->size - 1);
+        u32 size;
+        memcpy(&size, ring->data + offset, 4);
+        if (size == PACKET_RING_WRAP) {
+            consumedPos += ring->size - offset;
+            atomic_store_explicit(&ring->consumedPos, consumedPos, memory_order_relaxed);
+            continue;
+        }
+
+        *dataSize = size;
+        return ring->data + offset + 4;
+    }
+}
+
+// NOTE(traks): consumes the record returned by PeekPacketRing, but keeps it
+// around until the read position moves past it
+static void ConsumePacketRing(PacketRing * ring, u32 dataSize) {
+    u32 consumedPos = atomic_load_explicit(&ring->consumedPos, memory_order_relaxed);
+    atomic_store_explicit(&ring->consumedPos, consumedPos + PacketRingRecordSize(dataSize), memory_order_relaxed);
+}
+
+// NOTE(traks): frees up everything before the given position, which must lie
+// between the read position and the consumed position
+static void FreePacketRingUpTo(PacketRing * ring, u32 pos) {
+    atomic_store_explicit(&ring->readPos, pos, memory_order_release);
+}
+
+static PacketRing * CreatePacketRing(PacketQueue * queue, u32 size, u32 pos) {
+    PacketRing * ring = malloc(sizeof *ring + size);
+    if (ring == NULL) {
+        return NULL;
+    }
+    *ring = (PacketRing) {
+        .writePos = pos,
+        .readPos = pos,
+        .consumedPos = pos,
+        .size = size,
+    };
+    atomic_fetch_add_explicit(&queue->memory, sizeof *ring + size, memory_order_relaxed);
+    return ring;
+}
+
+static void FreePacketRing(PacketQueue * queue, PacketRing * ring) {
+    atomic_fetch_sub_explicit(&queue->memory, sizeof *ring + ring->size, memory_order_relaxed);
+    free(ring);
+}
+
+static i32 InitPacketQueue(PacketQueue * queue, u32 minSize, u32 maxSize) {
+    queue->minSize = minSize;
+    queue->maxSize = maxSize;
+    PacketRing * ring = CreatePacketRing(queue, minSize, 0);
+    if (ring == NULL) {
+        return 0;
+    }
+    queue->writeRing = ring;
+    queue->readRing = ring;
+    queue->consumeRing = ring;
+    return 1;
+}
+
+// NOTE(traks): only call once neither side uses the queue anymore
+static void FreePacketQueue(PacketQueue * queue) {
+    PacketRing * ring = queue->readRing;
+    while (ring != NULL) {
+        PacketRing * next = atomic_load_explicit(&ring->next, memory_order_relaxed);
+        FreePacketRing(queue, ring);
+        ring = next;
+    }
+}
+
+// NOTE(traks): returns the smallest ring size of the queue that can hold a
+// record of the given size, or 0 if the record is too large
+static u32 GetPacketRingSizeFor(PacketQueue * queue, u32 dataSize) {
+    u32 size = queue->minSize;
+    while (dataSize > size / 2) {
+        if (size >= queue->maxSize) {
+            return 0;
+        }
+        size *= 2;
+    }
+    return size;
+}
+
+// NOTE(traks): the producer moves on to a new ring, starting at the position
+// where the old ring ends
+static PacketRing * StartNewPacketRing(PacketQueue * queue, u32 size) {
+    PacketRing * old = queue->writeRing;
+    PacketRing * ring = CreatePacketRing(queue, size, atomic_load_explicit(&old->writePos, memory_order_relaxed));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_store_explicit(&old->next, ring, memory_order_release);
+    queue->writeRing = ring;
+    queue->idleChecks = 0;
+    return ring;
+}
+
+// NOTE(traks): Same as BeginPacketRingWrite, but for the producer's ring. If
+// the record doesn't fit and canGrow is set, the producer moves on to a larger
+// ring, unless the ring is as large as it gets already.
+static u8 * BeginPacketQueueWrite(PacketQueue * queue, u32 dataSize, i32 canGrow) {
+    PacketRing * ring = queue->writeRing;
+    u8 * res = BeginPacketRingWrite(ring, dataSize);
+    if (res != NULL || !canGrow || ring->size >= queue->maxSize) {
+        return res;
+    }
+
+    u32 size = GetPacketRingSizeFor(queue, dataSize);
+    if (size == 0) {
+        return NULL;
+    }
+    // NOTE(traks): if the ring filled up, the producer is probably going to
+    // write a lot more
+    size = MAX(size, 2 * ring->size);
+    ring = StartNewPacketRing(queue, size);
+    if (ring == NULL) {
+        return NULL;
+    }
+    return BeginPacketRingWrite(ring, dataSize);
+}
+
+static void CommitPacketQueueWrite(PacketQueue * queue, u32 dataSize) {
+    CommitPacketRingWrite(queue->writeRing, dataSize);
+    queue->recentMaxDataSize = MAX(queue->recentMaxDataSize, dataSize);
+}
+
+// NOTE(traks): The producer calls this regularly. Once its ring has been
+// empty for a while, it moves on to a smaller ring that still fits the
+// records written since the last time it checked.
+static void ShrinkIdlePacketQueue(PacketQueue * queue) {
+    PacketRing * ring = queue->writeRing;
+    u32 writePos = atomic_load_explicit(&ring->writePos, memory_order_relaxed);
+    u32 readPos = atomic_load_explicit(&ring->readPos, memory_order_acquire);
+    if (readPos != writePos) {
+        queue->idleChecks = 0;
+        return;
+    }
+
+    queue->idleChecks++;
+    if (queue->idleChecks < PACKET_RING_SHRINK_CHECKS) {
+        return;
+    }
+
+    u32 size = GetPacketRingSizeFor(queue, queue->recentMaxDataSize);
+    queue->idleChecks = 0;
+    queue->recentMaxDataSize = 0;
+    if (size < ring->size) {
+        StartNewPacketRing(queue, size);
+    }
+}
+
+// NOTE(traks): Same as PeekPacketRing, but for the consumer's ring. Once the
+// consumer's ring is used up and the producer moved on, the consumer moves on
+// too.
+static u8 * PeekPacketQueue(PacketQueue * queue, u32 * dataSize) {
+    for (;;) {
+        PacketRing * ring = queue->consumeRing;
+        u8 * res = PeekPacketRing(ring, dataSize);
+        if (res != NULL) {
+            return res;
+        }
+        PacketRing * next = atomic_load_explicit(&ring->next, memory_order_acquire);
+        if (next == NULL) {
+            return NULL;
+        }
+        // NOTE(traks): the producer may have written more records before it
+        // moved on
+        res = PeekPacketRing(ring, dataSize);
+        if (res != NULL) {
+            return res;
+        }
+
+        queue->consumeRing = next;
+        u32 readPos = atomic_load_explicit(&ring->readPos, memory_order_relaxed);
+        u32 writePos = atomic_load_explicit(&ring->writePos, memory_order_relaxed);
+        if (queue->readRing == ring && readPos == writePos) {
+            queue->readRing = next;
+            FreePacketRing(queue, ring);
+        }
+    }
+}
+
+static u32 GetPacketQueueConsumedPos(PacketQueue * queue) {
+    return atomic_load_explicit(&queue->consumeRing->consumedPos, memory_order_relaxed);
+}
+
+static void ConsumePacketQueue(PacketQueue * queue, u32 dataSize) {
+    ConsumePacketRing(queue->consumeRing, dataSize);
+    atomic_store_explicit(&queue->publishedConsumedPos, GetPacketQueueConsumedPos(queue), memory_order_relaxed);
+}
+
+// NOTE(traks): Frees up everything before the given position, which must lie
+// between the read position of the consumer's oldest ring and the consumed
+// position. Rings the consumer moved on from are freed entirely once
+// everything in them is freed up.
+static void FreePacketQueueUpTo(PacketQueue * queue, u32 pos) {
+    for (;;) {
+        PacketRing * ring = queue->readRing;
+        if (ring != queue->consumeRing) {
+            u32 end = atomic_load_explicit(&ring->writePos, memory_order_relaxed);
+            if ((i32) (pos - end) >= 0) {
+                queue->readRing = atomic_load_explicit(&ring->next, memory_order_relaxed);
+                FreePacketRing(queue, ring);
+                continue;
+            }
+        }
+        FreePacketRingUpTo(ring, pos);
+        return;
+    }
+}
+
+// NOTE(traks): consumes the record returned by PeekPacketQueue and frees it up
+// along with everything before it
+static void PopPacketQueue(PacketQueue * queue, u32 dataSize) {
+    ConsumePacketQueue(queue, dataSize);
+    FreePacketQueueUpTo(queue, GetPacketQueueConsumedPos(queue));
+}
+
+static i32 IsSendQueueEmpty(PlayerConnection * conn) {
+    return conn->sendSegmentHead == conn->sendSegmentTail;
+}
+
+// NOTE(traks): copies the compressed data of a packet that was compressed
+// straight into the send queue. The data starts skip bytes into the given
+// segment and may continue in the segments after it.
+static void FillChunkPacket(PlayerConnection * conn, ChunkPacket * packet, u32 firstSegment, i32 skip, i32 size, i32 uncompressedSize) {
+    packet->data = malloc(size);
+    if (packet->data == NULL) {
+        // NOTE(traks): let someone else try
+        atomic_store_explicit(&packet->fillState, CHUNK_PACKET_EMPTY, memory_order_relaxed);
+        return;
+    }
+    i32 copied = 0;
+    for (u32 i = firstSegment; copied < size; i++) {
+        SendSegment * segment = conn->sendSegments + (i & (MAX_SEND_SEGMENTS - 1));
+        i32 copySize = segment->size - skip;
+        memcpy(packet->data + copied, segment->data + skip, copySize);
+        copied += copySize;
+        skip = 0;
+    }
+    packet->size = size;
+    packet->uncompressedSize = uncompressedSize;
+    atomic_fetch_add_explicit(&network.chunkPacketCache.memoryUsage, size, memory_order_relaxed);
+    atomic_store_explicit(&packet->fillState, CHUNK_PACKET_FILLED, memory_order_release);
+}
+
+static void * AcquireConnectionBlock(PlayerConnection * conn) {
+    ConnectionBlockPool * pool = &network.blockPool;
+    pthread_mutex_lock(&pool->mutex);
+    void * block = pool->freeList;
+    if (block != NULL) {
+        memcpy(&pool->freeList, block, sizeof pool->freeList);
+        pool->freeCount--;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (block == NULL) {
+        block = malloc(CONNECTION_BLOCK_SIZE);
+        if (block == NULL) {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->allocatedBlocks, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&conn->pooledBytes, CONNECTION_BLOCK_SIZE, memory_order_relaxed);
+    return block;
+}
+
+static void ReleaseConnectionBlock(PlayerConnection * conn, void * block) {
+    ConnectionBlockPool * pool = &network.blockPool;
+    atomic_fetch_sub_explicit(&conn->pooledBytes, CONNECTION_BLOCK_SIZE, memory_order_relaxed);
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->freeCount < MAX_FREE_CONNECTION_BLOCKS) {
+        memcpy(block, &pool->freeList, sizeof pool->freeList);
+        pool->freeList = block;
+        pool->freeCount++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (block != NULL) {
+        free(block);
+        atomic_fetch_sub_explicit(&pool->allocatedBlocks, 1, memory_order_relaxed);
+    }
+}
+
+// NOTE(traks): returns NULL if we're out of memory, or if all connections
+// together buffer too much output already and force isn't set
+static SendBlock * AcquireSendBlock(PlayerConnection * conn, i32 force) {
+    ConnectionBlockPool * pool = &network.blockPool;
+    if (!force && atomic_load_explicit(&pool->sendBlockBytes, memory_order_relaxed) >= MAX_BUFFERED_OUTPUT_BYTES) {
+        return NULL;
+    }
+    SendBlock * block = AcquireConnectionBlock(conn);
+    if (block == NULL) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&pool->sendBlockBytes, CONNECTION_BLOCK_SIZE, memory_order_relaxed);
+    block->used = 0;
+    block->segmentCount = 0;
+    return block;
+}
+
+static void ReleaseSendBlock(PlayerConnection * conn, SendBlock * block) {
+    atomic_fetch_sub_explicit(&network.blockPool.sendBlockBytes, CONNECTION_BLOCK_SIZE, memory_order_relaxed);
+    ReleaseConnectionBlock(conn, block);
+}
+
+// NOTE(traks): whether the send queue can take another packet. An empty send
+// queue always can, so large packets don't get stuck.
+static i32 HasSendRoom(PlayerConnection * conn) {
+    if (IsSendQueueEmpty(conn)) {
+        return 1;
+    }
+    return conn->sendSegmentTail - conn->sendSegmentHead <= MAX_SEND_SEGMENTS - MAX_SEGMENTS_PER_PACKET
+            && conn->sendQueueBytes < MAX_SEND_QUEUE_BYTES;
+}
+
+// NOTE(traks): Returns where at least minSize bytes of send data can be
+// written, and stores how many bytes can be written there in available.
+// minSize can be at most SEND_BLOCK_DATA_SIZE. Returns NULL if there's too much
+// output buffered already, unless force is set. Call CommitSendData once the
+// data is written.
+static u8 * ReserveSendData(PlayerConnection * conn, i32 minSize, i32 force, i32 * available) {
+    SendBlock * block = conn->sendBlock;
+    if (block != NULL && block->segmentCount == 0) {
+        // NOTE(traks): everything in the block was sent, so start over
+        block->used = 0;
+    }
+    if (block == NULL || SEND_BLOCK_DATA_SIZE - block->used < minSize) {
+        SendBlock * newBlock = AcquireSendBlock(conn, force || IsSendQueueEmpty(conn));
+        if (newBlock == NULL) {
+            return NULL;
+        }
+        if (block != NULL && block->segmentCount == 0) {
+            ReleaseSendBlock(conn, block);
+        }
+        conn->sendBlock = newBlock;
+        block = newBlock;
+    }
+    *available = SEND_BLOCK_DATA_SIZE - block->used;
+    return block->data + block->used;
+}
+
+// NOTE(traks): data must lie in the space returned by ReserveSendData, but
+// doesn't have to start at the front of it
+static void CommitSendData(PlayerConnection * conn, u8 * data, i32 size) {
+    SendBlock * block = conn->sendBlock;
+    block->used = (data + size) - block->data;
+    conn->sendQueueBytes += size;
+
+    // NOTE(traks): extend the last segment if we can, so we don't end up with
+    // a segment for every tiny packet
+    if (!IsSendQueueEmpty(conn)) {
+        SendSegment * last = conn->sendSegments + ((conn->sendSegmentTail - 1) & (MAX_SEND_SEGMENTS - 1));
+        if (last->block == block && last->data + last->size == data) {
+            last->size += size;
+            return;
+        }
+    }
+
+    conn->sendSegments[conn->sendSegmentTail & (MAX_SEND_SEGMENTS - 1)] = (SendSegment) {
+        .data = data,
+        .size = size,
+        .block = block,
+        .outboundRelease = GetPacketQueueConsumedPos(&conn->outbound),
+    };
+    conn->sendSegmentTail++;
+    block->segmentCount++;
+}
+
+// NOTE(traks): Queues finalised packet data that lies in the batch at the
+// front of the outbound ring, so it's sent without copying. The batch stays in
+// the ring until the data is sent.
+static void QueueOutboundData(PlayerConnection * conn, u8 * data, i32 size) {
+    conn->sendQueueBytes += size;
+
+    if (!IsSendQueueEmpty(conn)) {
+        SendSegment * last = conn->sendSegments + ((conn->sendSegmentTail - 1) & (MAX_SEND_SEGMENTS - 1));
+        if (last->block == NULL && last->chunkPacket == NULL && last->broadcastPacket == NULL && last->data + last->size == data) {
+            last->size += size;
+            return;
+        }
+    }
+
+    conn->sendSegments[conn->sendSegmentTail & (MAX_SEND_SEGMENTS - 1)] = (SendSegment) {
+        .data = data,
+        .size = size,
+        .outboundRelease = GetPacketQueueConsumedPos(&conn->outbound),
+    };
+    conn->sendSegmentTail++;
+    conn->outboundSegmentCount++;
+}
+
+// NOTE(traks): Returns 0 if the send queue is full. Otherwise the send queue
+// takes over the caller's reference to the packet and sends its data straight
+// from the cache.
+static i32 QueueSharedChunkPacket(PlayerConnection * conn, ChunkPacket * packet) {
+    i32 available;
+    u8 * header = ReserveSendData(conn, 10, 0, &available);
+    if (header == NULL) {
+        return 0;
+    }
+    Cursor * headerCursor = &(Cursor) {.data = header, .size = 10};
+    WriteVarU32(headerCursor, VarU32Size(packet->uncompressedSize) + packet->size);
+    WriteVarU32(headerCursor, packet->uncompressedSize);
+    CommitSendData(conn, header, headerCursor->index);
+
+    conn->sendSegments[conn->sendSegmentTail & (MAX_SEND_SEGMENTS - 1)] = (SendSegment) {
+        .data = packet->data,
+        .size = packet->size,
+        .chunkPacket = packet,
+        .outboundRelease = GetPacketQueueConsumedPos(&conn->outbound),
+    };
+    conn->sendSegmentTail++;
+    conn->sendQueueBytes += packet->size;
+    return 1;
+}
+
+// NOTE(traks): the send queue takes over the caller's reference to the packet
+static void QueueBroadcastPacket(PlayerConnection * conn, BroadcastPacket * packet) {
+    conn->sendSegments[conn->sendSegmentTail & (MAX_SEND_SEGMENTS - 1)] = (SendSegment) {
+        .data = packet->data,
+        .size = packet->size,
+        .broadcastPacket = packet,
+        .outboundRelease = GetPacketQueueConsumedPos(&conn->outbound),
+    };
+    conn->sendSegmentTail++;
+    conn->sendQueueBytes += packet->size;
+}
+
+// NOTE(traks): frees up the first size bytes of the send queue
+static void PopSendData(PlayerConnection * conn, i32 size) {
+    conn->sendQueueBytes -= size;
+    while (size > 0) {
+        SendSegment * segment = conn->sendSegments + (conn->sendSegmentHead & (MAX_SEND_SEGMENTS - 1));
+        if (size < segment->size) {
+            segment->data += size;
+            segment->size -= size;
+            break;
+        }
+        size -= segment->size;
+        if (segment->chunkPacket != NULL) {
+            ReleaseChunkPacket(segment->chunkPacket);
+        } else if (segment->broadcastPacket != NULL) {
+            ReleaseBroadcastPacket(segment->broadcastPacket);
+        } else if (segment->block != NULL) {
+            SendBlock * block = segment->block;
+            block->segmentCount--;
+            if (block->segmentCount == 0 && block != conn->sendBlock) {
+                ReleaseSendBlock(conn, block);
+            }
+        } else {
+            conn->outboundSegmentCount--;
+        }
+        conn->sendSegmentHead++;
+    }
+}
+
+// NOTE(traks): gives the connection's buffers back to the pool if they're
+// empty. The connection gets new ones once it needs them.
+static void ReleaseIdleBuffers(PlayerConnection * conn) {
+    if (conn->sendBlock != NULL && IsSendQueueEmpty(conn)) {
+        ReleaseSendBlock(conn, conn->sendBlock);
+        conn->sendBlock = NULL;
+    }
+    ReceiveRing * ring = &conn->receiveRing;
+    if (ring->data != NULL && ring->readPos == ring->writePos) {
+        ReleaseConnectionBlock(conn, ring->data);
+        ring->data = NULL;
+    }
+    ShrinkIdlePacketQueue(&conn->inbound);
+}
+
+// NOTE(traks): skips a packet record that doesn't refer to a shared packet
+static void SkipPacketRecord(Cursor * cursor) {
+    int internalHeader = cursor->data[cursor->index];
+    if (!(internalHeader & PACKET_HEADER_FRAMED)) {
+        cursor->index += 1 + (internalHeader & 0x7);
+    }
+    i32 size = ReadVarU32(cursor);
+    cursor->index += size;
+}
+
+// NOTE(traks): releases the shared packets the records in the batch refer to,
+// for batches that won't be sent
+static void ReleasePacketRecords(u8 * data, i32 start, i32 end) {
+    Cursor * cursor = &(Cursor) {.data = data, .size = end, .index = start};
+    while (cursor->index < cursor->size) {
+        int internalHeader = cursor->data[cursor->index];
+        if (internalHeader == PACKET_RECORD_FILL_CACHE || internalHeader == PACKET_RECORD_CACHED) {
+            ReleaseChunkPacket(ReadChunkPacketRecord(cursor));
+        } else if (internalHeader == PACKET_RECORD_BROADCAST) {
+            ReleaseBroadcastPacket(ReadBroadcastPacketRecord(cursor));
+        } else {
+            SkipPacketRecord(cursor);
+        }
+    }
+}
+
+// NOTE(traks): Sockets are registered edge-triggered, so we only hear about a
+// socket again once new data arrives or once room frees up in its send buffer.
+// Readiness is remembered in flags, which are cleared once a read or write
+// runs out of data or room. That way idle sockets cost no syscalls at all.
+static i32 RegisterSocket(int socket, u32 owner, u32 id) {
+#ifdef NETWORK_EPOLL
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.u64 = ((u64) owner << 32) | id,
+    };
+    if (epoll_ctl(network.epollFd, EPOLL_CTL_ADD, socket, &event) == -1) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static i32 UnregisterSocket(int socket) {
+#ifdef NETWORK_EPOLL
+    if (epoll_ctl(network.epollFd, EPOLL_CTL_DEL, socket, NULL) == -1) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static i32 SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return 0;
+    }
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return 0;
+    }
+    return 1;
+}
+
+// NOTE(traks): frees up the part of the outbound queue that's consumed and
+// that no send segments point into anymore
+static void ReleaseOutbound(PlayerConnection * conn) {
+    PacketQueue * queue = &conn->outbound;
+    u32 releasePos = GetPacketQueueConsumedPos(queue);
+    if (conn->outboundSegmentCount > 0) {
+        releasePos = conn->sendSegments[conn->sendSegmentHead & (MAX_SEND_SEGMENTS - 1)].outboundRelease;
+    }
+    // NOTE(traks): the segment at the front may be older than what we already
+    // freed up
+    u32 readPos = atomic_load_explicit(&queue->readRing->readPos, memory_order_relaxed);
+    if ((i32) (releasePos - readPos) > 0) {
+        FreePacketQueueUpTo(queue, releasePos);
+    }
+}
+
+static void MarkConnectionClosed(PlayerConnection * conn) {
+    atomic_fetch_or_explicit(&conn->atomicFlags, CONNECTION_CLOSED, memory_order_release);
+}
+
+static void FreePlayerConnection(PlayerConnection * conn) {
+    for (;;) {
+        u32 batchSize;
+        u8 * batch = PeekPacketQueue(&conn->outbound, &batchSize);
+        if (batch == NULL) {
+            break;
+        }
+        ReleasePacketRecords(batch, conn->outboundBatchIndex, batchSize);
+        PopPacketQueue(&conn->outbound, batchSize);
+        conn->outboundBatchIndex = 0;
+    }
+    PopSendData(conn, conn->sendQueueBytes);
+    if (conn->sendBlock != NULL) {
+        ReleaseSendBlock(conn, conn->sendBlock);
+    }
+    if (conn->receiveRing.data != NULL) {
+        ReleaseConnectionBlock(conn, conn->receiveRing.data);
+    }
+
+    // NOTE(traks): also removes the socket from the network thread's epoll
+    // instance
+    close(conn->socket);
+    FreePacketQueue(&conn->inbound);
+    FreePacketQueue(&conn->outbound);
+    free(conn);
+}
+
+static u32 ReceiveRingFree(ReceiveRing * ring) {
+    return ring->size - (ring->writePos - ring->readPos);
+}
+
+// NOTE(traks): receives up to maxSize bytes into the free part of the ring,
+// which may wrap around, with a single system call. Returns the same as recv.
+static ssize_t ReceiveIntoRing(int socket, ReceiveRing * ring, u32 maxSize) {
+    u32 offset = ring->writePos & (ring->size - 1);
+    u32 firstSize = MIN(maxSize, ring->size - offset);
+    struct iovec iovecs[2] = {
+        {.iov_base = ring->data + offset, .iov_len = firstSize},
+        {.iov_base = ring->data, .iov_len = maxSize - firstSize},
+    };
+    ssize_t res = readv(socket, iovecs, maxSize > firstSize ? 2 : 1);
+    if (res > 0) {
+        ring->writePos += res;
+    }
+    return res;
+}
+
+// NOTE(traks): Reads the VarU32 at the given position. Returns how many bytes
+// it takes up, 0 if it hasn't been fully received yet, or -1 if it's too long.
+static i32 PeekReceiveRingVarU32(ReceiveRing * ring, u32 pos, u32 * value) {
+    u32 res = 0;
+    for (i32 i = 0; i < 5; i++) {
+        if (pos + i == ring->writePos) {
+            return 0;
+        }
+        u8 in = ring->data[(pos + i) & (ring->size - 1)];
+        res |= (u32) (in & 0x7f) << (i * 7);
+        if ((in & 0x80) == 0) {
+            *value = res;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// NOTE(traks): splits the data at the given position into the part up to the
+// end of the ring and the part that wrapped around to the start
+static void GetReceiveRingSpans(ReceiveRing * ring, u32 pos, i32 size, u8 * * first, i32 * firstSize, i32 * restSize) {
+    u32 offset = pos & (ring->size - 1);
+    *first = ring->data + offset;
+    *firstSize = MIN((u32) size, ring->size - offset);
+    *restSize = size - *firstSize;
+}
+
+static void CopyFromReceiveRing(ReceiveRing * ring, u32 pos, u8 * out, i32 size) {
+    u8 * first;
+    i32 firstSize;
+    i32 restSize;
+    GetReceiveRingSpans(ring, pos, size, &first, &firstSize, &restSize);
+    memcpy(out, first, firstSize);
+    memcpy(out + firstSize, ring->data, restSize);
+}
+
+// NOTE(traks): decompresses the data at the given position of the receive
+// ring, feeding zlib both parts if the data wraps around
+static i32 InflatePacket(NetworkThread * thread, ReceiveRing * ring, u32 pos, i32 inSize, u8 * out, i32 outSize) {
+    // @TODO(traks) move to a zlib alternative that is optimised for single
+    // pass inflate/deflate
+    z_stream * zstream = &thread->inflateStream;
+    if (inflateReset(zstream) != Z_OK) {
+        return 0;
+    }
+
+    u8 * first;
+    i32 firstSize;
+    i32 restSize;
+    GetReceiveRingSpans(ring, pos, inSize, &first, &firstSize, &restSize);
+
+    zstream->next_in = first;
+    zstream->avail_in = firstSize;
+    zstream->next_out = out;
+    zstream->avail_out = outSize;
+
+    i32 status = inflate(zstream, restSize > 0 ? Z_NO_FLUSH : Z_FINISH);
+    if (restSize > 0) {
+        if (status != Z_OK || zstream->avail_in != 0) {
+            return 0;
+        }
+        zstream->next_in = ring->data;
+        zstream->avail_in = restSize;
+        status = inflate(zstream, Z_FINISH);
+    }
+    return status == Z_STREAM_END && zstream->avail_in == 0 && zstream->total_out == (uLong) outSize;
+}
+
+// NOTE(traks): moves all fully received packets from the receive ring into
+// the inbound ring, decompressing them if necessary
+static void DecodePackets(NetworkThread * thread, PlayerConnection * conn) {
+    BeginTimings(DecodePackets);
+
+    ReceiveRing * ring = &conn->receiveRing;
+
+    conn->flags &= ~CONNECTION_INBOUND_FULL;
+
+    for (;;) {
+        u32 packetSize = 0;
+        i32 prefixSize = PeekReceiveRingVarU32(ring, ring->readPos, &packetSize);
+
+        if (prefixSize == 0) {
+            // NOTE(traks): packet size not fully received yet
+            break;
+        }
+        if (prefixSize < 0) {
+            LogInfo("Packet size VarInt too long");
+            MarkConnectionClosed(conn);
+            break;
+        }
+        if (packetSize > ring->size - 5 || packetSize == 0) {
+            LogInfo("Packet size error: %d", (i32) packetSize);
+            MarkConnectionClosed(conn);
+            break;
+        }
+        if (prefixSize + packetSize > ring->writePos - ring->readPos) {
+            // NOTE(traks): packet not fully received yet
+            break;
+        }
+
+        u32 payloadPos = ring->readPos + prefixSize;
+        u32 packetEnd = payloadPos + packetSize;
+
+        u32 uncompressedSize = 0;
+        if (conn->flags & CONNECTION_COMPRESSION) {
+            i32 uncompressedPrefixSize = PeekReceiveRingVarU32(ring, payloadPos, &uncompressedSize);
+            if (uncompressedPrefixSize <= 0 || uncompressedPrefixSize > (i32) packetSize || uncompressedSize > MAX_SERVERBOUND_PACKET_SIZE) {
+                LogInfo("Uncompressed packet size error: %d", (i32) uncompressedSize);
+                MarkConnectionClosed(conn);
+                break;
+            }
+            payloadPos += uncompressedPrefixSize;
+        }
+
+        i32 payloadSize = packetEnd - payloadPos;
+        // NOTE(traks): an uncompressed size of 0 means the packet was sent
+        // uncompressed
+        i32 decodedSize = (uncompressedSize == 0 ? payloadSize : (i32) uncompressedSize);
+        u8 * decoded = BeginPacketQueueWrite(&conn->inbound, decodedSize, 1);
+        if (decoded == NULL) {
+            // NOTE(traks): the tick thread hasn't caught up yet. Leave the
+            // rest in the receive ring and try again later.
+            conn->flags |= CONNECTION_INBOUND_FULL;
+            break;
+        }
+
+        if (uncompressedSize == 0) {
+            CopyFromReceiveRing(ring, payloadPos, decoded, payloadSize);
+        } else if (!InflatePacket(thread, ring, payloadPos, payloadSize, decoded, decodedSize)) {
+            LogInfo("Failed to inflate packet");
+            MarkConnectionClosed(conn);
+            break;
+        }
+
+        CommitPacketQueueWrite(&conn->inbound, decodedSize);
+        ring->readPos = packetEnd;
+    }
+
+    EndTimings(DecodePackets);
+}
+
+static void ConnectionReceive(NetworkThread * thread, PlayerConnection * conn) {
+    ReceiveRing * ring = &conn->receiveRing;
+
+    for (;;) {
+        u32 maxReceiveSize = MIN(ReceiveRingFree(ring), (u32) (MAX_RECEIVE_BYTES_PER_TICK - conn->tickReceivedBytes));
+        if ((conn->flags & CONNECTION_READABLE) && maxReceiveSize > 0) {
+            if (ring->data == NULL) {
+                ring->data = AcquireConnectionBlock(conn);
+                if (ring->data == NULL) {
+                    LogInfo("Failed to allocate receive ring");
+                    MarkConnectionClosed(conn);
+                    return;
+                }
+            }
+            ssize_t receiveSize = ReceiveIntoRing(conn->socket, ring, maxReceiveSize);
+
+            if (receiveSize == 0) {
+                // NOTE(traks): client closed its end of the connection
+                MarkConnectionClosed(conn);
+                return;
+            } else if (receiveSize == -1) {
+                if (errno == EAGAIN) {
+                    conn->flags &= ~CONNECTION_READABLE;
+                } else {
+                    LogErrno("Couldn't receive protocol data from player: %s");
+                    MarkConnectionClosed(conn);
+                    return;
+                }
+            } else {
+                conn->tickReceivedBytes += receiveSize;
+                if ((u32) receiveSize < maxReceiveSize) {
+                    // NOTE(traks): drained the socket's receive buffer
+                    conn->flags &= ~CONNECTION_READABLE;
+                }
+            }
+        }
+
+        DecodePackets(thread, conn);
+
+        if (atomic_load_explicit(&conn->atomicFlags, memory_order_relaxed) & CONNECTION_CLOSED) {
+            return;
+        }
+        if (!(conn->flags & CONNECTION_READABLE) || (conn->flags & CONNECTION_INBOUND_FULL)) {
+            return;
+        }
+        if (conn->tickReceivedBytes >= MAX_RECEIVE_BYTES_PER_TICK) {
+            // NOTE(traks): continue next tick. The socket is still marked as
+            // readable, so we get back to it once the tick thread wakes us.
+            return;
+        }
+        // NOTE(traks): there may be more data in the socket and we made room
+        // for it in the receive ring, so try again
+    }
+}
+
+// NOTE(traks): Compresses the stream's input into the send queue, starting at
+// out, which must lie in space returned by ReserveSendData. Continues in new
+// send blocks if the output doesn't fit. The first part is always committed,
+// even if empty, so the caller can put a header in front of it. Returns the
+// status of the last deflate call.
+static i32 DeflateIntoSendQueue(PlayerConnection * conn, z_stream * zstream, u8 * out, i32 outSize) {
+    i32 first = 1;
+    for (;;) {
+        zstream->next_out = out;
+        zstream->avail_out = outSize;
+        i32 status = deflate(zstream, Z_FINISH);
+        i32 written = outSize - zstream->avail_out;
+        if (first || written > 0) {
+            CommitSendData(conn, out, written);
+        }
+        first = 0;
+
+        if (status != Z_OK) {
+            return status;
+        }
+        if (zstream->avail_out != 0) {
+            out = zstream->next_out;
+            outSize = zstream->avail_out;
+        } else {
+            out = ReserveSendData(conn, SEND_BLOCK_DATA_SIZE, 1, &outSize);
+            if (out == NULL) {
+                return Z_MEM_ERROR;
+            }
+        }
+    }
+}
+
+// NOTE(traks): moves packets from the outbound ring into the send queue,
+// compressing them if necessary. Stops once the send queue fills up.
+static void FinalisePackets(NetworkThread * thread, PlayerConnection * conn) {
+    BeginTimings(FinalisePackets);
+
+    for (;;) {
+        u32 batchSize;
+        u8 * batch = PeekPacketQueue(&conn->outbound, &batchSize);
+        if (batch == NULL) {
+            break;
+        }
+
+        Cursor * batchCursor = &(Cursor) {
+            .data = batch,
+            .size = batchSize,
+            .index = conn->outboundBatchIndex,
+        };
+        i32 sendQueueFull = 0;
+        i32 failed = 0;
+
+        while (batchCursor->index != batchCursor->size) {
+            i32 packetStart = batchCursor->index;
+            int internalHeader = batchCursor->data[batchCursor->index];
+
+            if (!HasSendRoom(conn)) {
+                sendQueueFull = 1;
+                break;
+            }
+
+            if (internalHeader & PACKET_HEADER_FRAMED) {
+                // NOTE(traks): packets too small to compress are final
+                // already, so send runs of them straight from the batch
+                i64 packetCount = 0;
+                while (batchCursor->index != batchCursor->size && (batchCursor->data[batchCursor->index] & PACKET_HEADER_FRAMED)) {
+                    i32 frameSize = ReadVarU32(batchCursor);
+                    batchCursor->index += frameSize;
+                    packetCount++;
+                }
+                QueueOutboundData(conn, batch + packetStart, batchCursor->index - packetStart);
+                conn->flags |= CONNECTION_COMPRESSION;
+                atomic_fetch_add_explicit(&thread->packetsBelowThreshold, packetCount, memory_order_relaxed);
+                continue;
+            }
+
+            if (internalHeader == PACKET_RECORD_BROADCAST) {
+                QueueBroadcastPacket(conn, ReadBroadcastPacketRecord(batchCursor));
+                conn->flags |= CONNECTION_COMPRESSION;
+                continue;
+            }
+
+            if (internalHeader == PACKET_RECORD_CACHED) {
+                ChunkPacket * packet = ReadChunkPacketRecord(batchCursor);
+                if (!QueueSharedChunkPacket(conn, packet)) {
+                    batchCursor->index = packetStart;
+                    sendQueueFull = 1;
+                    break;
+                }
+                conn->flags |= CONNECTION_COMPRESSION;
+                continue;
+            }
+
+            ChunkPacket * fillPacket = NULL;
+            if (internalHeader == PACKET_RECORD_FILL_CACHE) {
+                fillPacket = ReadChunkPacketRecord(batchCursor);
+                if (batchCursor->index == batchCursor->size) {
+                    // NOTE(traks): the packet itself didn't make it into the
+                    // batch
+                    ReleaseChunkPacket(fillPacket);
+                    break;
+                }
+                internalHeader = batchCursor->data[batchCursor->index];
+
+                if (IsChunkPacketFilled(fillPacket)) {
+                    // NOTE(traks): someone else compressed the packet in the
+                    // meantime, so skip the packet that follows
+                    if (!QueueSharedChunkPacket(conn, fillPacket)) {
+                        batchCursor->index = packetStart;
+                        sendQueueFull = 1;
+                        break;
+                    }
+                    conn->flags |= CONNECTION_COMPRESSION;
+                    atomic_fetch_add_explicit(&network.chunkPacketCache.lateHits, 1, memory_order_relaxed);
+                    SkipPacketRecord(batchCursor);
+                    continue;
+                }
+            }
+
+            int sizeOffset = internalHeader & 0x7;
+            int shouldCompress = internalHeader & PACKET_HEADER_COMPRESS;
+
+            batchCursor->index += 1 + sizeOffset;
+
+            i32 frameStart = batchCursor->index;
+            i32 packetSize = ReadVarU32(batchCursor);
+            i32 packetEnd = batchCursor->index + packetSize;
+
+            if (shouldCompress) {
+                // NOTE(traks): We compress straight into the send queue and
+                // leave room in front for the frame header, since its size
+                // depends on the compressed size. The compressed data
+                // continues in new send blocks if it doesn't fit.
+                i32 available;
+                u8 * target = ReserveSendData(conn, 10 + MIN_DEFLATE_OUTPUT_SIZE, 0, &available);
+                if (target == NULL) {
+                    batchCursor->index = packetStart;
+                    sendQueueFull = 1;
+                    break;
+                }
+
+                // @TODO(traks) handle errors properly
+                z_stream * zstream = (internalHeader & PACKET_HEADER_BULK) ? &thread->bulkDeflateStream : &thread->deflateStream;
+                if (deflateReset(zstream) != Z_OK) {
+                    batchCursor->index = packetStart;
+                    failed = 1;
+                    break;
+                }
+
+                zstream->next_in = batchCursor->data + batchCursor->index;
+                zstream->avail_in = packetSize;
+                u32 firstSegment = conn->sendSegmentTail;
+
+                BeginTimings(Deflate);
+                i64 deflateStart = NanoTime();
+                i32 status = DeflateIntoSendQueue(conn, zstream, target + 10, available - 10);
+                i64 deflateNanos = NanoTime() - deflateStart;
+                EndTimings(Deflate);
+
+                thread->windowDeflateNanos += deflateNanos;
+                atomic_fetch_add_explicit(&thread->deflateNanos, deflateNanos, memory_order_relaxed);
+                atomic_fetch_add_explicit(&thread->bytesBeforeCompression, packetSize, memory_order_relaxed);
+                atomic_fetch_add_explicit(&thread->bytesAfterCompression, zstream->total_out, memory_order_relaxed);
+
+                if (status != Z_STREAM_END || zstream->avail_in != 0) {
+                    batchCursor->index = packetStart;
+                    failed = 1;
+                    break;
+                }
+
+                i32 compressedSize = zstream->total_out;
+                i32 headerSize = VarU32Size(VarU32Size(packetSize) + compressedSize) + VarU32Size(packetSize);
+                Cursor * headerCursor = &(Cursor) {.data = target + 10 - headerSize, .size = headerSize};
+                WriteVarU32(headerCursor, VarU32Size(packetSize) + compressedSize);
+                WriteVarU32(headerCursor, packetSize);
+                SendSegment * first = conn->sendSegments + (firstSegment & (MAX_SEND_SEGMENTS - 1));
+                first->data -= headerSize;
+                first->size += headerSize;
+                conn->sendQueueBytes += headerSize;
+
+                if (fillPacket != NULL && ClaimChunkPacket(fillPacket)) {
+                    FillChunkPacket(conn, fillPacket, firstSegment, headerSize, compressedSize, packetSize);
+                }
+
+                // NOTE(traks): the client compresses its packets from the
+                // moment it receives the set compression packet, which is sent
+                // right before the first compressed packet
+                conn->flags |= CONNECTION_COMPRESSION;
+            } else {
+                // NOTE(traks): large frames continue in new send blocks
+                u8 * frame = batchCursor->data + frameStart;
+                i32 remainingSize = packetEnd - frameStart;
+                i32 available;
+                u8 * target = ReserveSendData(conn, MIN(remainingSize, SEND_BLOCK_DATA_SIZE), 0, &available);
+                if (target == NULL) {
+                    batchCursor->index = packetStart;
+                    sendQueueFull = 1;
+                    break;
+                }
+                for (;;) {
+                    i32 copySize = MIN(remainingSize, available);
+                    memcpy(target, frame, copySize);
+                    CommitSendData(conn, target, copySize);
+                    frame += copySize;
+                    remainingSize -= copySize;
+                    if (remainingSize == 0) {
+                        break;
+                    }
+                    target = ReserveSendData(conn, MIN(remainingSize, SEND_BLOCK_DATA_SIZE), 1, &available);
+                    if (target == NULL) {
+                        break;
+                    }
+                }
+                if (remainingSize != 0) {
+                    batchCursor->index = packetStart;
+                    failed = 1;
+                    break;
+                }
+            }
+
+            if (fillPacket != NULL) {
+                ReleaseChunkPacket(fillPacket);
+            }
+            batchCursor->index = packetEnd;
+        }
+
+        if (failed || (sendQueueFull && IsSendQueueEmpty(conn))) {
+            LogInfo("Failed to finalise packets");
+            // NOTE(traks): so the remaining records get released
+            conn->outboundBatchIndex = batchCursor->index;
+            MarkConnectionClosed(conn);
+            break;
+        }
+
+        if (sendQueueFull) {
+            conn->outboundBatchIndex = batchCursor->index;
+            break;
+        }
+
+        ConsumePacketQueue(&conn->outbound, batchSize);
+        ReleaseOutbound(conn);
+        conn->outboundBatchIndex = 0;
+    }
+
+    EndTimings(FinalisePackets);
+}
+
+static void ConnectionSend(NetworkThread * thread, PlayerConnection * conn) {
+    for (;;) {
+        FinalisePackets(thread, conn);
+
+        if (atomic_load_explicit(&conn->atomicFlags, memory_order_relaxed) & CONNECTION_CLOSED) {
+            return;
+        }
+        if (IsSendQueueEmpty(conn) || !(conn->flags & CONNECTION_WRITABLE)) {
+            return;
+        }
+
+        struct iovec iovecs[MAX_SEND_IOVECS];
+        i32 iovecCount = 0;
+        i32 attemptedSize = 0;
+        for (u32 i = conn->sendSegmentHead; i != conn->sendSegmentTail && iovecCount < MAX_SEND_IOVECS; i++) {
+            SendSegment * segment = conn->sendSegments + (i & (MAX_SEND_SEGMENTS - 1));
+            iovecs[iovecCount++] = (struct iovec) {.iov_base = segment->data, .iov_len = segment->size};
+            attemptedSize += segment->size;
+        }
+
+        BeginTimings(SystemSend);
+        ssize_t sendSize = writev(conn->socket, iovecs, iovecCount);
+        EndTimings(SystemSend);
+
+        if (sendSize == -1) {
+            if (errno == EAGAIN) {
+                // NOTE(traks): The socket's internal send buffer is full
+                conn->flags &= ~CONNECTION_WRITABLE;
+                thread->windowSendStalls++;
+                conn->sendStallStreak++;
+                return;
+            }
+            LogErrno("Couldn't send protocol data to player: %s");
+            MarkConnectionClosed(conn);
+            return;
+        }
+
+        PopSendData(conn, sendSize);
+        ReleaseOutbound(conn);
+        conn->totalSentBytes += sendSize;
+
+        if (sendSize < attemptedSize) {
+            conn->flags &= ~CONNECTION_WRITABLE;
+            thread->windowSendStalls++;
+            conn->sendStallStreak++;
+            return;
+        }
+        if (IsSendQueueEmpty(conn)) {
+            conn->sendStallStreak = 0;
+        }
+        // NOTE(traks): sent everything we tried to, finalise more packets if
+        // there are any
+    }
+}
+
+static void UpdateLinkStats(PlayerConnection * conn) {
+    // NOTE(traks): data the kernel hasn't sent yet or that the client hasn't
+    // acknowledged yet
+    i32 kernelQueued = 0;
+#ifdef NETWORK_LINK_INFO
+    int outq;
+    if (ioctl(conn->socket, SIOCOUTQ, &outq) == 0) {
+        kernelQueued = outq;
+    }
+    struct tcp_info info;
+    socklen_t infoSize = sizeof info;
+    if (getsockopt(conn->socket, IPPROTO_TCP, TCP_INFO, &info, &infoSize) == 0) {
+        atomic_store_explicit(&conn->rttMicros, info.tcpi_rtt, memory_order_relaxed);
+    }
+#endif
+
+    atomic_store_explicit(&conn->deliveredBytes, conn->totalSentBytes - kernelQueued, memory_order_relaxed);
+    atomic_store_explicit(&conn->unsentBytes, conn->sendQueueBytes + kernelQueued, memory_order_relaxed);
+    atomic_store_explicit(&conn->publishedStallStreak, conn->sendStallStreak, memory_order_relaxed);
+}
+
+static void ServiceConnection(NetworkThread * thread, PlayerConnection * conn) {
+    u32 atomicFlags = atomic_load_explicit(&conn->atomicFlags, memory_order_acquire);
+    if (atomicFlags & (CONNECTION_CLOSED | CONNECTION_RELEASED)) {
+        return;
+    }
+    ConnectionReceive(thread, conn);
+    ConnectionSend(thread, conn);
+    UpdateLinkStats(conn);
+}
+
+static void AdoptNewConnections(NetworkThread * thread) {
+    pthread_mutex_lock(&thread->mutex);
+    i32 firstNew = thread->connectionCount;
+    for (i32 i = 0; i < thread->newConnectionCount; i++) {
+        thread->connections[thread->connectionCount] = thread->newConnections[i];
+        thread->connectionCount++;
+    }
+    thread->newConnectionCount = 0;
+    pthread_mutex_unlock(&thread->mutex);
+
+    for (i32 i = firstNew; i < thread->connectionCount; i++) {
+        PlayerConnection * conn = thread->connections[i];
+#ifdef NETWORK_EPOLL
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, conn->socket, &event) == -1) {
+            LogErrno("Failed to register player socket: %s");
+            MarkConnectionClosed(conn);
+            continue;
+        }
+#endif
+        // NOTE(traks): data may have arrived before we registered the socket
+        conn->flags |= CONNECTION_READABLE | CONNECTION_WRITABLE;
+    }
+}
+
+// NOTE(traks): Blocks until a socket becomes ready or until the tick thread
+// wakes us up. Services the ready sockets and returns whether we were woken up.
+static i32 ServiceReadyConnections(NetworkThread * thread) {
+    i32 woken = 0;
+
+#ifdef NETWORK_EPOLL
+    struct epoll_event events[128];
+    int eventCount = epoll_wait(thread->epollFd, events, ARRAY_SIZE(events), -1);
+    if (eventCount == -1) {
+        if (errno != EINTR) {
+            LogErrno("Failed to wait for network events: %s");
+        }
+        return 0;
+    }
+
+    for (i32 eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+        struct epoll_event * event = events + eventIndex;
+        PlayerConnection * conn = event->data.ptr;
+        if (conn == NULL) {
+            woken = 1;
+            continue;
+        }
+        // NOTE(traks): let the read or write find out about errors and hangups
+        if (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            conn->flags |= CONNECTION_READABLE;
+        }
+        if (event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            conn->flags |= CONNECTION_WRITABLE;
+        }
+        ServiceConnection(thread, conn);
+    }
+#else
+    // NOTE(traks): no edge-triggered notifications, so only ask for the events
+    // we're going to act on. Otherwise poll would return immediately.
+    struct pollfd * pollFds = thread->pollFds;
+    pollFds[0] = (struct pollfd) {.fd = thread->wakeReadFd, .events = POLLIN};
+    for (i32 i = 0; i < thread->connectionCount; i++) {
+        PlayerConnection * conn = thread->connections[i];
+        u32 atomicFlags = atomic_load_explicit(&conn->atomicFlags, memory_order_acquire);
+        short events = 0;
+        if (!(atomicFlags & (CONNECTION_CLOSED | CONNECTION_RELEASED))) {
+            if (!(conn->flags & (CONNECTION_READABLE | CONNECTION_INBOUND_FULL))) {
+                events |= POLLIN;
+            }
+            if (!IsSendQueueEmpty(conn) && !(conn->flags & CONNECTION_WRITABLE)) {
+                events |= POLLOUT;
+            }
+        }
+        pollFds[i + 1] = (struct pollfd) {.fd = conn->socket, .events = events};
+    }
+
+    if (poll(pollFds, thread->connectionCount + 1, -1) == -1) {
+        if (errno != EINTR) {
+            LogErrno("Failed to wait for network events: %s");
+        }
+        return 0;
+    }
+
+    woken = !!(pollFds[0].revents & POLLIN);
+    for (i32 i = 0; i < thread->connectionCount; i++) {
+        PlayerConnection * conn = thread->connections[i];
+        short revents = pollFds[i + 1].revents;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            conn->flags |= CONNECTION_READABLE;
+        }
+        if (revents & (POLLOUT | POLLHUP | POLLERR)) {
+            conn->flags |= CONNECTION_WRITABLE;
+        }
+        if (revents != 0) {
+            ServiceConnection(thread, conn);
+        }
+    }
+#endif
+
+    return woken;
+}
+
+static void UpdateCompressionPolicy(NetworkThread * thread) {
+    i64 now = NanoTime();
+    i64 windowNanos = now - thread->policyWindowStart;
+    if (windowNanos < COMPRESSION_POLICY_WINDOW_NANOS) {
+        return;
+    }
+
+    i32 level = thread->bulkLevel;
+    double busyFraction = (double) thread->windowDeflateNanos / windowNanos;
+    if (busyFraction > 0.5) {
+        level = MAX(level - 1, MIN_BULK_COMPRESSION_LEVEL);
+    } else if (busyFraction < 0.2 && thread->windowSendStalls > 0) {
+        level = MIN(level + 1, MAX_BULK_COMPRESSION_LEVEL);
+    }
+
+    if (level != thread->bulkLevel) {
+        // NOTE(traks): the stream is reset first, so changing the parameters
+        // doesn't flush anything
+        z_stream * zstream = &thread->bulkDeflateStream;
+        if (deflateReset(zstream) == Z_OK && deflateParams(zstream, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+            thread->bulkLevel = level;
+            atomic_store_explicit(&thread->reportedBulkLevel, level, memory_order_relaxed);
+        }
+    }
+
+    thread->policyWindowStart = now;
+    thread->windowDeflateNanos = 0;
+    thread->windowSendStalls = 0;
+}
+
+static void * RunNetworkThread(void * arg) {
+#ifdef PROFILE
+    TracyCSetThreadName("Network");
+#endif
+
+    NetworkThread * thread = arg;
+
+    for (;;) {
+        if (!ServiceReadyConnections(thread)) {
+            continue;
+        }
+
+        u8 wakeBytes[64];
+        while (read(thread->wakeReadFd, wakeBytes, sizeof wakeBytes) > 0) {}
+
+        AdoptNewConnections(thread);
+
+        // NOTE(traks): the tick thread queued new packets and may have
+        // released connections or consumed inbound packets. Also a new tick
+        // started, so connections can receive more data.
+        for (i32 i = 0; i < thread->connectionCount; i++) {
+            PlayerConnection * conn = thread->connections[i];
+            conn->tickReceivedBytes = 0;
+            u32 atomicFlags = atomic_load_explicit(&conn->atomicFlags, memory_order_acquire);
+            if (atomicFlags & CONNECTION_RELEASED) {
+                FreePlayerConnection(conn);
+                thread->connections[i] = thread->connections[thread->connectionCount - 1];
+                thread->connectionCount--;
+                i--;
+                continue;
+            }
+            ServiceConnection(thread, conn);
+            ReleaseIdleBuffers(conn);
+        }
+
+        UpdateCompressionPolicy(thread);
+    }
+
+    return NULL;
+}
+
+static void InitNetworkThread(NetworkThread * thread) {
+    int wakeFds[2];
+    if (pipe(wakeFds) == -1) {
+        LogErrno("Failed to create network thread wake pipe: %s");
+        exit(1);
+    }
+    if (!SetNonBlocking(wakeFds[0]) || !SetNonBlocking(wakeFds[1])) {
+        LogErrno("Failed to set wake pipe flags: %s");
+        exit(1);
+    }
+    thread->wakeReadFd = wakeFds[0];
+    thread->wakeWriteFd = wakeFds[1];
+
+#ifdef NETWORK_EPOLL
+    thread->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (thread->epollFd == -1) {
+        LogErrno("Failed to create epoll instance: %s");
+        exit(1);
+    }
+    struct epoll_event wakeEvent = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, thread->wakeReadFd, &wakeEvent) == -1) {
+        LogErrno("Failed to register wake pipe: %s");
+        exit(1);
+    }
+#endif
+
+    if (deflateInit(&thread->deflateStream, REGULAR_COMPRESSION_LEVEL) != Z_OK
+            || deflateInit(&thread->bulkDeflateStream, INITIAL_BULK_COMPRESSION_LEVEL) != Z_OK) {
+        LogInfo("Failed to initialise network thread deflate streams");
+        exit(1);
+    }
+    thread->bulkLevel = INITIAL_BULK_COMPRESSION_LEVEL;
+    thread->reportedBulkLevel = INITIAL_BULK_COMPRESSION_LEVEL;
+    thread->policyWindowStart = NanoTime();
+    // NOTE(traks): accepts any window size, so it works for all clients
+    if (inflateInit(&thread->inflateStream) != Z_OK) {
+        LogInfo("Failed to initialise network thread inflate stream");
+        exit(1);
+    }
+
+    pthread_mutex_init(&thread->mutex, NULL);
+    if (pthread_create(&thread->thread, NULL, RunNetworkThread, thread) != 0) {
+        LogInfo("Failed to create network thread");
+        exit(1);
+    }
+}
+
+static PlayerConnection * CreatePlayerConnection(int socket) {
+    PlayerConnection * conn = calloc(1, sizeof *conn);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->socket = socket;
+    // NOTE(traks): AAA games send a lot less than 1MB/tick. For example,
+    // according to some website, Fortnite sends about 1.5KB/tick. Although we
+    // sometimes have to send a bunch of chunk data, which can be tens of KB.
+    // Minecraft even allows up to 2MB of chunk data. So start with small
+    // packet rings and let them grow while the player needs it.
+    if (!InitPacketQueue(&conn->inbound, MIN_INBOUND_RING_SIZE, MAX_INBOUND_RING_SIZE)
+            || !InitPacketQueue(&conn->outbound, MIN_OUTBOUND_RING_SIZE, MAX_OUTBOUND_RING_SIZE)) {
+        FreePacketQueue(&conn->inbound);
+        FreePacketQueue(&conn->outbound);
+        free(conn);
+        return NULL;
+    }
+    // NOTE(traks): the network thread takes the data from the block pool
+    // once something arrives
+    conn->receiveRing = (ReceiveRing) {.size = PLAYER_RECEIVE_RING_SIZE};
+
+    // NOTE(traks): give the connection to the least busy network thread
+    NetworkThread * thread = network.networkThreads;
+    for (i32 i = 1; i < network.networkThreadCount; i++) {
+        NetworkThread * other = network.networkThreads + i;
+        if (other->assignedCount < thread->assignedCount) {
+            thread = other;
+        }
+    }
+    conn->thread = thread;
+    thread->assignedCount++;
+
+    pthread_mutex_lock(&thread->mutex);
+    thread->newConnections[thread->newConnectionCount] = conn;
+    thread->newConnectionCount++;
+    pthread_mutex_unlock(&thread->mutex);
+    return conn;
+}
+
+Cursor PeekPlayerPacket(PlayerConnection * conn) {
+    Cursor res = {0};
+    u32 size;
+    u8 * data = PeekPacketQueue(&conn->inbound, &size);
+    if (data != NULL) {
+        res.data = data;
+        res.size = size;
+    }
+    return res;
+}
+
+void PopPlayerPacket(PlayerConnection * conn, Cursor * packet) {
+    PopPacketQueue(&conn->inbound, packet->size);
+}
+
+i32 QueuePlayerPackets(PlayerConnection * conn, u8 * data, i32 size) {
+    u8 * target = BeginPacketQueueWrite(&conn->outbound, size, 1);
+    if (target == NULL) {
+        ReleasePacketRecords(data, 0, size);
+        return 0;
+    }
+    memcpy(target, data, size);
+    CommitPacketQueueWrite(&conn->outbound, size);
+    return 1;
+}
+
+u8 * BeginPlayerPackets(PlayerConnection * conn, i32 maxSize) {
+    // NOTE(traks): called once every tick, so a good time to let go of an
+    // outbound ring the player doesn't need anymore
+    ShrinkIdlePacketQueue(&conn->outbound);
+    // NOTE(traks): Don't grow the ring for the worst case here. Rings that
+    // grew for chunk sending have room, and small batches of other players
+    // are cheap to copy.
+    return BeginPacketQueueWrite(&conn->outbound, maxSize, 0);
+}
+
+void CommitPlayerPackets(PlayerConnection * conn, i32 size) {
+    CommitPacketQueueWrite(&conn->outbound, size);
+}
+
+void DiscardPlayerPackets(u8 * data, i32 size) {
+    ReleasePacketRecords(data, 0, size);
+}
+
+static u32 HashChunkPacketPos(u64 packedPos) {
+    return ((packedPos * 0x9e3779b97f4a7c15) >> 32) & (CHUNK_PACKET_CACHE_BUCKETS - 1);
+}
+
+static void UnlinkChunkPacketFromLru(ChunkPacket * packet) {
+    ChunkPacketCache * cache = &network.chunkPacketCache;
+    if (packet->lruPrev != NULL) {
+        packet->lruPrev->lruNext = packet->lruNext;
+    } else {
+        cache->lruHead = packet->lruNext;
+    }
+    if (packet->lruNext != NULL) {
+        packet->lruNext->lruPrev = packet->lruPrev;
+    } else {
+        cache->lruTail = packet->lruPrev;
+    }
+    packet->lruPrev = NULL;
+    packet->lruNext = NULL;
+}
+
+static void PushChunkPacketToLruHead(ChunkPacket * packet) {
+    ChunkPacketCache * cache = &network.chunkPacketCache;
+    packet->lruNext = cache->lruHead;
+    if (cache->lruHead != NULL) {
+        cache->lruHead->lruPrev = packet;
+    } else {
+        cache->lruTail = packet;
+    }
+    cache->lruHead = packet;
+}
+
+static void EvictChunkPacket(ChunkPacket * packet) {
+    ChunkPacketCache * cache = &network.chunkPacketCache;
+    ChunkPacket * * link = cache->buckets + HashChunkPacketPos(packet->packedPos);
+    while (*link != packet) {
+        link = &(*link)->hashNext;
+    }
+    *link = packet->hashNext;
+    UnlinkChunkPacketFromLru(packet);
+    ReleaseChunkPacket(packet);
+}
+
+static void WriteChunkPacketRecord(Cursor * sendCursor, int internalHeader, ChunkPacket * packet) {
+    atomic_fetch_add_explicit(&packet->refCount, 1, memory_order_relaxed);
+    WriteU8(sendCursor, internalHeader);
+    WriteData(sendCursor, (u8 *) &packet, sizeof packet);
+}
+
+i32 TryWriteCachedChunkPacket(Cursor * sendCursor, WorldChunkPos pos, u64 contentVersion, i32 canFill) {
+    ChunkPacketCache * cache = &network.chunkPacketCache;
+    u64 packedPos = PackWorldChunkPos(pos).packed;
+    ChunkPacket * * bucket = cache->buckets + HashChunkPacketPos(packedPos);
+
+    ChunkPacket * packet = *bucket;
+    while (packet != NULL && packet->packedPos != packedPos) {
+        packet = packet->hashNext;
+    }
+
+    if (packet != NULL && packet->contentVersion != contentVersion) {
+        EvictChunkPacket(packet);
+        packet = NULL;
+    }
+
+    if (CursorRemaining(sendCursor) < 1 + (i32) sizeof packet) {
+        // NOTE(traks): let the caller run into the error
+        return 0;
+    }
 
-enum ProtocolState {
-    PROTOCOL_HANDSHAKE,
-    PROTOCOL_AWAIT_STATUS_REQUEST,
-    PROTOCOL_AWAIT_PING_REQUEST,
-    PROTOCOL_AWAIT_HELLO,
-    PROTOCOL_JOIN_WHEN_SENT,
-};
+    if (packet != NULL) {
+        UnlinkChunkPacketFromLru(packet);
+        PushChunkPacketToLruHead(packet);
+        if (IsChunkPacketFilled(packet)) {
+            WriteChunkPacketRecord(sendCursor, PACKET_RECORD_CACHED, packet);
+            cache->hits++;
+            return 1;
+        }
+        if (!canFill) {
+            return 0;
+        }
+        // NOTE(traks): No network thread has compressed the packet yet. It may
+        // be done by the time our network thread gets to it though.
+        WriteChunkPacketRecord(sendCursor, PACKET_RECORD_FILL_CACHE, packet);
+        cache->misses++;
+        return 0;
+    }
 
-typedef struct {
-    u8 * data;
-    i32 cursor;
-    i32 size;
-} Buffer;
+    if (!canFill) {
+        return 0;
+    }
 
-typedef struct {
-    int socket;
-    u32 flags;
+    packet = calloc(1, sizeof *packet);
+    if (packet == NULL) {
+        cache->misses++;
+        return 0;
+    }
+    packet->packedPos = packedPos;
+    packet->contentVersion = contentVersion;
+    packet->refCount = 1;
+    packet->hashNext = *bucket;
+    *bucket = packet;
+    PushChunkPacketToLruHead(packet);
+
+    WriteChunkPacketRecord(sendCursor, PACKET_RECORD_FILL_CACHE, packet);
+    cache->misses++;
+    return 0;
+}
 
-    Buffer recBuf;
-    Buffer sendBuf;
-    Buffer recPacketBuf;
-    i32 recPacketBufConsumed;
+// NOTE(traks): Finalises a batch of packets written with begin_packet and
+// finish_packet for a player with packet compression. Compressed like the
+// network threads would, but on the tick thread, which is fine since this is
+// done once for all players.
+BroadcastPacket * CreateBroadcastPacket(u8 * data, i32 size) {
+    BeginTimings(CreateBroadcastPacket);
+
+    z_stream * zstream = &network.broadcastDeflateStream;
+    Cursor * cursor = &(Cursor) {.data = data, .size = size};
+    i64 maxSize = 0;
+    while (cursor->index < cursor->size) {
+        i32 recordStart = cursor->index;
+        int internalHeader = cursor->data[cursor->index];
+        assert((internalHeader & PACKET_HEADER_FRAMED) || (internalHeader & PACKET_HEADER_COMPRESS));
+        SkipPacketRecord(cursor);
+        if (internalHeader & PACKET_HEADER_FRAMED) {
+            maxSize += cursor->index - recordStart;
+        } else {
+            maxSize += 10 + deflateBound(zstream, cursor->index - recordStart);
+        }
+    }
 
-    int protocolState;
-    unsigned char username[16];
-    int usernameSize;
-} Client;
+    BroadcastPacket * res = malloc(sizeof *res + maxSize);
+    if (res == NULL) {
+        goto bail;
+    }
+    Cursor * out = &(Cursor) {.data = res->data, .size = maxSize};
 
-typedef struct {
-    Client * * clientArray;
-    i32 clientArraySize;
-    int serverSocket;
-} Network;
+    cursor->index = 0;
+    while (cursor->index < cursor->size) {
+        i32 recordStart = cursor->index;
+        int internalHeader = cursor->data[cursor->index];
 
-static Network network;
+        if (internalHeader & PACKET_HEADER_FRAMED) {
+            SkipPacketRecord(cursor);
+            WriteData(out, data + recordStart, cursor->index - recordStart);
+            continue;
+        }
+
+        cursor->index += 1 + (internalHeader & 0x7);
+        i32 packetSize = ReadVarU32(cursor);
+        zstream->next_in = cursor->data + cursor->index;
+        zstream->avail_in = packetSize;
+        cursor->index += packetSize;
+
+        // NOTE(traks): leave room for the frame header, like the network
+        // threads do
+        u8 * target = out->data + out->index;
+        zstream->next_out = target + 10;
+        zstream->avail_out = out->size - out->index - 10;
+        if (deflateReset(zstream) != Z_OK || deflate(zstream, Z_FINISH) != Z_STREAM_END) {
+            free(res);
+            res = NULL;
+            goto bail;
+        }
+
+        i32 compressedSize = zstream->total_out;
+        WriteVarU32(out, VarU32Size(packetSize) + compressedSize);
+        WriteVarU32(out, packetSize);
+        memmove(out->data + out->index, target + 10, compressedSize);
+        out->index += compressedSize;
+    }
+
+    atomic_init(&res->refCount, 1);
+    res->size = out->index;
+
+bail:
+    EndTimings(CreateBroadcastPacket);
+    return res;
+}
+
+void WriteBroadcastPacketRecord(Cursor * sendCursor, BroadcastPacket * packet) {
+    if (sendCursor->size - sendCursor->index < (i32) (1 + sizeof packet)) {
+        sendCursor->error = 1;
+        return;
+    }
+    atomic_fetch_add_explicit(&packet->refCount, 1, memory_order_relaxed);
+    WriteU8(sendCursor, PACKET_RECORD_BROADCAST);
+    WriteData(sendCursor, (u8 *) &packet, sizeof packet);
+    network.broadcastRecords++;
+}
+
+CompressedFragment CompressFragment(u8 * data, i32 size) {
+    CompressedFragment res = {0};
+
+    // NOTE(traks): Raw deflate data, so it can go in the middle of a zlib
+    // stream. The sync flush ends it on a byte boundary without marking the
+    // last block as final. A fresh stream never refers back to data before the
+    // fragment, so whatever precedes the fragment doesn't matter.
+    z_stream zstream = {0};
+    if (deflateInit2(&zstream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return res;
+    }
+    i32 maxSize = deflateBound(&zstream, size) + 16;
+    u8 * out = malloc(maxSize);
+    if (out != NULL) {
+        zstream.next_in = data;
+        zstream.avail_in = size;
+        zstream.next_out = out;
+        zstream.avail_out = maxSize;
+        if (deflate(&zstream, Z_SYNC_FLUSH) == Z_OK && zstream.avail_in == 0 && zstream.avail_out != 0) {
+            res.data = out;
+            res.size = zstream.total_out;
+            res.uncompressedSize = size;
+            res.checksum = adler32(1, data, size);
+        } else {
+            free(out);
+        }
+    }
+    deflateEnd(&zstream);
+    return res;
+}
+
+// NOTE(traks): a deflate block that stores the data as is
+static void WriteStoredBlock(Cursor * cursor, u8 * data, i32 size, i32 last) {
+    WriteU8(cursor, last);
+    WriteU8(cursor, size & 0xff);
+    WriteU8(cursor, size >> 8);
+    WriteU8(cursor, ~size & 0xff);
+    WriteU8(cursor, (~size >> 8) & 0xff);
+    WriteData(cursor, data, size);
+}
+
+void WriteSplicedPacket(Cursor * sendCursor, u8 * head, i32 headSize, CompressedFragment * fragment, u8 * tail, i32 tailSize) {
+    assert(headSize <= 0xffff && tailSize <= 0xffff);
+
+    i32 packetSize = headSize + fragment->uncompressedSize + tailSize;
+    // NOTE(traks): zlib header, stored blocks for the head and tail, and the
+    // checksum at the end
+    i32 compressedSize = 2 + (5 + headSize) + fragment->size + (5 + tailSize) + 4;
+    i32 frameSize = VarU32Size(packetSize) + compressedSize;
+
+    // NOTE(traks): The frame size is padded, so the network thread sends the
+    // packet as is, like packets that are too small to compress
+    if (frameSize >= (1 << 21) || sendCursor->size - sendCursor->index < 3 + frameSize) {
+        sendCursor->error = 1;
+        return;
+    }
+
+    WritePaddedVarU32(sendCursor, frameSize, 3);
+    WriteVarU32(sendCursor, packetSize);
+    // NOTE(traks): deflate with a 32KiB window, no preset dictionary
+    WriteU8(sendCursor, 0x78);
+    WriteU8(sendCursor, 0x01);
+    WriteStoredBlock(sendCursor, head, headSize, 0);
+    WriteData(sendCursor, fragment->data, fragment->size);
+    WriteStoredBlock(sendCursor, tail, tailSize, 1);
+
+    u32 checksum = adler32(1, head, headSize);
+    checksum = adler32_combine(checksum, fragment->checksum, fragment->uncompressedSize);
+    checksum = adler32_combine(checksum, adler32(1, tail, tailSize), tailSize);
+    WriteU32(sendCursor, checksum);
+}
+
+static void UpdateChunkPacketCache(void) {
+    BeginTimings(UpdateChunkPacketCache);
+
+    ChunkPacketCache * cache = &network.chunkPacketCache;
+    while (cache->lruTail != NULL && atomic_load_explicit(&cache->memoryUsage, memory_order_relaxed) > CHUNK_PACKET_CACHE_MAX_BYTES) {
+        EvictChunkPacket(cache->lruTail);
+    }
+
+    if ((serv->current_tick % (10 * 20)) == 0) {
+        i64 requests = cache->hits + cache->misses;
+        i64 lateHits = atomic_exchange_explicit(&cache->lateHits, 0, memory_order_relaxed);
+        i64 memoryUsage = atomic_load_explicit(&cache->memoryUsage, memory_order_relaxed);
+        LogInfo("Chunk packet cache: %lld requests, %lld hits, %lld late hits (%.1f%% hit rate), %.0fMB",
+                (long long) requests, (long long) cache->hits, (long long) lateHits,
+                requests > 0 ? 100.0 * (cache->hits + lateHits) / requests : 0.0,
+                memoryUsage / 1000000.0);
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+
+    EndTimings(UpdateChunkPacketCache);
+}
+
+static void LogCompressionStats(void) {
+    i64 before = 0;
+    i64 after = 0;
+    i64 deflateNanos = 0;
+    i64 packetsBelowThreshold = 0;
+    i32 minLevel = MAX_BULK_COMPRESSION_LEVEL;
+    i32 maxLevel = MIN_BULK_COMPRESSION_LEVEL;
+
+    for (i32 i = 0; i < network.networkThreadCount; i++) {
+        NetworkThread * thread = network.networkThreads + i;
+        before += atomic_exchange_explicit(&thread->bytesBeforeCompression, 0, memory_order_relaxed);
+        after += atomic_exchange_explicit(&thread->bytesAfterCompression, 0, memory_order_relaxed);
+        deflateNanos += atomic_exchange_explicit(&thread->deflateNanos, 0, memory_order_relaxed);
+        packetsBelowThreshold += atomic_exchange_explicit(&thread->packetsBelowThreshold, 0, memory_order_relaxed);
+        i32 level = atomic_load_explicit(&thread->reportedBulkLevel, memory_order_relaxed);
+        minLevel = MIN(minLevel, level);
+        maxLevel = MAX(maxLevel, level);
+    }
+
+    LogInfo("Compression: %.1fMB to %.1fMB (saved %.1fMB) in %.1fms, %lld packets below threshold, %lld broadcast references, bulk level %d-%d",
+            before / 1000000.0, after / 1000000.0, (before - after) / 1000000.0,
+            deflateNanos / 1000000.0, (long long) packetsBelowThreshold,
+            (long long) network.broadcastRecords, (int) minLevel, (int) maxLevel);
+    network.broadcastRecords = 0;
+}
+
+static i64 GetPlayerConnectionMemory(PlayerConnection * conn) {
+    i64 res = sizeof *conn;
+    res += atomic_load_explicit(&conn->inbound.memory, memory_order_relaxed);
+    res += atomic_load_explicit(&conn->outbound.memory, memory_order_relaxed);
+    res += atomic_load_explicit(&conn->pooledBytes, memory_order_relaxed);
+    return res;
+}
+
+static void LogConnectionMemory(void) {
+    i32 playerCount = 0;
+    i64 totalMemory = 0;
+    i64 maxMemory = 0;
+    entity_base * maxPlayer = NULL;
+
+    for (int i = 0; i < (i32) ARRAY_SIZE(serv->entities); i++) {
+        entity_base * entity = serv->entities + i;
+        if (entity->type != ENTITY_PLAYER || (entity->flags & ENTITY_IN_USE) == 0) {
+            continue;
+        }
+        i64 memory = GetPlayerConnectionMemory(entity->player.connection);
+        playerCount++;
+        totalMemory += memory;
+        if (memory > maxMemory) {
+            maxMemory = memory;
+            maxPlayer = entity;
+        }
+    }
+
+    ConnectionBlockPool * pool = &network.blockPool;
+    i32 allocatedBlocks = atomic_load_explicit(&pool->allocatedBlocks, memory_order_relaxed);
+    i64 sendBlockBytes = atomic_load_explicit(&pool->sendBlockBytes, memory_order_relaxed);
+    pthread_mutex_lock(&pool->mutex);
+    i32 freeBlocks = pool->freeCount;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (maxPlayer == NULL) {
+        LogInfo("Connection memory: no players, %d pool blocks (%d free)", (int) allocatedBlocks, (int) freeBlocks);
+        return;
+    }
+    LogInfo("Connection memory: %.1fMB for %d players (%.0fKB average, %.0fKB most for '%.*s'), %.1fMB buffered output, %d pool blocks (%d free)",
+            totalMemory / 1000000.0, (int) playerCount,
+            totalMemory / 1000.0 / playerCount,
+            maxMemory / 1000.0, (int) maxPlayer->player.username_size, maxPlayer->player.username,
+            sendBlockBytes / 1000000.0, (int) allocatedBlocks, (int) freeBlocks);
+}
+
+void TickNetwork(void) {
+    UpdateChunkPacketCache();
+
+    if ((serv->current_tick % (10 * 20)) == 0) {
+        LogCompressionStats();
+        LogConnectionMemory();
+    }
+}
+
+i32 GetQueuedPacketBytes(PlayerConnection * conn) {
+    u32 writePos = atomic_load_explicit(&conn->outbound.writeRing->writePos, memory_order_relaxed);
+    u32 consumedPos = atomic_load_explicit(&conn->outbound.publishedConsumedPos, memory_order_relaxed);
+    return writePos - consumedPos;
+}
+
+PlayerLinkStats GetPlayerLinkStats(PlayerConnection * conn) {
+    PlayerLinkStats res = {
+        .deliveredBytes = atomic_load_explicit(&conn->deliveredBytes, memory_order_relaxed),
+        .unsentBytes = atomic_load_explicit(&conn->unsentBytes, memory_order_relaxed),
+        .sendStallStreak = atomic_load_explicit(&conn->publishedStallStreak, memory_order_relaxed),
+        .rttMicros = atomic_load_explicit(&conn->rttMicros, memory_order_relaxed),
+    };
+    return res;
+}
+
+i32 IsPlayerConnectionClosed(PlayerConnection * conn) {
+    return !!(atomic_load_explicit(&conn->atomicFlags, memory_order_acquire) & CONNECTION_CLOSED);
+}
+
+void ReleasePlayerConnection(PlayerConnection * conn) {
+    conn->thread->assignedCount--;
+    atomic_fetch_or_explicit(&conn->atomicFlags, CONNECTION_RELEASED, memory_order_release);
+}
+
+void WakeNetworkThreads(void) {
+    for (i32 i = 0; i < network.networkThreadCount; i++) {
+        NetworkThread * thread = network.networkThreads + i;
+        // NOTE(traks): if the pipe is full, the thread has a wake up pending
+        // anyway
+        write(thread->wakeWriteFd, &(u8) {0}, 1);
+    }
+}
 
 static void CreateClient(int clientSocket) {
     i32 clientIndex;
@@ -130,8 +2460,16 @@ static void CreateClient(int clientSocket) {
     // survival). So caching compressed chunk packets may be quite effective.
     // Though there's little point if players are spread out.
 
+    if (!RegisterSocket(clientSocket, SOCKET_OWNER_CLIENT, clientIndex)) {
+        LogErrno("Client failed to register socket: %s");
+        close(clientSocket);
+        return;
+    }
+
     Client * client = calloc(1, sizeof *client);
     client->socket = clientSocket;
+    // NOTE(traks): data may have arrived before we registered the socket
+    client->flags = CLIENT_SOCKET_READABLE | CLIENT_SOCKET_WRITABLE;
 
     // TODO(traks): Should be large enough to:
     //
@@ -141,22 +2479,16 @@ static void CreateClient(int clientSocket) {
     //
     //  2. Receive a client intention packet and hello packet and store them
     //     together inside the receive buffer.
-    i32 receiveBufferSize = 1024;
+    client->receiveRing = (ReceiveRing) {
+        .data = malloc(CLIENT_RECEIVE_RING_SIZE),
+        .size = CLIENT_RECEIVE_RING_SIZE,
+    };
     // TODO(traks): figure out appropriate size
     i32 sendBufferSize = 2048;
-    i32 receivePacketBufferSize = 1024;
-    client->recBuf = (Buffer) {
-        .data = malloc(receiveBufferSize),
-        .size = receiveBufferSize,
-    };
     client->sendBuf = (Buffer) {
         .data = malloc(sendBufferSize),
         .size = sendBufferSize,
     };
-    client->recPacketBuf = (Buffer) {
-        .data = malloc(receivePacketBufferSize),
-        .size = receivePacketBufferSize,
-    };
 
     network.clientArray[clientIndex] = client;
     // LogInfo("Created client");
@@ -165,7 +2497,7 @@ static void CreateClient(int clientSocket) {
 static void FreeClientNoClose(i32 clientIndex) {
     Client * client = network.clientArray[clientIndex];
     assert(client != NULL);
-    free(client->recBuf.data);
+    free(client->receiveRing.data);
     free(client->sendBuf.data);
     free(client);
     network.clientArray[clientIndex] = NULL;
@@ -183,102 +2515,87 @@ static void ClientMarkTerminate(Client * client) {
 }
 
 static void ClientReadAllPackets(Client * client) {
-    if (client->recBuf.cursor == client->recBuf.size) {
+    ReceiveRing * ring = &client->receiveRing;
+    if (ReceiveRingFree(ring) == 0) {
         // NOTE(traks): Should never happen. If there's a full packet in the
-        // buffer, we always drain it. Maybe some parse error occurred and we
+        // ring, we always drain it. Maybe some parse error occurred and we
         // didn't kick the client?
         LogInfo("Client read buffer full");
         ClientMarkTerminate(client);
         return;
     }
 
-    ssize_t receiveSize = recv(client->socket, client->recBuf.data + client->recBuf.cursor, client->recBuf.size - client->recBuf.cursor, 0);
-
-    if (receiveSize == 0) {
-        // NOTE(traks): client closed its end of the connection
-        LogInfo("Client disconnected itself");
-        ClientMarkTerminate(client);
-        return;
-    } else if (receiveSize == -1) {
-        if (errno == EAGAIN) {
-            // NOTE(traks): EAGAIN means there was no new data in the socket's
-            // internal receive buffer
-        } else {
-            LogErrno("Couldn't receive protocol data from client: %s");
-            ClientMarkTerminate(client);
-            return;
-        }
-    } else {
-        client->recBuf.cursor += receiveSize;
-    }
-
-    Cursor * recCursor = &(Cursor) {
-        .data = client->recBuf.data,
-        .size = client->recBuf.cursor,
-    };
-
-    // NOTE(traks): compact the incoming packet buffer
-    memmove(client->recPacketBuf.data, client->recPacketBuf.data + client->recPacketBufConsumed, client->recPacketBuf.cursor - client->recPacketBufConsumed);
-    client->recPacketBuf.cursor -= client->recPacketBufConsumed;
-    client->recPacketBufConsumed = 0;
-
-    for (;;) {
-        CursorSetMark(recCursor);
-        i32 packetSizeRemaining = ReadVarU32(recCursor);
-        i32 prefixSize = recCursor->index - recCursor->mark;
-        CursorRewind(recCursor);
-
-        if (recCursor->error != 0) {
-            // NOTE(traks): packet size not fully received yet
-            break;
-        }
-
-        i32 maxRemaining = client->recBuf.size - prefixSize;
-        if (packetSizeRemaining <= 0 || packetSizeRemaining > maxRemaining) {
-            LogInfo("Packet size error: %d, max: %d", packetSizeRemaining, maxRemaining);
-            ClientMarkTerminate(client);
-            return;
-        }
-
-        i32 totalPacketSize = packetSizeRemaining + prefixSize;
-        if (totalPacketSize > CursorRemaining(recCursor)) {
-            // NOTE(traks): packet not fully received yet
-            break;
-        }
+    if (client->flags & CLIENT_SOCKET_READABLE) {
+        u32 maxReceiveSize = ReceiveRingFree(ring);
+        ssize_t receiveSize = ReceiveIntoRing(client->socket, ring, maxReceiveSize);
 
-        if (totalPacketSize > (client->recPacketBuf.size - client->recPacketBuf.cursor)) {
-            LogInfo("Client sending too much data");
+        if (receiveSize == 0) {
+            // NOTE(traks): client closed its end of the connection
+            LogInfo("Client disconnected itself");
             ClientMarkTerminate(client);
             return;
+        } else if (receiveSize == -1) {
+            if (errno == EAGAIN) {
+                // NOTE(traks): EAGAIN means there was no new data in the
+                // socket's internal receive buffer
+                client->flags &= ~CLIENT_SOCKET_READABLE;
+            } else {
+                LogErrno("Couldn't receive protocol data from client: %s");
+                ClientMarkTerminate(client);
+                return;
+            }
+        } else if ((u32) receiveSize < maxReceiveSize) {
+            // NOTE(traks): drained the socket's receive buffer
+            client->flags &= ~CLIENT_SOCKET_READABLE;
         }
-
-        memcpy(client->recPacketBuf.data + client->recPacketBuf.cursor, recCursor->data + recCursor->index, totalPacketSize);
-        client->recPacketBuf.cursor += totalPacketSize;
-
-        recCursor->index += totalPacketSize;
     }
-
-    memmove(recCursor->data, recCursor->data + recCursor->index, recCursor->size - recCursor->index);
-    client->recBuf.cursor = recCursor->size - recCursor->index;
 }
 
-static Cursor ClientGetNextPacket(Client * client) {
+// NOTE(traks): Returns the next fully received packet, or a cursor with NULL
+// data if there is none. The packet is read straight from the receive ring,
+// unless it wraps around the end of the ring. Then it's copied into the
+// scratch buffer, which must be as large as the ring.
+static Cursor ClientGetNextPacket(Client * client, u8 * scratch) {
     Cursor res = {0};
-    if (client->recPacketBufConsumed == client->recPacketBuf.cursor) {
+    ReceiveRing * ring = &client->receiveRing;
+
+    u32 packetSize = 0;
+    i32 prefixSize = PeekReceiveRingVarU32(ring, ring->readPos, &packetSize);
+    if (prefixSize == 0) {
+        // NOTE(traks): packet size not fully received yet
+        return res;
+    }
+    if (prefixSize < 0) {
+        LogInfo("Packet size VarInt too long");
+        ClientMarkTerminate(client);
         return res;
     }
 
-    Cursor * temp = &(Cursor) {
-        .data = client->recPacketBuf.data,
-        .size = client->recPacketBuf.cursor,
-        .index = client->recPacketBufConsumed,
-    };
-    i32 packetSizeRemaining = ReadVarU32(temp);
+    u32 maxPacketSize = ring->size - prefixSize;
+    if (packetSize == 0 || packetSize > maxPacketSize) {
+        LogInfo("Packet size error: %d, max: %d", (i32) packetSize, (i32) maxPacketSize);
+        ClientMarkTerminate(client);
+        return res;
+    }
+    if (prefixSize + packetSize > ring->writePos - ring->readPos) {
+        // NOTE(traks): packet not fully received yet
+        return res;
+    }
 
-    res.data = temp->data + temp->index;
-    res.size = packetSizeRemaining;
+    u32 packetPos = ring->readPos + prefixSize;
+    u8 * first;
+    i32 firstSize;
+    i32 restSize;
+    GetReceiveRingSpans(ring, packetPos, packetSize, &first, &firstSize, &restSize);
+    if (restSize == 0) {
+        res.data = first;
+    } else {
+        CopyFromReceiveRing(ring, packetPos, scratch, packetSize);
+        res.data = scratch;
+    }
+    res.size = packetSize;
 
-    client->recPacketBufConsumed = temp->index + packetSizeRemaining;
+    ring->readPos = packetPos + packetSize;
     return res;
 }
 
@@ -319,61 +2636,15 @@ static void ClientProcessSinglePacket(Client * client, Cursor * recCursor, Curso
         // read status request packet
         // empty
 
-        MemoryArena scratch_arena = {
-            .data = serv->short_lived_scratch,
-            .size = serv->short_lived_scratch_size
-        };
-
-        int list_size = serv->tab_list_size;
-        size_t list_bytes = list_size * sizeof (entity_id);
-        entity_id * list = MallocInArena(
-                &scratch_arena, list_bytes);
-        memcpy(list, serv->tab_list, list_bytes);
-        int sample_size = MIN(12, list_size);
-
-        unsigned char * response = MallocInArena(&scratch_arena, 2048);
-        int response_size = 0;
-        response_size += sprintf((char *) response + response_size,
-                "{\"version\":{\"name\":\"%s\",\"protocol\":%d},"
-                "\"players\":{\"max\":%d,\"online\":%d,\"sample\":[",
-                SERVER_GAME_VERSION, SERVER_PROTOCOL_VERSION,
-                (int) MAX_PLAYERS, (int) list_size);
-
-        for (int sampleIndex = 0; sampleIndex < sample_size; sampleIndex++) {
-            int target = sampleIndex + (rand() % (list_size - sampleIndex));
-            entity_id * sampled = list + target;
-
-            if (sampleIndex > 0) {
-                response[response_size] = ',';
-                response_size += 1;
-            }
-
-            entity_base * entity = resolve_entity(*sampled);
-            // @TODO(traks) this assert fired, not sure how that
-            // happened. Can leave it for now, since these things
-            // will may need to be rewritten anyway if we decide to
-            // move all initial session stuff to a separate thread.
-            assert(entity->type == ENTITY_PLAYER);
-            // @TODO(traks) actual UUID
-            response_size += sprintf((char *) response + response_size,
-                    "{\"id\":\"01234567-89ab-cdef-0123-456789abcdef\","
-                    "\"name\":\"%.*s\"}",
-                    (int) entity->player.username_size,
-                    entity->player.username);
-
-            *sampled = list[sampleIndex];
-        }
-
-        // TODO(traks): implement chat previewing
-        response_size += sprintf((char *) response + response_size,
-                "]},\"description\":{\"text\":\"Running Blaze\"}}");
-
+        // NOTE(traks): the tick thread keeps the response up to date
+        pthread_mutex_lock(&network.loginMutex);
+        int response_size = network.statusResponseSize;
         int out_size = VarU32Size(0) + VarU32Size(response_size) + response_size;
-        int start = sendCursor->index;
         WriteVarU32(sendCursor, out_size);
         WriteVarU32(sendCursor, 0);
         WriteVarU32(sendCursor, response_size);
-        WriteData(sendCursor, response, response_size);
+        WriteData(sendCursor, network.statusResponse, response_size);
+        pthread_mutex_unlock(&network.loginMutex);
 
         client->protocolState = PROTOCOL_AWAIT_PING_REQUEST;
         break;
@@ -434,8 +2705,10 @@ static void ClientProcessAllPackets(Client * client) {
         .index = client->sendBuf.cursor,
     };
 
+    u8 scratch[CLIENT_RECEIVE_RING_SIZE];
+
     for (;;) {
-        Cursor packetCursor = ClientGetNextPacket(client);
+        Cursor packetCursor = ClientGetNextPacket(client, scratch);
         if (packetCursor.data == NULL) {
             break;
         }
@@ -473,94 +2746,138 @@ static void ClientTick(Client * client) {
 
     // NOTE(traks): send outgoing packets
 
-    ssize_t sendSize = send(client->socket, client->sendBuf.data, client->sendBuf.cursor, 0);
+    if (client->sendBuf.cursor > 0 && (client->flags & CLIENT_SOCKET_WRITABLE)) {
+        ssize_t sendSize = send(client->socket, client->sendBuf.data, client->sendBuf.cursor, 0);
 
-    if (sendSize == -1) {
-        if (errno == EAGAIN) {
-            // NOTE(traks): The socket's internal send buffer is full
-            // TODO(traks): If this error keeps happening, we should probably
-            // kick the client
+        if (sendSize == -1) {
+            if (errno == EAGAIN) {
+                // NOTE(traks): The socket's internal send buffer is full
+                // TODO(traks): If this error keeps happening, we should
+                // probably kick the client
+                client->flags &= ~CLIENT_SOCKET_WRITABLE;
+            } else {
+                LogErrno("Couldn't send protocol data to client: %s");
+                ClientMarkTerminate(client);
+                return;
+            }
         } else {
-            LogErrno("Couldn't send protocol data to client: %s");
-            ClientMarkTerminate(client);
-            return;
+            if (sendSize < client->sendBuf.cursor) {
+                client->flags &= ~CLIENT_SOCKET_WRITABLE;
+            }
+            memmove(client->sendBuf.data, client->sendBuf.data + sendSize, client->sendBuf.cursor - sendSize);
+            client->sendBuf.cursor -= sendSize;
         }
-    } else {
-        memmove(client->sendBuf.data, client->sendBuf.data + sendSize, client->sendBuf.cursor - sendSize);
-        client->sendBuf.cursor -= sendSize;
     }
 
-    // NOTE(traks): start the PLAY state and transfer the connection to the
-    // player entity
+    // NOTE(traks): hand the connection over to the tick thread, which will
+    // start the PLAY state and create the player entity
 
     if (client->sendBuf.cursor == 0 && client->protocolState == PROTOCOL_JOIN_WHEN_SENT) {
-        entity_base * entity = try_reserve_entity(ENTITY_PLAYER);
-
-        if (entity->type == ENTITY_NULL) {
-            // @TODO(traks) send some message and disconnect
-            ClientMarkTerminate(client);
-            return;
+        pthread_mutex_lock(&network.loginMutex);
+        // NOTE(traks): if the queue is full, try again later
+        if (network.pendingJoinCount < (i32) ARRAY_SIZE(network.pendingJoins)) {
+            if (!UnregisterSocket(client->socket)) {
+                LogErrno("Failed to unregister client socket: %s");
+                ClientMarkTerminate(client);
+            } else {
+                PendingJoin * join = network.pendingJoins + network.pendingJoinCount;
+                network.pendingJoinCount++;
+                join->socket = client->socket;
+                memcpy(join->username, client->username, client->usernameSize);
+                join->usernameSize = client->usernameSize;
+                client->flags |= CLIENT_DID_TRANSFER_TO_PLAYER;
+            }
         }
+        pthread_mutex_unlock(&network.loginMutex);
+    }
+}
 
-        entity_player * player = &entity->player;
-
-        // @TODO(traks) don't malloc this much when a player joins. AAA
-        // games send a lot less than 1MB/tick. For example, according
-        // to some website, Fortnite sends about 1.5KB/tick. Although we
-        // sometimes have to send a bunch of chunk data, which can be
-        // tens of KB. Minecraft even allows up to 2MB of chunk data.
-        player->rec_buf_size = 1 << 16;
-        player->rec_buf = malloc(player->rec_buf_size);
-
-        player->send_buf_size = 1 << 20;
-        player->send_buf = malloc(player->send_buf_size);
-
-        if (player->rec_buf == NULL || player->send_buf == NULL) {
-            // @TODO(traks) send some message on disconnect
-            free(player->send_buf);
-            free(player->rec_buf);
-            evict_entity(entity->eid);
-            ClientMarkTerminate(client);
-            return;
+static void MarkSocketReady(u64 eventData, i32 readable, i32 writable) {
+    u32 owner = eventData >> 32;
+    u32 id = eventData;
+    switch (owner) {
+    case SOCKET_OWNER_SERVER: {
+        network.serverSocketReadable |= readable;
+        break;
+    }
+    case SOCKET_OWNER_CLIENT: {
+        Client * client = network.clientArray[id];
+        if (client != NULL) {
+            client->flags |= (readable ? CLIENT_SOCKET_READABLE : 0) | (writable ? CLIENT_SOCKET_WRITABLE : 0);
         }
+        break;
+    }
+    default:
+        assert(0);
+    }
+}
 
-        player->sock = client->socket;
-        memcpy(player->username, client->username, client->usernameSize);
-        player->username_size = client->usernameSize;
-        player->chunkCacheRadius = -1;
-        // @TODO(traks) configurable server-wide global
-        player->nextChunkCacheRadius = MAX_CHUNK_CACHE_RADIUS;
-        player->last_keep_alive_sent_tick = serv->current_tick;
-        entity->flags |= PLAYER_GOT_ALIVE_RESPONSE;
-        player->selected_slot = PLAYER_FIRST_HOTBAR_SLOT;
-        // @TODO(traks) collision width and height of player depending
-        // on player pose
-        entity->collision_width = 0.6;
-        entity->collision_height = 1.8;
-        set_player_gamemode(entity, GAMEMODE_CREATIVE);
+// NOTE(traks): Blocks until some socket is ready. Wakes up regularly though,
+// so clients waiting for room in the join queue can try again.
+static void WaitForClientEvents(void) {
+    BeginTimings(WaitForClientEvents);
 
-        entity->worldId = 1;
-        // teleport_player(entity, 88, 70, 73, 0, 0);
-        teleport_player(entity, 0.5, 140, 0.5, 0, 0);
+    i32 timeoutMillis = 50;
 
-        // @TODO(traks) ensure this can never happen instead of assering
-        // it never will hopefully happen
-        assert(serv->tab_list_added_count < (i32) ARRAY_SIZE(serv->tab_list_added));
-        serv->tab_list_added[serv->tab_list_added_count] = entity->eid;
-        serv->tab_list_added_count++;
+#ifdef NETWORK_EPOLL
+    struct epoll_event events[128];
+    for (;;) {
+        int eventCount = epoll_wait(network.epollFd, events, ARRAY_SIZE(events), timeoutMillis);
+        if (eventCount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LogErrno("Failed to wait for network events: %s");
+            break;
+        }
+        // NOTE(traks): only block for the first batch of events
+        timeoutMillis = 0;
+
+        for (i32 eventIndex = 0; eventIndex < eventCount; eventIndex++) {
+            struct epoll_event * event = events + eventIndex;
+            // NOTE(traks): let the read or write find out about errors and
+            // hangups
+            i32 readable = !!(event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+            i32 writable = !!(event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR));
+            MarkSocketReady(event->data.u64, readable, writable);
+        }
 
-        client->flags |= CLIENT_DID_TRANSFER_TO_PLAYER;
+        if (eventCount < (i32) ARRAY_SIZE(events)) {
+            break;
+        }
+    }
+#else
+    // NOTE(traks): no edge-triggered notifications, so wait until any socket
+    // is ready and then try every socket
+    struct pollfd pollFds[1 + 32];
+    i32 pollFdCount = 0;
+    pollFds[pollFdCount++] = (struct pollfd) {.fd = network.serverSocket, .events = POLLIN};
+    for (i32 clientIndex = 0; clientIndex < network.clientArraySize && pollFdCount < (i32) ARRAY_SIZE(pollFds); clientIndex++) {
+        Client * client = network.clientArray[clientIndex];
+        if (client != NULL) {
+            pollFds[pollFdCount++] = (struct pollfd) {.fd = client->socket, .events = POLLIN | (client->sendBuf.cursor > 0 ? POLLOUT : 0)};
+        }
+    }
+    poll(pollFds, pollFdCount, timeoutMillis);
 
-        LogInfo("Player '%.*s' joined", (int) client->usernameSize, client->username);
+    MarkSocketReady((u64) SOCKET_OWNER_SERVER << 32, 1, 1);
+    for (i32 clientIndex = 0; clientIndex < network.clientArraySize; clientIndex++) {
+        MarkSocketReady(((u64) SOCKET_OWNER_CLIENT << 32) | clientIndex, 1, 1);
     }
+#endif
+
+    EndTimings(WaitForClientEvents);
 }
 
-void TickInitialConnections(void) {
+static void TickInitialConnections(void) {
     BeginTimings(AcceptInitialConnections);
 
-    for (;;) {
+    while (network.serverSocketReadable) {
         int accepted = accept(network.serverSocket, NULL, NULL);
         if (accepted == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                network.serverSocketReadable = 0;
+            }
             break;
         }
         CreateClient(accepted);
@@ -585,6 +2902,143 @@ void TickInitialConnections(void) {
     EndTimings(TickClients);
 }
 
+static void * RunLoginThread(void * arg) {
+#ifdef PROFILE
+    TracyCSetThreadName("Login");
+#endif
+
+    for (;;) {
+        WaitForClientEvents();
+        TickInitialConnections();
+    }
+    return NULL;
+}
+
+static void SetStatusResponse(entity_id * sample, i32 sampleSize, i32 onlineCount) {
+    u8 response[sizeof network.statusResponse];
+    i32 maxSize = sizeof response;
+    i32 size = 0;
+    size += snprintf((char *) response + size, maxSize - size,
+            "{\"version\":{\"name\":\"%s\",\"protocol\":%d},"
+            "\"players\":{\"max\":%d,\"online\":%d,\"sample\":[",
+            SERVER_GAME_VERSION, SERVER_PROTOCOL_VERSION,
+            (int) MAX_PLAYERS, (int) onlineCount);
+
+    for (i32 sampleIndex = 0; sampleIndex < sampleSize; sampleIndex++) {
+        entity_base * entity = resolve_entity(sample[sampleIndex]);
+        // @TODO(traks) this assert fired, not sure how that
+        // happened. Can leave it for now, since these things
+        // will may need to be rewritten anyway.
+        assert(entity->type == ENTITY_PLAYER);
+        // @TODO(traks) actual UUID
+        size += snprintf((char *) response + size, maxSize - size,
+                "%s{\"id\":\"01234567-89ab-cdef-0123-456789abcdef\","
+                "\"name\":\"%.*s\"}",
+                sampleIndex > 0 ? "," : "",
+                (int) entity->player.username_size,
+                entity->player.username);
+    }
+
+    // TODO(traks): implement chat previewing
+    size += snprintf((char *) response + size, maxSize - size,
+            "]},\"description\":{\"text\":\"Running Blaze\"}}");
+    size = MIN(size, maxSize - 1);
+
+    pthread_mutex_lock(&network.loginMutex);
+    memcpy(network.statusResponse, response, size);
+    network.statusResponseSize = size;
+    pthread_mutex_unlock(&network.loginMutex);
+}
+
+void UpdateStatusResponse(void) {
+    BeginTimings(UpdateStatusResponse);
+
+    entity_id list[ARRAY_SIZE(serv->tab_list)];
+    i32 listSize = serv->tab_list_size;
+    memcpy(list, serv->tab_list, listSize * sizeof *list);
+    i32 sampleSize = MIN(12, listSize);
+
+    // NOTE(traks): partial shuffle to pick a random sample
+    for (i32 sampleIndex = 0; sampleIndex < sampleSize; sampleIndex++) {
+        i32 target = sampleIndex + (rand() % (listSize - sampleIndex));
+        entity_id sampled = list[target];
+        list[target] = list[sampleIndex];
+        list[sampleIndex] = sampled;
+    }
+
+    SetStatusResponse(list, sampleSize, listSize);
+
+    EndTimings(UpdateStatusResponse);
+}
+
+static void AcceptNewPlayer(PendingJoin * join) {
+    entity_base * entity = try_reserve_entity(ENTITY_PLAYER);
+
+    if (entity->type == ENTITY_NULL) {
+        // @TODO(traks) send some message and disconnect
+        close(join->socket);
+        return;
+    }
+
+    entity_player * player = &entity->player;
+
+    player->connection = CreatePlayerConnection(join->socket);
+    if (player->connection == NULL) {
+        // @TODO(traks) send some message on disconnect
+        evict_entity(entity->eid);
+        close(join->socket);
+        return;
+    }
+
+    memcpy(player->username, join->username, join->usernameSize);
+    player->username_size = join->usernameSize;
+    player->chunkCacheRadius = -1;
+    player->chunkSendRate = INITIAL_CHUNK_SEND_RATE;
+    player->bandwidthSampleTick = serv->current_tick;
+    // NOTE(traks): the player is missing everything, make sure they get a
+    // share of the chunk encode budget right away
+    player->missingChunkCount = MAX_CHUNK_CACHE_DIAM * MAX_CHUNK_CACHE_DIAM;
+    // @TODO(traks) configurable server-wide global
+    player->nextChunkCacheRadius = MAX_CHUNK_CACHE_RADIUS;
+    player->last_keep_alive_sent_tick = serv->current_tick;
+    entity->flags |= PLAYER_GOT_ALIVE_RESPONSE;
+    player->selected_slot = PLAYER_FIRST_HOTBAR_SLOT;
+    // @TODO(traks) collision width and height of player depending
+    // on player pose
+    entity->collision_width = 0.6;
+    entity->collision_height = 1.8;
+    set_player_gamemode(entity, GAMEMODE_CREATIVE);
+
+    entity->worldId = 1;
+    // teleport_player(entity, 88, 70, 73, 0, 0);
+    teleport_player(entity, 0.5, 140, 0.5, 0, 0);
+
+    // @TODO(traks) ensure this can never happen instead of assering
+    // it never will hopefully happen
+    assert(serv->tab_list_added_count < (i32) ARRAY_SIZE(serv->tab_list_added));
+    serv->tab_list_added[serv->tab_list_added_count] = entity->eid;
+    serv->tab_list_added_count++;
+
+    LogInfo("Player '%.*s' joined", (int) join->usernameSize, join->username);
+}
+
+void AcceptNewPlayers(void) {
+    BeginTimings(AcceptNewPlayers);
+
+    PendingJoin joins[ARRAY_SIZE(network.pendingJoins)];
+    pthread_mutex_lock(&network.loginMutex);
+    i32 joinCount = network.pendingJoinCount;
+    memcpy(joins, network.pendingJoins, joinCount * sizeof *joins);
+    network.pendingJoinCount = 0;
+    pthread_mutex_unlock(&network.loginMutex);
+
+    for (i32 joinIndex = 0; joinIndex < joinCount; joinIndex++) {
+        AcceptNewPlayer(joins + joinIndex);
+    }
+
+    EndTimings(AcceptNewPlayers);
+}
+
 void InitNetwork(void) {
     struct sockaddr_in serverAddress = {
         .sin_family = AF_INET,
@@ -636,9 +3090,51 @@ void InitNetwork(void) {
     }
 
     network.serverSocket = serverSocket;
+    // NOTE(traks): connections may be waiting already
+    network.serverSocketReadable = 1;
+
+#ifdef NETWORK_EPOLL
+    network.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (network.epollFd == -1) {
+        LogErrno("Failed to create epoll instance: %s");
+        exit(1);
+    }
+#endif
+    if (!RegisterSocket(serverSocket, SOCKET_OWNER_SERVER, 0)) {
+        LogErrno("Failed to register server socket: %s");
+        exit(1);
+    }
 
     network.clientArraySize = 32;
     network.clientArray = calloc(1, network.clientArraySize * sizeof *network.clientArray);
 
+    pthread_mutex_init(&network.loginMutex, NULL);
+    pthread_mutex_init(&network.blockPool.mutex, NULL);
+    if (deflateInit(&network.broadcastDeflateStream, REGULAR_COMPRESSION_LEVEL) != Z_OK) {
+        LogInfo("Failed to initialise broadcast deflate stream");
+        exit(1);
+    }
+    SetStatusResponse(NULL, 0, 0);
+
+    // NOTE(traks): leave a core for the tick thread. The network threads
+    // spend most of their time compressing, so spread players over as many
+    // cores as we can.
+    long coreCount = sysconf(_SC_NPROCESSORS_ONLN);
+    network.networkThreadCount = CLAMP(coreCount - 1, 1, MAX_NETWORK_THREADS);
+    network.networkThreads = calloc(network.networkThreadCount, sizeof *network.networkThreads);
+    if (network.networkThreads == NULL) {
+        LogInfo("Failed to allocate network threads");
+        exit(1);
+    }
+    for (i32 i = 0; i < network.networkThreadCount; i++) {
+        InitNetworkThread(network.networkThreads + i);
+    }
+    LogInfo("Started %d network threads", (int) network.networkThreadCount);
+
+    if (pthread_create(&network.loginThread, NULL, RunLoginThread, NULL) != 0) {
+        LogInfo("Failed to create login thread");
+        exit(1);
+    }
+
     LogInfo("Bound to address");
 }
@@ -1,7 +1,109 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include "shared.h"
+#include "buffer.h"
+
+// NOTE(traks): starts the login thread, which accepts connections and handles
+// handshakes, status requests and logins, and the network threads
 void InitNetwork(void);
-void TickInitialConnections(void);
+// NOTE(traks): creates player entities for clients that finished logging in
+void AcceptNewPlayers(void);
+// NOTE(traks): rebuilds the response to status requests from the tab list
+void UpdateStatusResponse(void);
+
+// NOTE(traks): Internal packet headers set by finish_packet. The low 3 bits
+// are the number of bytes skipped before the packet size. Packets that need no
+// more work from the network thread start with their final frame instead,
+// which always has the top bit set in its first byte.
+#define PACKET_HEADER_FRAMED (0x80)
+#define PACKET_HEADER_COMPRESS (0x10)
+// NOTE(traks): set for packets that carry lots of world data, like chunk
+// packets. The network threads adjust the compression level of those packets
+// to their load.
+#define PACKET_HEADER_BULK (0x08)
+
+// NOTE(traks): Player connections are owned by the network threads. They
+// decode serverbound packets and compress and send clientbound packets. The
+// functions below are for the tick thread.
+
+// NOTE(traks): returns the next decoded serverbound packet, or a cursor with
+// NULL data if there is none. The packet data stays valid until it's popped.
+Cursor PeekPlayerPacket(PlayerConnection * conn);
+void PopPlayerPacket(PlayerConnection * conn, Cursor * packet);
+// NOTE(traks): hands a batch of packets written with begin_packet and
+// finish_packet to the network thread. Returns 0 if the connection's outbound
+// queue is full.
+i32 QueuePlayerPackets(PlayerConnection * conn, u8 * data, i32 size);
+// NOTE(traks): Returns where a batch of up to maxSize bytes can be written
+// straight into the connection's outbound queue, or NULL if there's no room
+// for that many bytes. Hand the batch over with CommitPlayerPackets, or don't
+// call it to drop the batch.
+u8 * BeginPlayerPackets(PlayerConnection * conn, i32 maxSize);
+void CommitPlayerPackets(PlayerConnection * conn, i32 size);
+// NOTE(traks): call for batches of packets that won't be queued
+void DiscardPlayerPackets(u8 * data, i32 size);
+// NOTE(traks): number of bytes of queued packets the network thread hasn't
+// finalised yet
+i32 GetQueuedPacketBytes(PlayerConnection * conn);
+
+// NOTE(traks): what the network thread last saw of the connection
+typedef struct {
+    // NOTE(traks): bytes the kernel got rid of, roughly what reached the
+    // client
+    i64 deliveredBytes;
+    // NOTE(traks): compressed bytes in our send queue or the kernel's
+    i32 unsentBytes;
+    // NOTE(traks): number of sends in a row that couldn't empty the send buffer
+    i32 sendStallStreak;
+    // NOTE(traks): smoothed TCP round trip time, 0 if unknown
+    i32 rttMicros;
+} PlayerLinkStats;
+
+PlayerLinkStats GetPlayerLinkStats(PlayerConnection * conn);
+i32 IsPlayerConnectionClosed(PlayerConnection * conn);
+// NOTE(traks): closes the connection. Don't use it afterwards.
+void ReleasePlayerConnection(PlayerConnection * conn);
+// NOTE(traks): lets the network threads know there are new packets to send.
+// Call once all players have been sent their packets for the tick.
+void WakeNetworkThreads(void);
+
+// NOTE(traks): Chunk packets are shared by all players, so they only need to
+// be built and compressed once per version of the chunk. If the cache has the
+// compressed packet, writes a reference to it and returns 1. Otherwise returns
+// 0, and if canFill is set, the caller must write the chunk packet right after,
+// which the network thread will then store in the cache. Only for players with
+// packet compression.
+i32 TryWriteCachedChunkPacket(Cursor * sendCursor, WorldChunkPos pos, u64 contentVersion, i32 canFill);
+// NOTE(traks): Packets that are the same for lots of players, like chat
+// messages, are encoded and compressed once per tick into a broadcast packet.
+// Batches of players with packet compression then just refer to it. Create one
+// from a batch of packets written with begin_packet and finish_packet for a
+// player with packet compression. Returns NULL if that fails. Release the
+// creator's reference once all players have their batches.
+typedef struct BroadcastPacket BroadcastPacket;
+
+BroadcastPacket * CreateBroadcastPacket(u8 * data, i32 size);
+void WriteBroadcastPacketRecord(Cursor * sendCursor, BroadcastPacket * packet);
+void ReleaseBroadcastPacket(BroadcastPacket * packet);
+// NOTE(traks): Data in the middle of a large packet that's the same for all
+// players, like the registries in the login packet. It's compressed once with
+// CompressFragment. WriteSplicedPacket then builds the final packet for a
+// player with packet compression. The head (which starts with the packet ID)
+// and the tail go around the fragment uncompressed, so building the packet
+// for a player only means copying.
+typedef struct {
+    u8 * data;
+    i32 size;
+    i32 uncompressedSize;
+    u32 checksum;
+} CompressedFragment;
+
+// NOTE(traks): returns a fragment with NULL data if compression fails
+CompressedFragment CompressFragment(u8 * data, i32 size);
+void WriteSplicedPacket(Cursor * sendCursor, u8 * head, i32 headSize, CompressedFragment * fragment, u8 * tail, i32 tailSize);
+// NOTE(traks): evicts old chunk packets and logs network statistics. Call once
+// per tick.
+void TickNetwork(void);
 
 #endif
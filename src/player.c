@@ -1,14 +1,16 @@
-#include <sys/socket.h>
-#include <unistd.h>
-#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
-#include <zlib.h>
 #include "shared.h"
 #include "nbt.h"
 #include "chunk.h"
+#include "network.h"
+#include "cpu.h"
+
+#ifdef CPU_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 // Implicit packet IDs for ease of updating. Updating packet IDs manually is a
 // pain because packet types are ordered alphabetically and Mojang doesn't
@@ -689,6 +691,7 @@ process_packet(entity_base * entity, Cursor * rec_cursor,
         i64 id = ReadU64(rec_cursor);
         if (player->last_keep_alive_sent_tick == id) {
             entity->flags |= PLAYER_GOT_ALIVE_RESPONSE;
+            player->keepAliveRttNanos = NanoTime() - player->lastKeepAliveSentNanos;
         }
         break;
     }
@@ -1209,15 +1212,17 @@ begin_packet(Cursor * send_cursor, i32 id) {
 }
 
 static void
-finish_packet(Cursor * send_cursor, entity_base * player) {
+finish_packet_as(Cursor * send_cursor, i32 compression) {
     // We use the written data to determine the packet size instead of
     // calculating the packet size up front. The major benefit is that
     // calculating the packet size up front is very error prone and requires a
     // lot of maintainance (in case of packet format changes).
     //
-    // The downside is that we have to copy all packet data an additional time,
-    // because Mojang decided to encode packet sizes with a variable-size
-    // encoding.
+    // The downside is that Mojang decided to encode packet sizes with a
+    // variable-size encoding, so the size doesn't generally fill the space we
+    // reserved for it. Packets too small to compress get padded sizes instead,
+    // so they're in their final form right away. The network thread compresses
+    // the larger ones straight from here anyway.
 
     if (send_cursor->error != 0 || send_cursor->index == send_cursor->size) {
         // @NOTE(traks) packet ID could be invalid, but print it anyway
@@ -1225,17 +1230,37 @@ finish_packet(Cursor * send_cursor, entity_base * player) {
         CursorSkip(send_cursor, 6);
         i32 maybeId = ReadVarU32(send_cursor);
         LogInfo("Finished invalid packet: %d", maybeId);
+        // NOTE(traks): drop the packet, so the packets before it are still
+        // well-formed
+        send_cursor->index = send_cursor->mark;
         return;
     }
 
     int packet_end = send_cursor->index;
+    send_cursor->index = send_cursor->mark + 6;
+    i32 packet_id = ReadVarU32(send_cursor);
     send_cursor->index = send_cursor->mark;
     i32 packet_size = packet_end - send_cursor->index - 6;
 
+    if (compression && packet_size < PACKET_COMPRESSION_THRESHOLD) {
+        // NOTE(traks): The frame size (the client reads up to 3 bytes) and an
+        // uncompressed size of 0, which tells the client the packet isn't
+        // compressed. Together they exactly fill the reserved bytes, so runs
+        // of small packets are contiguous and the network thread can send them
+        // straight from the outbound queue.
+        WritePaddedVarU32(send_cursor, 3 + packet_size, 3);
+        WritePaddedVarU32(send_cursor, 0, 3);
+        send_cursor->index = packet_end;
+        return;
+    }
+
     int size_offset = 5 - VarU32Size(packet_size);
     int internal_header = size_offset;
-    if (player->flags & PLAYER_PACKET_COMPRESSION) {
-        internal_header |= 0x80;
+    if (compression) {
+        internal_header |= PACKET_HEADER_COMPRESS;
+    }
+    if (packet_id == CBP_LEVEL_CHUNK_WITH_LIGHT || packet_id == CBP_LIGHT_UPDATE) {
+        internal_header |= PACKET_HEADER_BULK;
     }
     send_cursor->data[send_cursor->index] = internal_header;
     send_cursor->index += 1 + size_offset;
@@ -1247,6 +1272,11 @@ finish_packet(Cursor * send_cursor, entity_base * player) {
     // LogInfo("Packet size: %d", (int) packet_size);
 }
 
+static void
+finish_packet(Cursor * send_cursor, entity_base * player) {
+    finish_packet_as(send_cursor, player->flags & PLAYER_PACKET_COMPRESSION);
+}
+
 static void PackLightSection(Cursor * targetCursor, u8 * source) {
     WriteVarU32(targetCursor, 2048);
     u8 * target = targetCursor->data + targetCursor->index;
@@ -1257,87 +1287,264 @@ static void PackLightSection(Cursor * targetCursor, u8 * source) {
     }
 }
 
+static void WriteHeightMapNbt(Cursor * send_cursor, String name, i16 * heights) {
+    nbt_write_key(send_cursor, NBT_TAG_LONG_ARRAY, name);
+    // number of elements in long array
+    i32 bitsPerValue = CeilLog2U32(WORLD_HEIGHT + 1);
+    i32 valuesPerLong = 64 / bitsPerValue;
+    i32 longs = (16 * 16  + valuesPerLong - 1) / valuesPerLong;
+    WriteU32(send_cursor, longs);
+    u64 val = 0;
+    int offset = 0;
+
+    for (int j = 0; j < 16 * 16; j++) {
+        // NOTE(traks): the client wants heights relative to the bottom of
+        // the world
+        u64 height = heights[j] - MIN_WORLD_Y;
+        val |= height << offset;
+        offset += bitsPerValue;
+
+        if (offset > 64 - bitsPerValue) {
+            WriteU64(send_cursor, val);
+            val = 0;
+            offset = 0;
+        }
+    }
+
+    if (offset != 0) {
+        WriteU64(send_cursor, val);
+    }
+}
+
+// NOTE(traks): Pack kernels for paletted sections, the reverse of the Anvil
+// unpack kernels. They pack the 4096 palette indices of a section into
+// big-endian longs of 64 / bitsPerBlock indices each, starting from the least
+// significant bits. Indices never straddle two longs.
+
+#define MIN_PACKED_BITS_PER_BLOCK 4
+#define MAX_PACKED_BITS_PER_BLOCK 8
+
+typedef void (* PackIndicesKernel)(u8 * restrict out, u8 * restrict indices);
+
+#define PACK_INDICES_SCALAR(bits) \
+static void PackIndicesScalar##bits(u8 * restrict out, u8 * restrict indices) { \
+    enum { blocksPerLong = 64 / (bits) }; \
+    for (i32 blockIndex = 0; blockIndex < 4096; blockIndex += blocksPerLong) { \
+        i32 count = MIN(blocksPerLong, 4096 - blockIndex); \
+        u64 longValue = 0; \
+        for (i32 i = 0; i < count; i++) { \
+            longValue |= (u64) indices[blockIndex + i] << (i * (bits)); \
+        } \
+        WriteDirectU64(out, longValue); \
+        out += 8; \
+    } \
+}
+
+PACK_INDICES_SCALAR(4)
+PACK_INDICES_SCALAR(5)
+PACK_INDICES_SCALAR(6)
+PACK_INDICES_SCALAR(7)
+PACK_INDICES_SCALAR(8)
+
+#ifdef CPU_X86_KERNELS
+
+// NOTE(traks): Every index is in its own byte, so pext with the low bits of
+// every byte packs 8 indices at once. Longs with more than 8 indices take a
+// second pext for the rest. Only the last long of a section can be partial,
+// and we load just the indices it has, so we don't read past the end.
+#define PACK_INDICES_BMI2(bits) \
+TARGET_BMI2 static void PackIndicesBmi2##bits(u8 * restrict out, u8 * restrict indices) { \
+    enum { blocksPerLong = 64 / (bits) }; \
+    u64 mask = 0x0101010101010101ULL * (((u32) 1 << (bits)) - 1); \
+    for (i32 blockIndex = 0; blockIndex < 4096; blockIndex += blocksPerLong) { \
+        i32 count = MIN(blocksPerLong, 4096 - blockIndex); \
+        u64 low = 0; \
+        u64 high = 0; \
+        if (count == blocksPerLong) { \
+            memcpy(&low, indices + blockIndex, 8); \
+            if (blocksPerLong > 8) { \
+                memcpy(&high, indices + blockIndex + 8, blocksPerLong - 8); \
+            } \
+        } else { \
+            memcpy(&low, indices + blockIndex, MIN(count, 8)); \
+            if (count > 8) { \
+                memcpy(&high, indices + blockIndex + 8, count - 8); \
+            } \
+        } \
+        u64 longValue = _pext_u64(low, mask); \
+        if (blocksPerLong > 8) { \
+            longValue |= _pext_u64(high, mask) << (8 * (bits) % 64); \
+        } \
+        WriteDirectU64(out, longValue); \
+        out += 8; \
+    } \
+}
+
+PACK_INDICES_BMI2(4)
+PACK_INDICES_BMI2(5)
+PACK_INDICES_BMI2(6)
+PACK_INDICES_BMI2(7)
+PACK_INDICES_BMI2(8)
+
+#endif
+
+static PackIndicesKernel packIndicesKernels[MAX_PACKED_BITS_PER_BLOCK + 1] = {
+    [4] = PackIndicesScalar4,
+    [5] = PackIndicesScalar5,
+    [6] = PackIndicesScalar6,
+    [7] = PackIndicesScalar7,
+    [8] = PackIndicesScalar8,
+};
+
+void InitChunkPacketKernels(void) {
+#ifdef CPU_X86_KERNELS
+    // NOTE(traks): the global palette takes 15 bits per block, so 4 block
+    // states per long. Compilers already vectorise the scalar loop well for
+    // that, so it has no kernel.
+    if (cpuFeatures.hasFastPext) {
+        packIndicesKernels[4] = PackIndicesBmi24;
+        packIndicesKernels[5] = PackIndicesBmi25;
+        packIndicesKernels[6] = PackIndicesBmi26;
+        packIndicesKernels[7] = PackIndicesBmi27;
+        packIndicesKernels[8] = PackIndicesBmi28;
+    }
+#endif
+}
+
+// NOTE(traks): Writes the block states of a section like vanilla does: a
+// single value if there's only one block state, a palette with 4 to 8 bits
+// per block if there are at most 256, and the global palette otherwise. The
+// palette is built with paletteIndexOf, which must be all zeroes and is left
+// that way. Sends the global palette if it's NULL.
+static void WriteSectionBlockStates(Cursor * send_cursor, SectionBlocks * blocks, u16 * paletteIndexOf, u8 * paletteIndices) {
+    u16 palette[256];
+    i32 paletteSize = 0;
+    i32 direct = (paletteIndexOf == NULL);
+
+    if (!direct) {
+        for (i32 i = 0; i < 16 * 16 * 16; i++) {
+            u32 blockState = SectionGetBlockState(blocks, i);
+            i32 paletteIndex = paletteIndexOf[blockState];
+            if (paletteIndex == 0) {
+                if (paletteSize == (i32) ARRAY_SIZE(palette)) {
+                    direct = 1;
+                    break;
+                }
+                palette[paletteSize] = blockState;
+                paletteSize++;
+                paletteIndexOf[blockState] = paletteSize;
+                paletteIndex = paletteSize;
+            }
+            paletteIndices[i] = paletteIndex - 1;
+        }
+
+        for (i32 i = 0; i < paletteSize; i++) {
+            paletteIndexOf[palette[i]] = 0;
+        }
+    }
+
+    if (!direct && paletteSize == 1) {
+        WriteU8(send_cursor, 0);
+        WriteVarU32(send_cursor, palette[0]);
+        WriteVarU32(send_cursor, 0);
+        return;
+    }
+
+    if (!direct) {
+        // NOTE(traks): the client doesn't accept fewer than 4 bits per block
+        // for palettes
+        i32 bitsPerBlock = MAX(CeilLog2U32(paletteSize), 4);
+        i32 blocksPerLong = 64 / bitsPerBlock;
+        i32 longs = (16 * 16 * 16 + blocksPerLong - 1) / blocksPerLong;
+        WriteU8(send_cursor, bitsPerBlock);
+        WriteVarU32(send_cursor, paletteSize);
+        for (i32 i = 0; i < paletteSize; i++) {
+            WriteVarU32(send_cursor, palette[i]);
+        }
+        WriteVarU32(send_cursor, longs);
+
+        u8 * cursorData = send_cursor->data + send_cursor->index;
+        if (CursorSkip(send_cursor, longs * 8)) {
+            assert(bitsPerBlock <= MAX_PACKED_BITS_PER_BLOCK);
+            packIndicesKernels[bitsPerBlock](cursorData, paletteIndices);
+        }
+        return;
+    }
+
+    // @TODO(traks) compute bits per block using block type table
+    int bits_per_block = CeilLog2U32(serv->vanilla_block_state_count);
+    int blocks_per_long = 64 / bits_per_block;
+    WriteU8(send_cursor, bits_per_block);
+
+    // number of longs used for the block states
+    int longs = (16 * 16 * 16 + blocks_per_long - 1) / blocks_per_long;
+    WriteVarU32(send_cursor, longs);
+    assert(blocks_per_long == 4);
+
+    u8 * cursorData = send_cursor->data + send_cursor->index;
+    if (CursorSkip(send_cursor, longs * 8)) {
+        for (i32 longIndex = 0; longIndex < longs; longIndex++) {
+            u16 blockStates[4];
+            blockStates[0] = SectionGetBlockState(blocks, 4 * longIndex + 0);
+            blockStates[1] = SectionGetBlockState(blocks, 4 * longIndex + 1);
+            blockStates[2] = SectionGetBlockState(blocks, 4 * longIndex + 2);
+            blockStates[3] = SectionGetBlockState(blocks, 4 * longIndex + 3);
+            u64 longValue = ((u64) blockStates[0])
+                    | ((u64) blockStates[1] << 15)
+                    | ((u64) blockStates[2] << 30)
+                    | ((u64) blockStates[3] << 45);
+            WriteDirectU64(cursorData + (8 * longIndex), longValue);
+        }
+    }
+}
+
+// NOTE(traks): upper bound on the size of the packets send_chunk_fully writes,
+// with 2 bytes per block state and uncompressed light
+#define MAX_CHUNK_PACKET_SIZE (SECTIONS_PER_CHUNK * (3 + 3 + 4096 * 2 + 3) + LIGHT_SECTIONS_PER_CHUNK * 2 * (3 + 2048) + 4096)
+
 void
 send_chunk_fully(Cursor * send_cursor, Chunk * ch,
         entity_base * entity, MemoryArena * tick_arena) {
     BeginTimings(SendChunkFully);
 
     // TODO(traks): make uncompressed data as compact as possible, so the
-    // compressor doesn't choke on these packets. As of writing this, these
-    // packets are ~170KiB, and take ~2ms to compress. If we send a chunk to
-    // 1000 players every tick, that's 2 seconds in a tick of 50ms, so we need
-    // 40 CPU cores for that.
+    // compressor doesn't choke on these packets. Block states are paletted
+    // now, but light is still sent uncompressed for every section.
     begin_packet(send_cursor, CBP_LEVEL_CHUNK_WITH_LIGHT);
     WriteU32(send_cursor, ch->pos.x);
     WriteU32(send_cursor, ch->pos.z);
 
     BeginTimings(WriteHeightMap);
 
-    // @NOTE(traks) height map NBT
+    // @NOTE(traks) height map NBT. The client only uses these two
     {
         nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR(""));
-
-        nbt_write_key(send_cursor, NBT_TAG_LONG_ARRAY, STR("MOTION_BLOCKING"));
-        // number of elements in long array
-        i32 bitsPerValue = CeilLog2U32(WORLD_HEIGHT + 1);
-        i32 valuesPerLong = 64 / bitsPerValue;
-        i32 longs = (16 * 16  + valuesPerLong - 1) / valuesPerLong;
-        WriteU32(send_cursor, longs);
-        u64 val = 0;
-        int offset = 0;
-
-        for (int j = 0; j < 16 * 16; j++) {
-            u64 height = ch->motion_blocking_height_map[j];
-            val |= height << offset;
-            offset += bitsPerValue;
-
-            if (offset > 64 - bitsPerValue) {
-                WriteU64(send_cursor, val);
-                val = 0;
-                offset = 0;
-            }
-        }
-
-        if (offset != 0) {
-            WriteU64(send_cursor, val);
-        }
-
+        WriteHeightMapNbt(send_cursor, STR("MOTION_BLOCKING"), ch->heightMaps[HEIGHT_MAP_MOTION_BLOCKING]);
+        WriteHeightMapNbt(send_cursor, STR("WORLD_SURFACE"), ch->heightMaps[HEIGHT_MAP_WORLD_SURFACE]);
         WriteU8(send_cursor, NBT_TAG_END);
     }
 
     EndTimings(WriteHeightMap);
 
-    // @NOTE(traks) calculate size of block data
-
     BeginTimings(WriteBlocks);
 
-    // calculate total size of chunk section data
-    i32 section_data_size = 0;
-    // @TODO(traks) compute bits per block using block type table
-    int bits_per_block = CeilLog2U32(serv->vanilla_block_state_count);
-    int blocks_per_long = 64 / bits_per_block;
-
-    for (int i = 0; i < SECTIONS_PER_CHUNK; i++) {
-        ChunkSection * section = ch->sections + i;
-        if (section->nonAirCount == 0) {
-            section_data_size += 2 + 1 + 1 + 1;
-        } else {
-            // size of non-air count + bits per block
-            section_data_size += 2 + 1;
-            // size of block state data in longs
-            int longs = (16 * 16 * 16 + blocks_per_long - 1) / blocks_per_long;
-            section_data_size += VarU32Size(longs);
-            // number of bytes used to store block state data
-            section_data_size += longs * 8;
-        }
-
-        // @NOTE(traks) size of biome data
-        section_data_size += 1 + 1 + 1;
+    // NOTE(traks): lookup table from block state to palette index + 1, kept
+    // all zeroes between sections. Without it, we just send every section
+    // with the global palette.
+    MemoryArena scratchArena = *tick_arena;
+    u16 * paletteIndexOf = MallocInArena(&scratchArena, serv->vanilla_block_state_count * sizeof (u16));
+    u8 * paletteIndices = MallocInArena(&scratchArena, 16 * 16 * 16);
+    if (paletteIndexOf != NULL && paletteIndices != NULL) {
+        memset(paletteIndexOf, 0, serv->vanilla_block_state_count * sizeof (u16));
+    } else {
+        paletteIndexOf = NULL;
     }
 
-    // @NOTE(traks) write block data
-
-    WriteVarU32(send_cursor, section_data_size);
+    // NOTE(traks): The size of the section data goes in front of it, but we
+    // only know it once the sections are written. Pad it to 3 bytes, like we
+    // do for packet sizes.
+    i32 sectionDataSizeIndex = send_cursor->index;
+    CursorSkip(send_cursor, 3);
 
     for (i32 i = 0; i < SECTIONS_PER_CHUNK; i++) {
         ChunkSection * section = ch->sections + i;
@@ -1347,30 +1554,7 @@ send_chunk_fully(Cursor * send_cursor, Chunk * ch,
             WriteVarU32(send_cursor, 0);
             WriteVarU32(send_cursor, 0);
         } else {
-            WriteU8(send_cursor, bits_per_block);
-
-            // number of longs used for the block states
-            int longs = (16 * 16 * 16 + blocks_per_long - 1) / blocks_per_long;
-            WriteVarU32(send_cursor, longs);
-            u64 val = 0;
-            int offset = 0;
-            assert(blocks_per_long == 4);
-
-            u8 * cursorData = send_cursor->data + send_cursor->index;
-            if (CursorSkip(send_cursor, longs * 8)) {
-                for (i32 longIndex = 0; longIndex < longs; longIndex++) {
-                    u16 blockStates[4];
-                    blockStates[0] = SectionGetBlockState(&section->blocks, 4 * longIndex + 0);
-                    blockStates[1] = SectionGetBlockState(&section->blocks, 4 * longIndex + 1);
-                    blockStates[2] = SectionGetBlockState(&section->blocks, 4 * longIndex + 2);
-                    blockStates[3] = SectionGetBlockState(&section->blocks, 4 * longIndex + 3);
-                    u64 longValue = ((u64) blockStates[0])
-                            | ((u64) blockStates[1] << 15)
-                            | ((u64) blockStates[2] << 30)
-                            | ((u64) blockStates[3] << 45);
-                    WriteDirectU64(cursorData + (8 * longIndex), longValue);
-                }
-            }
+            WriteSectionBlockStates(send_cursor, &section->blocks, paletteIndexOf, paletteIndices);
         }
 
         // @NOTE(traks) write biome data. Currently we just write all plains
@@ -1380,6 +1564,13 @@ send_chunk_fully(Cursor * send_cursor, Chunk * ch,
         WriteVarU32(send_cursor, 0);
     }
 
+    if (send_cursor->error == 0) {
+        i32 sectionDataEnd = send_cursor->index;
+        send_cursor->index = sectionDataSizeIndex;
+        WritePaddedVarU32(send_cursor, sectionDataEnd - sectionDataSizeIndex - 3, 3);
+        send_cursor->index = sectionDataEnd;
+    }
+
     // number of block entities
     WriteVarU32(send_cursor, 0);
 
@@ -1433,21 +1624,18 @@ send_chunk_fully(Cursor * send_cursor, Chunk * ch,
 }
 
 static void
-send_light_update(Cursor * send_cursor, ChunkPos pos, Chunk * ch,
-        entity_base * entity, MemoryArena * tick_arena) {
+send_light_update(Cursor * send_cursor, Chunk * ch, entity_base * entity) {
     BeginTimings(SendLightUpdate);
 
-    // @TODO(traks) send the real lighting data
-
     begin_packet(send_cursor, CBP_LIGHT_UPDATE);
-    WriteVarU32(send_cursor, pos.x);
-    WriteVarU32(send_cursor, pos.z);
-
-    // light sections present as arrays in this packet
-    // @NOTE(traks) add 2 for light below the world and light above the world
-    i32 lightSections = SECTIONS_PER_CHUNK + 2;
-    u64 sky_light_mask = (0x1 << lightSections) - 1;
-    u64 block_light_mask = (0x1 << lightSections) - 1;
+    WriteVarU32(send_cursor, ch->pos.x);
+    WriteVarU32(send_cursor, ch->pos.z);
+
+    // @NOTE(traks) only the sections changed this tick are present as arrays
+    // in this packet. Bits are indexed the same way as the chunk's light
+    // sections, i.e. including light below and above the world
+    u64 sky_light_mask = ch->changedSkyLightSections;
+    u64 block_light_mask = ch->changedBlockLightSections;
     // sections with all light values equal to 0
     u64 zero_sky_light_mask = 0;
     u64 zero_block_light_mask = 0;
@@ -1462,21 +1650,17 @@ send_light_update(Cursor * send_cursor, ChunkPos pos, Chunk * ch,
     WriteVarU32(send_cursor, 1);
     WriteU64(send_cursor, zero_block_light_mask);
 
-    WriteVarU32(send_cursor, lightSections);
-    for (int i = 0; i < lightSections; i++) {
-        WriteVarU32(send_cursor, 2048);
-        for (int j = 0; j < 4096; j += 2) {
-            u8 light = 0xff;
-            WriteU8(send_cursor, light);
+    WriteVarU32(send_cursor, __builtin_popcountll(sky_light_mask));
+    for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
+        if (sky_light_mask & ((u64) 1 << sectionIndex)) {
+            PackLightSection(send_cursor, ch->lightSections[sectionIndex].skyLight);
         }
     }
 
-    WriteVarU32(send_cursor, lightSections);
-    for (int i = 0; i < lightSections; i++) {
-        WriteVarU32(send_cursor, 2048);
-        for (int j = 0; j < 4096; j += 2) {
-            u8 light = 0;
-            WriteU8(send_cursor, light);
+    WriteVarU32(send_cursor, __builtin_popcountll(block_light_mask));
+    for (i32 sectionIndex = 0; sectionIndex < LIGHT_SECTIONS_PER_CHUNK; sectionIndex++) {
+        if (block_light_mask & ((u64) 1 << sectionIndex)) {
+            PackLightSection(send_cursor, ch->lightSections[sectionIndex].blockLight);
         }
     }
 
@@ -1512,7 +1696,7 @@ static void SendPlayerTeleport(entity_base * player, Cursor * send_cursor) {
 static void
 disconnect_player_now(entity_base * entity) {
     entity_player * player = &entity->player;
-    close(player->sock);
+    ReleasePlayerConnection(player->connection);
 
     i32 chunk_cache_min_x = player->chunkCacheCentreX - player->chunkCacheRadius;
     i32 chunk_cache_max_x = player->chunkCacheCentreX + player->chunkCacheRadius;
@@ -1529,9 +1713,6 @@ disconnect_player_now(entity_base * entity) {
         }
     }
 
-    free(player->rec_buf);
-    free(player->send_buf);
-
     evict_entity(entity->eid);
 }
 
@@ -1615,7 +1796,7 @@ tick_player(entity_base * player, MemoryArena * tick_arena) {
             i32 posIndex = ((basedY & 0xf) << 8) | ((z & 0xf) << 4) | (x & 0xf);
             i32 skyLight = GetSectionLight(ch->lightSections[basedY >> 4].skyLight, posIndex);
             i32 blockLight = GetSectionLight(ch->lightSections[basedY >> 4].blockLight, posIndex);
-            i32 maxHeight = ch->motion_blocking_height_map[((z & 0xf) << 4) | (x & 0xf)];
+            i32 maxHeight = ch->heightMaps[HEIGHT_MAP_MOTION_BLOCKING][((z & 0xf) << 4) | (x & 0xf)];
 
             if (serv->global_msg_count < ARRAY_SIZE(serv->global_msgs)) {
                 global_msg * msg = serv->global_msgs + serv->global_msg_count;
@@ -1629,137 +1810,43 @@ tick_player(entity_base * player, MemoryArena * tick_arena) {
     }
 
     assert(player->type == ENTITY_PLAYER);
-    int sock = player->player.sock;
-
-    // TODO(traks): We might want to move this to an event-based system (such as
-    // epoll/kqueue/etc.). Not sure if offloading some of the work to a
-    // different thread is really worth it (haven't tested). However, it seems
-    // like TCP ACKs aren't sent back to the client until our program actually
-    // reads from the OS buffers (at least on macOS). I'm thinking this might
-    // give the client's TCP stack a wrong impression about the server latency.
+    PlayerConnection * conn = player->player.connection;
+
+    // NOTE(traks): The network thread already received and decoded the
+    // packets, so we only have to process them.
     //
     // In the future we might also want to respond to certain packets
     // immediately (such as tab completes, statistics requests and chat
     // previewing), instead of waiting for the next tick. Since waiting could
     // delay the handling of the packet upward of 50ms.
-    //
-    // We also should actually also respond to server list pings as soon as
-    // possible, so the client's ping counter is accurate.
-    ssize_t rec_size = recv(sock, player->player.rec_buf + player->player.rec_cursor,
-            player->player.rec_buf_size - player->player.rec_cursor, 0);
-
-    if (rec_size == 0) {
-        disconnect_player_now(player);
-    } else if (rec_size == -1) {
-        // EAGAIN means no data received
-        if (errno != EAGAIN) {
-            LogErrno("Couldn't receive protocol data from player: %s");
-            disconnect_player_now(player);
-        }
-    } else {
-        player->player.rec_cursor += rec_size;
-
-        Cursor rec_cursor = {
-            .data = player->player.rec_buf,
-            .size = player->player.rec_cursor
-        };
 
-        // @TODO(traks) rate limit incoming packets per player
+    // @TODO(traks) rate limit incoming packets per player
 
-        for (;;) {
-            Cursor packet_cursor = rec_cursor;
-            i32 packet_size = ReadVarU32(&packet_cursor);
-
-            if (packet_cursor.error != 0) {
-                // packet size not fully received yet
-                break;
-            }
-            if (packet_size > player->player.rec_buf_size - 5 || packet_size <= 0) {
+    for (;;) {
+        Cursor packet_cursor = PeekPlayerPacket(conn);
+        if (packet_cursor.data == NULL) {
+            if (IsPlayerConnectionClosed(conn)) {
                 disconnect_player_now(player);
-                break;
-            }
-            if (packet_size > packet_cursor.size - packet_cursor.index) {
-                // packet not fully received yet
-                break;
-            }
-
-            MemoryArena process_arena = *tick_arena;
-            packet_cursor.size = packet_cursor.index + packet_size;
-            rec_cursor.index = packet_cursor.size;
-
-            if (player->flags & PLAYER_PACKET_COMPRESSION) {
-                // ignore the uncompressed packet size, since we require all
-                // packets to be compressed
-                ReadVarU32(&packet_cursor);
-
-                // @TODO(traks) move to a zlib alternative that is optimised
-                // for single pass inflate/deflate. If we don't end up doing
-                // this, make sure the code below is actually correct (when
-                // do we need to clean stuff up?)!
-
-                z_stream zstream;
-                zstream.zalloc = Z_NULL;
-                zstream.zfree = Z_NULL;
-                zstream.opaque = Z_NULL;
-
-                if (inflateInit2(&zstream, 0) != Z_OK) {
-                    LogInfo("inflateInit failed");
-                    disconnect_player_now(player);
-                    break;
-                }
-
-                zstream.next_in = packet_cursor.data + packet_cursor.index;
-                zstream.avail_in = packet_cursor.size - packet_cursor.index;
-
-                size_t max_uncompressed_size = 2 * (1 << 20);
-                unsigned char * uncompressed = MallocInArena(&process_arena,
-                        max_uncompressed_size);
-
-                zstream.next_out = uncompressed;
-                zstream.avail_out = max_uncompressed_size;
-
-                if (inflate(&zstream, Z_FINISH) != Z_STREAM_END) {
-                    LogInfo("Failed to finish inflating packet: %s", zstream.msg);
-                    disconnect_player_now(player);
-                    break;
-                }
-
-                if (inflateEnd(&zstream) != Z_OK) {
-                    LogInfo("inflateEnd failed");
-                    disconnect_player_now(player);
-                    break;
-                }
-
-                if (zstream.avail_in != 0) {
-                    LogInfo("Didn't inflate entire packet");
-                    disconnect_player_now(player);
-                    break;
-                }
-
-                packet_cursor = (Cursor) {
-                    .data = uncompressed,
-                    .size = zstream.total_out,
-                };
             }
+            break;
+        }
 
-            process_packet(player, &packet_cursor, &process_arena);
+        MemoryArena process_arena = *tick_arena;
+        process_packet(player, &packet_cursor, &process_arena);
 
-            if (packet_cursor.error != 0) {
-                LogInfo("Player protocol error occurred");
-                disconnect_player_now(player);
-                break;
-            }
+        if (packet_cursor.error != 0) {
+            LogInfo("Player protocol error occurred");
+            disconnect_player_now(player);
+            break;
+        }
 
-            if (packet_cursor.index != packet_cursor.size) {
-                LogInfo("Player protocol packet not fully read");
-                disconnect_player_now(player);
-                break;
-            }
+        if (packet_cursor.index != packet_cursor.size) {
+            LogInfo("Player protocol packet not fully read");
+            disconnect_player_now(player);
+            break;
         }
 
-        memmove(rec_cursor.data, rec_cursor.data + rec_cursor.index,
-                rec_cursor.size - rec_cursor.index);
-        player->player.rec_cursor = rec_cursor.size - rec_cursor.index;
+        PopPlayerPacket(conn, &packet_cursor);
     }
 
     // @TODO(traks) only here because players could be disconnected and get
@@ -2581,346 +2668,852 @@ static void SendTrackedBlockChanges(entity_base * player, Cursor * sendCursor, M
     }
 }
 
-// @TODO(traks) I wonder if this function should be sending packets to all
-// players at once instead of to only a single player. That would allow us to
-// cache compressed chunk packets, copy packets that get sent to all players,
-// use the CPU cache better, etc.
-void
-send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
-    BeginTimings(SendPackets);
+static void SendTrackedLightChanges(entity_base * player, Cursor * sendCursor, MemoryArena * tickArena) {
+    i32 chunkCacheMinX = player->player.chunkCacheCentreX - player->player.chunkCacheRadius;
+    i32 chunkCacheMaxX = player->player.chunkCacheCentreX + player->player.chunkCacheRadius;
+    i32 chunkCacheMinZ = player->player.chunkCacheCentreZ - player->player.chunkCacheRadius;
+    i32 chunkCacheMaxZ = player->player.chunkCacheCentreZ + player->player.chunkCacheRadius;
+    Chunk * * changedChunks = CallocInArena(tickArena, MAX_CHUNK_CACHE_DIAM * MAX_CHUNK_CACHE_DIAM * sizeof (Chunk *));
+    i32 changedChunkCount = CollectLightChangedChunks(
+            (WorldChunkPos) {.worldId = player->worldId, .x = chunkCacheMinX, .z = chunkCacheMinZ},
+            (WorldChunkPos) {.worldId = player->worldId, .x = chunkCacheMaxX, .z = chunkCacheMaxZ},
+            changedChunks);
 
-    size_t max_uncompressed_packet_size = 1 << 20;
-    Cursor send_cursor_ = {
-        .data = MallocInArena(tick_arena, max_uncompressed_packet_size),
-        .size = max_uncompressed_packet_size
-    };
-    Cursor * send_cursor = &send_cursor_;
+    for (i32 chunkIndex = 0; chunkIndex < changedChunkCount; chunkIndex++) {
+        Chunk * chunk = changedChunks[chunkIndex];
+        PlayerChunkCacheEntry * cacheEntry = player->player.chunkCache + chunk_cache_index(chunk->pos.xz);
 
-    if (!(player->flags & PLAYER_DID_INIT_PACKETS)) {
-        player->flags |= PLAYER_DID_INIT_PACKETS;
+        // NOTE(traks): chunks that haven't been sent yet will be sent with
+        // up-to-date light anyway
+        if (cacheEntry->flags & PLAYER_CHUNK_SENT) {
+            send_light_update(sendCursor, chunk, player);
+        }
+    }
+}
 
-        if (PACKET_COMPRESSION_ENABLED) {
-            // send login compression packet
-            begin_packet(send_cursor, 3);
-            WriteVarU32(send_cursor, 0);
-            finish_packet(send_cursor, player);
+// NOTE(traks): Returns how many chunks we can send to the player this tick.
+// The goal is to keep the send buffers filled with about a round trip's worth
+// of data plus a little extra. Any more and gameplay packets get delayed
+// behind chunks, any less and we don't use the connection's bandwidth.
+static i32 GetChunkSendBudget(entity_base * player) {
+    entity_player * p = &player->player;
+    PlayerLinkStats link = GetPlayerLinkStats(p->connection);
+
+    // NOTE(traks): If data was waiting in the send buffers, the delivery rate
+    // is roughly the bandwidth. Otherwise it's only a lower bound.
+    i64 sampleTicks = serv->current_tick - p->bandwidthSampleTick;
+    if (sampleTicks >= 20) {
+        float sample = (link.deliveredBytes - p->bandwidthSampleDeliveredBytes) * 20.0f / sampleTicks;
+        if (sample > p->bandwidthEstimate) {
+            p->bandwidthEstimate = sample;
+        } else if (link.unsentBytes >= MIN_CHUNK_SEND_TARGET_BYTES) {
+            p->bandwidthEstimate = 0.75f * p->bandwidthEstimate + 0.25f * sample;
+        }
+        p->bandwidthSampleTick = serv->current_tick;
+        p->bandwidthSampleDeliveredBytes = link.deliveredBytes;
+    }
+
+    // NOTE(traks): the keep alive round trip includes time spent waiting in
+    // the send buffers, so prefer TCP's estimate
+    float rttSeconds = link.rttMicros > 0 ? link.rttMicros / 1e6f : MIN(p->keepAliveRttNanos / 1e9f, 1.0f);
+    float targetBytes = MAX(MIN_CHUNK_SEND_TARGET_BYTES, p->bandwidthEstimate * (rttSeconds + CHUNK_SEND_TARGET_DELAY_SECONDS));
+
+    // NOTE(traks): also back off if the network thread hasn't even gotten
+    // around to compressing the packets we gave it earlier
+    if (link.unsentBytes > targetBytes || link.sendStallStreak >= 10
+            || GetQueuedPacketBytes(p->connection) > MAX_QUEUED_PACKET_BYTES_FOR_CHUNKS) {
+        p->chunkSendRate = MAX(0.9f * p->chunkSendRate, MIN_CHUNK_SEND_RATE);
+        p->chunkSendCredit = 0;
+        return 0;
+    }
 
-            player->flags |= PLAYER_PACKET_COMPRESSION;
+    // NOTE(traks): Unused credit carries over to the next tick, so rates below
+    // one chunk per tick work. Carry over at most a tick's worth though, or
+    // a player without missing chunks would save up a burst of chunks for the
+    // next time they cross a chunk border, however slow their connection.
+    p->chunkSendCredit = MIN(p->chunkSendCredit + p->chunkSendRate, MAX(p->chunkSendRate, 1.0f));
+    return p->chunkSendCredit;
+}
+
+static void UpdateChunkSendRate(entity_base * player, i32 budget, i32 sent) {
+    entity_player * p = &player->player;
+    p->chunkSendCredit = MAX(p->chunkSendCredit - sent, 0);
+    // NOTE(traks): only speed up if we actually had chunks to send
+    if (budget > 0 && sent == budget) {
+        p->chunkSendRate = MIN(p->chunkSendRate + CHUNK_SEND_RATE_STEP, MAX_CHUNK_SEND_RATE);
+    }
+}
+
+static struct {
+    float encodeNanosEstimate;
+    i64 tickEncodeNanos;
+    i32 tickEncodes;
+    i32 encodesLeft;
+    i32 firstPlayerIndex;
+    // NOTE(traks): entity index of the player that used the last encode of
+    // the tick's budget, or -1 if the budget didn't run out
+    i32 lastEncodingPlayerIndex;
+} chunkEncodeScheduler = {
+    .encodeNanosEstimate = INITIAL_CHUNK_ENCODE_NANOS,
+    .lastEncodingPlayerIndex = -1,
+};
+
+static float chunkEncodePriorityWeights[PLAYER_PRIORITY_COUNT] = {
+    [PLAYER_PRIORITY_NORMAL] = 1,
+    [PLAYER_PRIORITY_VIP] = 2,
+    [PLAYER_PRIORITY_STAFF] = 4,
+};
+
+// NOTE(traks): Hands out this tick's budget of chunk encodes to the players in
+// proportion to how many chunks they're missing. Players keep a little of the
+// share they couldn't use yet, so even if there are many more players than
+// chunks we can encode, everyone makes progress. Returns the entity index of
+// the player that should be sent packets first. This rotates every tick, and
+// if the budget ran out, the player after the one that got the last encode
+// goes first, so the same players aren't always first in line.
+i32 ScheduleChunkEncodes(void) {
+    if (chunkEncodeScheduler.tickEncodes > 0) {
+        float sample = (float) chunkEncodeScheduler.tickEncodeNanos / chunkEncodeScheduler.tickEncodes;
+        chunkEncodeScheduler.encodeNanosEstimate = 0.875f * chunkEncodeScheduler.encodeNanosEstimate + 0.125f * sample;
+        chunkEncodeScheduler.tickEncodeNanos = 0;
+        chunkEncodeScheduler.tickEncodes = 0;
+    }
+
+    i64 tickEnd = serv->currentTickStartNanos + 50000000LL;
+    i64 timeLeft = tickEnd - CHUNK_ENCODE_TIME_RESERVE_NANOS - NanoTime();
+    float budget = CLAMP(timeLeft / chunkEncodeScheduler.encodeNanosEstimate,
+            MIN_CHUNK_ENCODES_PER_TICK, MAX_CHUNK_ENCODES_PER_TICK);
+    chunkEncodeScheduler.encodesLeft = budget;
+
+    i32 entityCount = ARRAY_SIZE(serv->entities);
+    i32 startIndex;
+    if (chunkEncodeScheduler.lastEncodingPlayerIndex >= 0) {
+        startIndex = chunkEncodeScheduler.lastEncodingPlayerIndex + 1;
+    } else {
+        startIndex = chunkEncodeScheduler.firstPlayerIndex + 1;
+    }
+    chunkEncodeScheduler.lastEncodingPlayerIndex = -1;
+
+    float totalWeight = 0;
+    i32 firstPlayerFound = 0;
+    for (i32 n = 0; n < entityCount; n++) {
+        i32 i = (startIndex + n) % entityCount;
+        entity_base * entity = serv->entities + i;
+        if (entity->type != ENTITY_PLAYER || !(entity->flags & ENTITY_IN_USE)) {
+            continue;
         }
+        if (!firstPlayerFound) {
+            chunkEncodeScheduler.firstPlayerIndex = i;
+            firstPlayerFound = 1;
+        }
+        entity_player * p = &entity->player;
+        totalWeight += p->missingChunkCount * chunkEncodePriorityWeights[p->priorityClass];
+    }
 
-        // send game profile packet
-        begin_packet(send_cursor, 2);
-        // @TODO(traks) send UUID
-        WriteU64(send_cursor, 0);
-        WriteU64(send_cursor, player->eid);
-        String username = {
-            .size = player->player.username_size,
-            .data = player->player.username
-        };
-        WriteVarString(send_cursor, username);
-        WriteVarU32(send_cursor, 0); // no properties for now
-        finish_packet(send_cursor, player);
+    if (totalWeight == 0) {
+        return chunkEncodeScheduler.firstPlayerIndex;
+    }
 
-        String level_name = STR("blaze:main");
+    for (i32 i = 0; i < entityCount; i++) {
+        entity_base * entity = serv->entities + i;
+        if (entity->type != ENTITY_PLAYER || !(entity->flags & ENTITY_IN_USE)) {
+            continue;
+        }
+        entity_player * p = &entity->player;
+        float weight = p->missingChunkCount * chunkEncodePriorityWeights[p->priorityClass];
+        // NOTE(traks): don't let credit pile up for players whose connection
+        // can't keep up, so they don't hog the budget later
+        p->chunkEncodeCredit = MIN(p->chunkEncodeCredit, MAX_CHUNK_ENCODE_CREDIT_CARRY)
+                + budget * weight / totalWeight;
+    }
+    return chunkEncodeScheduler.firstPlayerIndex;
+}
 
-        begin_packet(send_cursor, CBP_LOGIN);
-        WriteU32(send_cursor, player->eid);
-        WriteU8(send_cursor, 0); // hardcore
-        WriteU8(send_cursor, player->player.gamemode); // current gamemode
-        WriteU8(send_cursor, 255); // previous gamemode, -1 = none
-
-        // all levels/worlds currently available on the server
-        // @NOTE(traks) This list is used for tab completions
-        WriteVarU32(send_cursor, 1); // number of levels
-        WriteVarString(send_cursor, level_name);
-
-        // send all synchronised registries
-        Cursor nbtCursor = *send_cursor;
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR(""));
+static void WriteLoginPacketHead(Cursor * send_cursor, entity_base * player) {
+    String level_name = STR("blaze:main");
 
-        // write dimension types
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:dimension_type"));
-        {
-            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
-            nbt_write_string(send_cursor, STR("minecraft:dimension_type"));
-
-            nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
-            WriteU8(send_cursor, NBT_TAG_COMPOUND);
-            WriteU32(send_cursor, serv->dimension_type_count);
-            for (int i = 0; i < serv->dimension_type_count; i++) {
-                dimension_type * dim_type = serv->dimension_types + i;
-
-                nbt_write_key(send_cursor, NBT_TAG_STRING, STR("name"));
-                String name = {
-                    .data = dim_type->name,
-                    .size = dim_type->name_size
-                };
-                nbt_write_string(send_cursor, name);
+    WriteU32(send_cursor, player->eid);
+    WriteU8(send_cursor, 0); // hardcore
+    WriteU8(send_cursor, player->player.gamemode); // current gamemode
+    WriteU8(send_cursor, 255); // previous gamemode, -1 = none
 
-                nbt_write_key(send_cursor, NBT_TAG_INT, STR("id"));
-                WriteU32(send_cursor, i);
+    // all levels/worlds currently available on the server
+    // @NOTE(traks) This list is used for tab completions
+    WriteVarU32(send_cursor, 1); // number of levels
+    WriteVarString(send_cursor, level_name);
+}
 
-                nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("element"));
-                {
-                    nbt_write_dimension_type(send_cursor, dim_type);
-                }
-                WriteU8(send_cursor, NBT_TAG_END);
+static void WriteRegistries(Cursor * send_cursor) {
+    // send all synchronised registries
+    Cursor nbtCursor = *send_cursor;
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR(""));
 
-                WriteU8(send_cursor, NBT_TAG_END);
+    // write dimension types
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:dimension_type"));
+    {
+        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
+        nbt_write_string(send_cursor, STR("minecraft:dimension_type"));
+
+        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
+        WriteU8(send_cursor, NBT_TAG_COMPOUND);
+        WriteU32(send_cursor, serv->dimension_type_count);
+        for (int i = 0; i < serv->dimension_type_count; i++) {
+            dimension_type * dim_type = serv->dimension_types + i;
+
+            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("name"));
+            String name = {
+                .data = dim_type->name,
+                .size = dim_type->name_size
+            };
+            nbt_write_string(send_cursor, name);
+
+            nbt_write_key(send_cursor, NBT_TAG_INT, STR("id"));
+            WriteU32(send_cursor, i);
+
+            nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("element"));
+            {
+                nbt_write_dimension_type(send_cursor, dim_type);
             }
+            WriteU8(send_cursor, NBT_TAG_END);
+
+            WriteU8(send_cursor, NBT_TAG_END);
         }
-        WriteU8(send_cursor, NBT_TAG_END);
+    }
+    WriteU8(send_cursor, NBT_TAG_END);
 
-        // write biomes
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:worldgen/biome"));
-        {
-            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
-            nbt_write_string(send_cursor, STR("minecraft:worldgen/biome"));
-
-            nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
-            WriteU8(send_cursor, NBT_TAG_COMPOUND);
-            WriteU32(send_cursor, serv->biome_count);
-            for (int i = 0; i < serv->biome_count; i++) {
-                biome * b = serv->biomes + i;
-
-                nbt_write_key(send_cursor, NBT_TAG_STRING, STR("name"));
-                String name = {
-                    .data = b->name,
-                    .size = b->name_size
-                };
-                nbt_write_string(send_cursor, name);
+    // write biomes
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:worldgen/biome"));
+    {
+        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
+        nbt_write_string(send_cursor, STR("minecraft:worldgen/biome"));
 
-                nbt_write_key(send_cursor, NBT_TAG_INT, STR("id"));
-                WriteU32(send_cursor, i);
+        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
+        WriteU8(send_cursor, NBT_TAG_COMPOUND);
+        WriteU32(send_cursor, serv->biome_count);
+        for (int i = 0; i < serv->biome_count; i++) {
+            biome * b = serv->biomes + i;
 
-                nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("element"));
-                {
-                    nbt_write_biome(send_cursor, b);
-                }
-                WriteU8(send_cursor, NBT_TAG_END);
+            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("name"));
+            String name = {
+                .data = b->name,
+                .size = b->name_size
+            };
+            nbt_write_string(send_cursor, name);
 
-                WriteU8(send_cursor, NBT_TAG_END);
+            nbt_write_key(send_cursor, NBT_TAG_INT, STR("id"));
+            WriteU32(send_cursor, i);
+
+            nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("element"));
+            {
+                nbt_write_biome(send_cursor, b);
             }
+            WriteU8(send_cursor, NBT_TAG_END);
+
+            WriteU8(send_cursor, NBT_TAG_END);
         }
-        WriteU8(send_cursor, NBT_TAG_END);
+    }
+    WriteU8(send_cursor, NBT_TAG_END);
 
-        // write chat types
-        // TODO(traks): make this whole chat type business neater...
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:chat_type"));
-        {
-            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
-            nbt_write_string(send_cursor, STR("minecraft:chat_type"));
+    // write chat types
+    // TODO(traks): make this whole chat type business neater...
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:chat_type"));
+    {
+        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
+        nbt_write_string(send_cursor, STR("minecraft:chat_type"));
 
-            nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
-            WriteU8(send_cursor, NBT_TAG_COMPOUND);
-            WriteU32(send_cursor, 1);
+        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
+        WriteU8(send_cursor, NBT_TAG_COMPOUND);
+        WriteU32(send_cursor, 1);
 
-            // chat
+        // chat
+        {
+            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("name"));
+            nbt_write_string(send_cursor, STR("minecraft:chat"));
+            nbt_write_key(send_cursor, NBT_TAG_INT, STR("id"));
+            WriteU32(send_cursor, 0);
+            nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("element"));
             {
-                nbt_write_key(send_cursor, NBT_TAG_STRING, STR("name"));
-                nbt_write_string(send_cursor, STR("minecraft:chat"));
-                nbt_write_key(send_cursor, NBT_TAG_INT, STR("id"));
-                WriteU32(send_cursor, 0);
-                nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("element"));
+                nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("chat"));
                 {
-                    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("chat"));
-                    {
-                        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("translation_key"));
-                        nbt_write_string(send_cursor, STR("chat.type.text"));
-
-                        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("parameters"));
-                        WriteU8(send_cursor, NBT_TAG_STRING);
-                        WriteU32(send_cursor, 2);
-                        nbt_write_string(send_cursor, STR("sender"));
-                        nbt_write_string(send_cursor, STR("content"));
-                    }
-                    WriteU8(send_cursor, NBT_TAG_END);
-
-                    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("narration"));
-                    {
-                        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("translation_key"));
-                        nbt_write_string(send_cursor, STR("chat.type.text.narrate"));
-
-                        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("parameters"));
-                        WriteU8(send_cursor, NBT_TAG_STRING);
-                        WriteU32(send_cursor, 2);
-                        nbt_write_string(send_cursor, STR("sender"));
-                        nbt_write_string(send_cursor, STR("content"));
-                    }
-                    WriteU8(send_cursor, NBT_TAG_END);
+                    nbt_write_key(send_cursor, NBT_TAG_STRING, STR("translation_key"));
+                    nbt_write_string(send_cursor, STR("chat.type.text"));
+
+                    nbt_write_key(send_cursor, NBT_TAG_LIST, STR("parameters"));
+                    WriteU8(send_cursor, NBT_TAG_STRING);
+                    WriteU32(send_cursor, 2);
+                    nbt_write_string(send_cursor, STR("sender"));
+                    nbt_write_string(send_cursor, STR("content"));
+                }
+                WriteU8(send_cursor, NBT_TAG_END);
+
+                nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("narration"));
+                {
+                    nbt_write_key(send_cursor, NBT_TAG_STRING, STR("translation_key"));
+                    nbt_write_string(send_cursor, STR("chat.type.text.narrate"));
+
+                    nbt_write_key(send_cursor, NBT_TAG_LIST, STR("parameters"));
+                    WriteU8(send_cursor, NBT_TAG_STRING);
+                    WriteU32(send_cursor, 2);
+                    nbt_write_string(send_cursor, STR("sender"));
+                    nbt_write_string(send_cursor, STR("content"));
                 }
                 WriteU8(send_cursor, NBT_TAG_END);
             }
             WriteU8(send_cursor, NBT_TAG_END);
         }
         WriteU8(send_cursor, NBT_TAG_END);
+    }
+    WriteU8(send_cursor, NBT_TAG_END);
 
-        // write trim materials
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:trim_material"));
-        {
-            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
-            nbt_write_string(send_cursor, STR("minecraft:trim_material"));
+    // write trim materials
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:trim_material"));
+    {
+        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
+        nbt_write_string(send_cursor, STR("minecraft:trim_material"));
 
-            nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
-            WriteU8(send_cursor, NBT_TAG_COMPOUND);
-            WriteU32(send_cursor, 0);
-        }
-        WriteU8(send_cursor, NBT_TAG_END);
+        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
+        WriteU8(send_cursor, NBT_TAG_COMPOUND);
+        WriteU32(send_cursor, 0);
+    }
+    WriteU8(send_cursor, NBT_TAG_END);
 
-        // write trim patterns
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:trim_pattern"));
-        {
-            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
-            nbt_write_string(send_cursor, STR("minecraft:trim_pattern"));
+    // write trim patterns
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:trim_pattern"));
+    {
+        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
+        nbt_write_string(send_cursor, STR("minecraft:trim_pattern"));
 
-            nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
-            WriteU8(send_cursor, NBT_TAG_COMPOUND);
-            WriteU32(send_cursor, 0);
-        }
-        WriteU8(send_cursor, NBT_TAG_END);
+        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
+        WriteU8(send_cursor, NBT_TAG_COMPOUND);
+        WriteU32(send_cursor, 0);
+    }
+    WriteU8(send_cursor, NBT_TAG_END);
 
-        // write damage types
-        // NOTE(traks): Currently (1.19.4), we must send ALL vanilla damage
-        // types to the client. Otherwise it'll throw internally and it'll be
-        // stuck on the login screen. The client doesn't disconnect, and no
-        // error message pops up on the screen.
-        nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:damage_type"));
-        {
-            nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
-            nbt_write_string(send_cursor, STR("minecraft:damage_type"));
-
-            nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
-            WriteU8(send_cursor, NBT_TAG_COMPOUND);
-            WriteU32(send_cursor, 42);
-
-            // TODO(traks): these IDs don't seem to be the same as vanilla. Does
-            // that matter? I wouldn't think so
-            NbtWriteDamageType(send_cursor, 0, "minecraft:in_fire", "inFire", 0.1f);
-            NbtWriteDamageType(send_cursor, 1, "minecraft:lightning_bolt", "lightningBolt", 0.1f);
-            NbtWriteDamageType(send_cursor, 2, "minecraft:on_fire", "onFire", 0.0f);
-            NbtWriteDamageType(send_cursor, 3, "minecraft:lava", "lava", 0.1f);
-            NbtWriteDamageType(send_cursor, 4, "minecraft:hot_floor", "hotFloor", 0.1f);
-            NbtWriteDamageType(send_cursor, 5, "minecraft:in_wall", "inWall", 0.0f);
-            NbtWriteDamageType(send_cursor, 6, "minecraft:cramming", "cramming", 0.0f);
-            NbtWriteDamageType(send_cursor, 7, "minecraft:drown", "drown", 0.0f);
-            NbtWriteDamageType(send_cursor, 8, "minecraft:starve", "starve", 0.0f);
-            NbtWriteDamageType(send_cursor, 9, "minecraft:cactus", "cactus", 0.1f);
-            NbtWriteDamageType(send_cursor, 10, "minecraft:fall", "fall", 0.0f);
-            NbtWriteDamageType(send_cursor, 11, "minecraft:fly_into_wall", "flyIntoWall", 0.0f);
-            NbtWriteDamageType(send_cursor, 12, "minecraft:out_of_world", "outOfWorld", 0.0f);
-            NbtWriteDamageType(send_cursor, 13, "minecraft:generic", "generic", 0.0f);
-            NbtWriteDamageType(send_cursor, 14, "minecraft:magic", "magic", 0.0f);
-            NbtWriteDamageType(send_cursor, 15, "minecraft:wither", "wither", 0.0f);
-            NbtWriteDamageType(send_cursor, 16, "minecraft:dragon_breath", "dragonBreath", 0.0f);
-            NbtWriteDamageType(send_cursor, 17, "minecraft:dry_out", "dryout", 0.1f);
-            NbtWriteDamageType(send_cursor, 18, "minecraft:sweet_berry_bush", "sweetBerryBush", 0.1f);
-            NbtWriteDamageType(send_cursor, 19, "minecraft:freeze", "freeze", 0.0f);
-            NbtWriteDamageType(send_cursor, 20, "minecraft:stalagmite", "stalagmite", 0.0f);
-            NbtWriteDamageType(send_cursor, 21, "minecraft:falling_block", "fallingBlock", 0.1f);
-            NbtWriteDamageType(send_cursor, 22, "minecraft:falling_anvil", "anvil", 0.1f);
-            NbtWriteDamageType(send_cursor, 23, "minecraft:falling_stalactite", "fallingStalactite", 0.1f);
-            NbtWriteDamageType(send_cursor, 24, "minecraft:sting", "sting", 0.1f);
-            NbtWriteDamageType(send_cursor, 25, "minecraft:mob_attack", "mob", 0.1f);
-            NbtWriteDamageType(send_cursor, 26, "minecraft:mob_attack_no_aggro", "mob", 0.1f);
-            NbtWriteDamageType(send_cursor, 27, "minecraft:player_attack", "player", 0.1f);
-            NbtWriteDamageType(send_cursor, 28, "minecraft:arrow", "arrow", 0.1f);
-            NbtWriteDamageType(send_cursor, 29, "minecraft:trident", "trident", 0.1f);
-            NbtWriteDamageType(send_cursor, 30, "minecraft:mob_projectile", "mob", 0.1f);
-            NbtWriteDamageType(send_cursor, 31, "minecraft:fireworks", "fireworks", 0.1f);
-            NbtWriteDamageType(send_cursor, 32, "minecraft:fireball", "onFire", 0.1f);
-            NbtWriteDamageType(send_cursor, 33, "minecraft:unattributed_fireball", "fireball", 0.1f);
-            NbtWriteDamageType(send_cursor, 34, "minecraft:wither_skull", "witherSkull", 0.1f);
-            NbtWriteDamageType(send_cursor, 35, "minecraft:thrown", "thrown", 0.1f);
-            NbtWriteDamageType(send_cursor, 36, "minecraft:indirect_magic", "indirectMagic", 0.0f);
-            NbtWriteDamageType(send_cursor, 37, "minecraft:thorns", "thorns", 0.1f);
-            NbtWriteDamageTypeWithScaling(send_cursor, 38, "minecraft:explosion", "explosion", 0.1f, "always");
-            NbtWriteDamageTypeWithScaling(send_cursor, 39, "minecraft:player_explosion", "explosion.player", 0.1f, "always");
-            NbtWriteDamageTypeWithScaling(send_cursor, 40, "minecraft:sonic_boom", "sonic_boom", 0.0f, "always");
-            NbtWriteDamageTypeWithScaling(send_cursor, 41, "minecraft:bad_respawn_point", "badRespawnPoint", 0.1f, "always");
-        }
-        WriteU8(send_cursor, NBT_TAG_END);
+    // write damage types
+    // NOTE(traks): Currently (1.19.4), we must send ALL vanilla damage
+    // types to the client. Otherwise it'll throw internally and it'll be
+    // stuck on the login screen. The client doesn't disconnect, and no
+    // error message pops up on the screen.
+    nbt_write_key(send_cursor, NBT_TAG_COMPOUND, STR("minecraft:damage_type"));
+    {
+        nbt_write_key(send_cursor, NBT_TAG_STRING, STR("type"));
+        nbt_write_string(send_cursor, STR("minecraft:damage_type"));
+
+        nbt_write_key(send_cursor, NBT_TAG_LIST, STR("value"));
+        WriteU8(send_cursor, NBT_TAG_COMPOUND);
+        WriteU32(send_cursor, 42);
+
+        // TODO(traks): these IDs don't seem to be the same as vanilla. Does
+        // that matter? I wouldn't think so
+        NbtWriteDamageType(send_cursor, 0, "minecraft:in_fire", "inFire", 0.1f);
+        NbtWriteDamageType(send_cursor, 1, "minecraft:lightning_bolt", "lightningBolt", 0.1f);
+        NbtWriteDamageType(send_cursor, 2, "minecraft:on_fire", "onFire", 0.0f);
+        NbtWriteDamageType(send_cursor, 3, "minecraft:lava", "lava", 0.1f);
+        NbtWriteDamageType(send_cursor, 4, "minecraft:hot_floor", "hotFloor", 0.1f);
+        NbtWriteDamageType(send_cursor, 5, "minecraft:in_wall", "inWall", 0.0f);
+        NbtWriteDamageType(send_cursor, 6, "minecraft:cramming", "cramming", 0.0f);
+        NbtWriteDamageType(send_cursor, 7, "minecraft:drown", "drown", 0.0f);
+        NbtWriteDamageType(send_cursor, 8, "minecraft:starve", "starve", 0.0f);
+        NbtWriteDamageType(send_cursor, 9, "minecraft:cactus", "cactus", 0.1f);
+        NbtWriteDamageType(send_cursor, 10, "minecraft:fall", "fall", 0.0f);
+        NbtWriteDamageType(send_cursor, 11, "minecraft:fly_into_wall", "flyIntoWall", 0.0f);
+        NbtWriteDamageType(send_cursor, 12, "minecraft:out_of_world", "outOfWorld", 0.0f);
+        NbtWriteDamageType(send_cursor, 13, "minecraft:generic", "generic", 0.0f);
+        NbtWriteDamageType(send_cursor, 14, "minecraft:magic", "magic", 0.0f);
+        NbtWriteDamageType(send_cursor, 15, "minecraft:wither", "wither", 0.0f);
+        NbtWriteDamageType(send_cursor, 16, "minecraft:dragon_breath", "dragonBreath", 0.0f);
+        NbtWriteDamageType(send_cursor, 17, "minecraft:dry_out", "dryout", 0.1f);
+        NbtWriteDamageType(send_cursor, 18, "minecraft:sweet_berry_bush", "sweetBerryBush", 0.1f);
+        NbtWriteDamageType(send_cursor, 19, "minecraft:freeze", "freeze", 0.0f);
+        NbtWriteDamageType(send_cursor, 20, "minecraft:stalagmite", "stalagmite", 0.0f);
+        NbtWriteDamageType(send_cursor, 21, "minecraft:falling_block", "fallingBlock", 0.1f);
+        NbtWriteDamageType(send_cursor, 22, "minecraft:falling_anvil", "anvil", 0.1f);
+        NbtWriteDamageType(send_cursor, 23, "minecraft:falling_stalactite", "fallingStalactite", 0.1f);
+        NbtWriteDamageType(send_cursor, 24, "minecraft:sting", "sting", 0.1f);
+        NbtWriteDamageType(send_cursor, 25, "minecraft:mob_attack", "mob", 0.1f);
+        NbtWriteDamageType(send_cursor, 26, "minecraft:mob_attack_no_aggro", "mob", 0.1f);
+        NbtWriteDamageType(send_cursor, 27, "minecraft:player_attack", "player", 0.1f);
+        NbtWriteDamageType(send_cursor, 28, "minecraft:arrow", "arrow", 0.1f);
+        NbtWriteDamageType(send_cursor, 29, "minecraft:trident", "trident", 0.1f);
+        NbtWriteDamageType(send_cursor, 30, "minecraft:mob_projectile", "mob", 0.1f);
+        NbtWriteDamageType(send_cursor, 31, "minecraft:fireworks", "fireworks", 0.1f);
+        NbtWriteDamageType(send_cursor, 32, "minecraft:fireball", "onFire", 0.1f);
+        NbtWriteDamageType(send_cursor, 33, "minecraft:unattributed_fireball", "fireball", 0.1f);
+        NbtWriteDamageType(send_cursor, 34, "minecraft:wither_skull", "witherSkull", 0.1f);
+        NbtWriteDamageType(send_cursor, 35, "minecraft:thrown", "thrown", 0.1f);
+        NbtWriteDamageType(send_cursor, 36, "minecraft:indirect_magic", "indirectMagic", 0.0f);
+        NbtWriteDamageType(send_cursor, 37, "minecraft:thorns", "thorns", 0.1f);
+        NbtWriteDamageTypeWithScaling(send_cursor, 38, "minecraft:explosion", "explosion", 0.1f, "always");
+        NbtWriteDamageTypeWithScaling(send_cursor, 39, "minecraft:player_explosion", "explosion.player", 0.1f, "always");
+        NbtWriteDamageTypeWithScaling(send_cursor, 40, "minecraft:sonic_boom", "sonic_boom", 0.0f, "always");
+        NbtWriteDamageTypeWithScaling(send_cursor, 41, "minecraft:bad_respawn_point", "badRespawnPoint", 0.1f, "always");
+    }
+    WriteU8(send_cursor, NBT_TAG_END);
+
+    WriteU8(send_cursor, NBT_TAG_END); // end of registries
+
+    nbtCursor.size = send_cursor->size;
+    // NOTE(traks): for debugging purposes
+    // NbtCompound nbtCompound = NbtRead(&nbtCursor, serv->tickArena);
+    // NbtPrint(&nbtCompound);
+}
+
+static void WriteLoginPacketTail(Cursor * send_cursor, entity_base * player) {
+    String level_name = STR("blaze:main");
 
-        WriteU8(send_cursor, NBT_TAG_END); // end of registries
+    // dimension type of level player is joining
+    String dimTypeName = {
+        .data = serv->dimension_types[0].name,
+        .size = serv->dimension_types[0].name_size
+    };
+    WriteVarString(send_cursor, dimTypeName);
+
+    // level name the player is joining
+    WriteVarString(send_cursor, level_name);
+
+    WriteU64(send_cursor, 0); // hashed seed
+    WriteVarU32(send_cursor, 0); // max players (ignored by client)
+    WriteVarU32(send_cursor, player->player.nextChunkCacheRadius - 1); // chunk radius
+    // @TODO(traks) figure out why the client needs to know the simulation
+    // distance and what it uses it for
+    WriteVarU32(send_cursor, player->player.nextChunkCacheRadius - 1); // simulation distance
+    WriteU8(send_cursor, 0); // reduced debug info
+    WriteU8(send_cursor, 1); // show death screen on death
+    WriteU8(send_cursor, 0); // is debug
+    WriteU8(send_cursor, 0); // is flat
+    WriteU8(send_cursor, 0); // has death location, world + block pos after if true
+}
 
-        nbtCursor.size = send_cursor->size;
-        // NOTE(traks): for debugging purposes
-        // NbtCompound nbtCompound = NbtRead(&nbtCursor, tick_arena);
-        // NbtPrint(&nbtCompound);
+static void WriteTags(Cursor * send_cursor) {
+    tag_list * tag_lists[] = {
+        &serv->block_tags,
+        &serv->item_tags,
+        &serv->fluid_tags,
+        &serv->entity_tags,
+        &serv->game_event_tags,
+    };
 
-        // dimension type of level player is joining
-        String dimTypeName = {
-            .data = serv->dimension_types[0].name,
-            .size = serv->dimension_types[0].name_size
+    WriteVarU32(send_cursor, ARRAY_SIZE(tag_lists));
+    for (int tagsi = 0; tagsi < (i32) ARRAY_SIZE(tag_lists); tagsi++) {
+        tag_list * tags = tag_lists[tagsi];
+
+        String name = {
+            .size = tags->name_size,
+            .data = tags->name
         };
-        WriteVarString(send_cursor, dimTypeName);
-
-        // level name the player is joining
-        WriteVarString(send_cursor, level_name);
-
-        WriteU64(send_cursor, 0); // hashed seed
-        WriteVarU32(send_cursor, 0); // max players (ignored by client)
-        WriteVarU32(send_cursor, player->player.nextChunkCacheRadius - 1); // chunk radius
-        // @TODO(traks) figure out why the client needs to know the simulation
-        // distance and what it uses it for
-        WriteVarU32(send_cursor, player->player.nextChunkCacheRadius - 1); // simulation distance
-        WriteU8(send_cursor, 0); // reduced debug info
-        WriteU8(send_cursor, 1); // show death screen on death
-        WriteU8(send_cursor, 0); // is debug
-        WriteU8(send_cursor, 0); // is flat
-        WriteU8(send_cursor, 0); // has death location, world + block pos after if true
-        finish_packet(send_cursor, player);
 
-        begin_packet(send_cursor, CBP_UPDATE_ENABLE_FEATURES);
-        WriteVarU32(send_cursor, 1);
-        WriteVarString(send_cursor, STR("minecraft:vanilla"));
-        finish_packet(send_cursor, player);
+        WriteVarString(send_cursor, name);
+        WriteVarU32(send_cursor, tags->size);
 
-        begin_packet(send_cursor, CBP_SET_CARRIED_ITEM);
-        WriteU8(send_cursor,
-                player->player.selected_slot - PLAYER_FIRST_HOTBAR_SLOT);
+        for (int i = 0; i < tags->size; i++) {
+            tag_spec * tag = tags->tags + i;
+            unsigned char * name_size = serv->tag_name_buf + tag->name_index;
+            String tag_name = {
+                .size = *name_size,
+                .data = name_size + 1
+            };
+
+            WriteVarString(send_cursor, tag_name);
+            WriteVarU32(send_cursor, tag->value_count);
+
+            for (int vali = 0; vali < tag->value_count; vali++) {
+                i32 val = serv->tag_value_id_buf[tag->values_index + vali];
+                WriteVarU32(send_cursor, val);
+            }
+        }
+    }
+}
+
+// NOTE(traks): Parts of the join packets that are the same for all players,
+// built once at startup. The registries are compressed once and spliced into
+// each login packet, since the fields around them differ per player.
+static struct {
+    u8 * registries;
+    i32 registriesSize;
+    CompressedFragment compressedRegistries;
+    // NOTE(traks): tags packet without the packet ID
+    u8 * tags;
+    i32 tagsSize;
+    BroadcastPacket * compressedTags;
+} joinPackets;
+
+static u8 * CopyJoinPacketData(Cursor * cursor) {
+    if (cursor->error != 0) {
+        LogInfo("Failed to build join packets");
+        exit(1);
+    }
+    u8 * res = MallocInArena(serv->permanentArena, cursor->index);
+    if (res == NULL) {
+        LogInfo("Failed to allocate join packets");
+        exit(1);
+    }
+    memcpy(res, cursor->data, cursor->index);
+    return res;
+}
+
+void InitJoinPackets(void) {
+    MemoryArena scratchArena = {
+        .data = serv->short_lived_scratch,
+        .size = serv->short_lived_scratch_size
+    };
+    i32 maxSize = 1 << 20;
+    Cursor cursor = {
+        .data = MallocInArena(&scratchArena, maxSize),
+        .size = maxSize
+    };
+
+    WriteRegistries(&cursor);
+    joinPackets.registries = CopyJoinPacketData(&cursor);
+    joinPackets.registriesSize = cursor.index;
+    joinPackets.compressedRegistries = CompressFragment(joinPackets.registries, joinPackets.registriesSize);
+
+    cursor.index = 0;
+    WriteTags(&cursor);
+    joinPackets.tags = CopyJoinPacketData(&cursor);
+    joinPackets.tagsSize = cursor.index;
+
+    cursor.index = 0;
+    begin_packet(&cursor, CBP_UPDATE_TAGS);
+    WriteData(&cursor, joinPackets.tags, joinPackets.tagsSize);
+    finish_packet_as(&cursor, 1);
+    if (cursor.error == 0) {
+        joinPackets.compressedTags = CreateBroadcastPacket(cursor.data, cursor.index);
+    }
+
+    LogInfo("Join packets: registries %dKB (%dKB compressed), tags %dKB",
+            (int) (joinPackets.registriesSize / 1024),
+            (int) (joinPackets.compressedRegistries.size / 1024),
+            (int) (joinPackets.tagsSize / 1024));
+}
+
+static void SendLoginPacket(Cursor * send_cursor, entity_base * player) {
+    if ((player->flags & PLAYER_PACKET_COMPRESSION) && joinPackets.compressedRegistries.data != NULL) {
+        u8 headData[256];
+        u8 tailData[256];
+        Cursor head = {.data = headData, .size = sizeof headData};
+        Cursor tail = {.data = tailData, .size = sizeof tailData};
+        WriteVarU32(&head, CBP_LOGIN);
+        WriteLoginPacketHead(&head, player);
+        WriteLoginPacketTail(&tail, player);
+        if (head.error != 0 || tail.error != 0) {
+            send_cursor->error = 1;
+            return;
+        }
+        WriteSplicedPacket(send_cursor, head.data, head.index, &joinPackets.compressedRegistries, tail.data, tail.index);
+    } else {
+        begin_packet(send_cursor, CBP_LOGIN);
+        WriteLoginPacketHead(send_cursor, player);
+        WriteData(send_cursor, joinPackets.registries, joinPackets.registriesSize);
+        WriteLoginPacketTail(send_cursor, player);
         finish_packet(send_cursor, player);
+    }
+}
 
+static void SendTagsPacket(Cursor * send_cursor, entity_base * player) {
+    if ((player->flags & PLAYER_PACKET_COMPRESSION) && joinPackets.compressedTags != NULL) {
+        WriteBroadcastPacketRecord(send_cursor, joinPackets.compressedTags);
+    } else {
         begin_packet(send_cursor, CBP_UPDATE_TAGS);
+        WriteData(send_cursor, joinPackets.tags, joinPackets.tagsSize);
+        finish_packet(send_cursor, player);
+    }
+}
 
-        tag_list * tag_lists[] = {
-            &serv->block_tags,
-            &serv->item_tags,
-            &serv->fluid_tags,
-            &serv->entity_tags,
-            &serv->game_event_tags,
-        };
-
-        WriteVarU32(send_cursor, ARRAY_SIZE(tag_lists));
-        for (int tagsi = 0; tagsi < (i32) ARRAY_SIZE(tag_lists); tagsi++) {
-            tag_list * tags = tag_lists[tagsi];
+static void WriteFullTabList(Cursor * send_cursor, i32 compression) {
+    if (serv->tab_list_size > 0) {
+        begin_packet(send_cursor, CBP_PLAYER_INFO_UPDATE);
+        u8 actionBits = 0b111111; // everything
+        WriteU8(send_cursor, actionBits);
+        WriteVarU32(send_cursor, serv->tab_list_size);
+
+        for (int i = 0; i < serv->tab_list_size; i++) {
+            entity_id eid = serv->tab_list[i];
+            entity_base * tabListPlayer = resolve_entity(eid);
+            // TODO(traks): If a player disconnects mid tick (e.g. due to a
+            // networking error), this assert can fail, because the player
+            // entity will be gone. Fix this. For example by storing all
+            // required data in the tab list array, so we don't need to
+            // resolve entities.
+            // assert(tabListPlayer->type == ENTITY_PLAYER);
+            // @TODO(traks) write UUID
+            WriteU64(send_cursor, 0);
+            WriteU64(send_cursor, eid);
+            String username = {
+                .data = tabListPlayer->player.username,
+                .size = tabListPlayer->player.username_size
+            };
+            WriteVarString(send_cursor, username);
+            WriteVarU32(send_cursor, 0); // num properties
+            WriteU8(send_cursor, 0); // has message signing key
+            WriteVarU32(send_cursor, tabListPlayer->player.gamemode);
+            WriteU8(send_cursor, 1); // listed
+            WriteVarU32(send_cursor, 0); // latency
+            WriteU8(send_cursor, 0); // has display name
+        }
+        finish_packet_as(send_cursor, compression);
+    }
+}
 
-            String name = {
-                .size = tags->name_size,
-                .data = tags->name
+static void WriteTabListChanges(Cursor * send_cursor, i32 compression) {
+    if (serv->tab_list_removed_count > 0) {
+        begin_packet(send_cursor, CBP_PLAYER_INFO_REMOVE);
+        WriteVarU32(send_cursor, serv->tab_list_removed_count);
+
+        for (int i = 0; i < serv->tab_list_removed_count; i++) {
+            entity_id eid = serv->tab_list_removed[i];
+            // @TODO(traks) write UUID
+            WriteU64(send_cursor, 0);
+            WriteU64(send_cursor, eid);
+        }
+        finish_packet_as(send_cursor, compression);
+    }
+    if (serv->tab_list_added_count > 0) {
+        begin_packet(send_cursor, CBP_PLAYER_INFO_UPDATE);
+
+        // NOTE(traks): actions:
+        // 0 = add player
+        // 1 = init chat
+        // 2 = update game mode
+        // 3 = update listed
+        // 4 = update latency
+        // 5 = update display name
+
+        // TODO(traks): init chat?
+
+        u8 actionBits = 0b111111; // everything
+        WriteU8(send_cursor, actionBits);
+        WriteVarU32(send_cursor, serv->tab_list_added_count);
+
+        for (int i = 0; i < serv->tab_list_added_count; i++) {
+            entity_id eid = serv->tab_list_added[i];
+            entity_base * tabListPlayer = resolve_entity(eid);
+            // TODO(traks): If a player disconnects mid tick (e.g. due to a
+            // networking error), this assert can fail, because the player
+            // entity will be gone. Fix this. For example by storing all
+            // required data in the tab list array, so we don't need to
+            // resolve entities.
+            // assert(tabListPlayer->type == ENTITY_PLAYER);
+            // @TODO(traks) write UUID
+            WriteU64(send_cursor, 0);
+            WriteU64(send_cursor, eid);
+
+            // NOTE(traks): after the UUID, write all the data of the player
+            // per action, in order
+
+            String username = {
+                .data = tabListPlayer->player.username,
+                .size = tabListPlayer->player.username_size
             };
+            WriteVarString(send_cursor, username);
+            WriteVarU32(send_cursor, 0); // num properties
+            WriteU8(send_cursor, 0); // has message signing key
+            WriteVarU32(send_cursor, tabListPlayer->player.gamemode);
+            WriteU8(send_cursor, 1); // listed
+            WriteVarU32(send_cursor, 0); // latency
+            WriteU8(send_cursor, 0); // has display name
+        }
+        finish_packet_as(send_cursor, compression);
+    }
 
-            WriteVarString(send_cursor, name);
-            WriteVarU32(send_cursor, tags->size);
+    for (int i = 0; i < MAX_ENTITIES; i++) {
+        entity_base * entity = serv->entities + i;
+        if (!(entity->flags & ENTITY_IN_USE)) {
+            continue;
+        }
+        if (entity->type != ENTITY_PLAYER) {
+            continue;
+        }
 
-            for (int i = 0; i < tags->size; i++) {
-                tag_spec * tag = tags->tags + i;
-                unsigned char * name_size = serv->tag_name_buf + tag->name_index;
-                String tag_name = {
-                    .size = *name_size,
-                    .data = name_size + 1
-                };
+        if (entity->changed_data & PLAYER_GAMEMODE_CHANGED) {
+            begin_packet(send_cursor, CBP_PLAYER_INFO_UPDATE);
+            WriteVarU32(send_cursor, 0b000100); // action: update gamemode
+            WriteVarU32(send_cursor, 1); // changed entries
+            // @TODO(traks) write uuid
+            WriteU64(send_cursor, 0);
+            WriteU64(send_cursor, entity->eid);
+            WriteVarU32(send_cursor, entity->player.gamemode);
+            finish_packet_as(send_cursor, compression);
+        }
+    }
+}
 
-                WriteVarString(send_cursor, tag_name);
-                WriteVarU32(send_cursor, tag->value_count);
+static void WriteChatMessages(Cursor * send_cursor, i32 compression) {
+    for (int msgIndex = 0; msgIndex < serv->global_msg_count; msgIndex++) {
+        global_msg * msg = serv->global_msgs + msgIndex;
 
-                for (int vali = 0; vali < tag->value_count; vali++) {
-                    i32 val = serv->tag_value_id_buf[tag->values_index + vali];
-                    WriteVarU32(send_cursor, val);
-                }
+        // @TODO(traks) formatted messages and such
+        unsigned char buf[1024];
+        int buf_index = 0;
+        String prefix = STR("{\"text\":\"");
+        String suffix = STR("\"}");
+
+        memcpy(buf + buf_index, prefix.data, prefix.size);
+        buf_index += prefix.size;
+
+        for (int i = 0; i < msg->size; i++) {
+            if (msg->text[i] == '"' || msg->text[i] == '\\') {
+                buf[buf_index] = '\\';
+                buf_index++;
             }
+            buf[buf_index] = msg->text[i];
+            buf_index++;
         }
+
+        memcpy(buf + buf_index, suffix.data, suffix.size);
+        buf_index += suffix.size;
+
+        String jsonMessage = {
+            .size = buf_index,
+            .data = buf,
+        };
+
+        // TODO(traks): use player chat packet for this with annoying signing.
+        // Also will make chat narration work properly as "sender says message"
+        // (see the chat types we define in the login packet).
+        begin_packet(send_cursor, CBP_SYSTEM_CHAT);
+        WriteVarString(send_cursor, jsonMessage);
+        WriteU8(send_cursor, 0); // action bar or chat log
+        // @TODO(traks) write sender UUID. If UUID equals 0, client displays it
+        // regardless of client settings
+        // WriteU64(send_cursor, 0);
+        // WriteU64(send_cursor, 0);
+        finish_packet_as(send_cursor, compression);
+    }
+}
+
+#define MAX_BROADCAST_SIZE (1 << 20)
+
+// NOTE(traks): Packets that are the same for all players this tick. They're
+// encoded and compressed once, by the first player with packet compression
+// that needs them, and other players' batches refer to the result.
+typedef struct {
+    void (* write)(Cursor * send_cursor, i32 compression);
+    i32 prepared;
+    // NOTE(traks): set if there are no packets to send
+    i32 empty;
+    // NOTE(traks): NULL if encoding the packets failed, in which case every
+    // player encodes them on their own
+    BroadcastPacket * packet;
+} Broadcast;
+
+enum {
+    BROADCAST_FULL_TAB_LIST,
+    BROADCAST_TAB_LIST_CHANGES,
+    BROADCAST_CHAT,
+    BROADCAST_COUNT,
+};
+
+static Broadcast broadcasts[BROADCAST_COUNT] = {
+    [BROADCAST_FULL_TAB_LIST] = {.write = WriteFullTabList},
+    [BROADCAST_TAB_LIST_CHANGES] = {.write = WriteTabListChanges},
+    [BROADCAST_CHAT] = {.write = WriteChatMessages},
+};
+
+static void PrepareBroadcast(Broadcast * broadcast, MemoryArena * tick_arena) {
+    broadcast->prepared = 1;
+
+    // NOTE(traks): don't hold on to the scratch memory
+    MemoryArena scratchArena = *tick_arena;
+    Cursor cursor = {
+        .data = MallocInArena(&scratchArena, MAX_BROADCAST_SIZE),
+        .size = MAX_BROADCAST_SIZE
+    };
+    broadcast->write(&cursor, 1);
+    if (cursor.error != 0) {
+        return;
+    }
+    if (cursor.index == 0) {
+        broadcast->empty = 1;
+        return;
+    }
+    broadcast->packet = CreateBroadcastPacket(cursor.data, cursor.index);
+}
+
+static void SendBroadcast(Cursor * send_cursor, entity_base * player, Broadcast * broadcast, MemoryArena * tick_arena) {
+    i32 compression = player->flags & PLAYER_PACKET_COMPRESSION;
+    if (compression && !broadcast->prepared) {
+        PrepareBroadcast(broadcast, tick_arena);
+    }
+    if (compression && broadcast->empty) {
+        return;
+    }
+    if (compression && broadcast->packet != NULL) {
+        WriteBroadcastPacketRecord(send_cursor, broadcast->packet);
+    } else {
+        broadcast->write(send_cursor, compression);
+    }
+}
+
+void ReleaseBroadcastPackets(void) {
+    for (i32 i = 0; i < BROADCAST_COUNT; i++) {
+        Broadcast * broadcast = broadcasts + i;
+        if (broadcast->packet != NULL) {
+            ReleaseBroadcastPacket(broadcast->packet);
+        }
+        broadcast->prepared = 0;
+        broadcast->empty = 0;
+        broadcast->packet = NULL;
+    }
+}
+
+// @TODO(traks) I wonder if this function should be sending packets to all
+// players at once instead of to only a single player. That would allow us to
+// use the CPU cache better, etc. Chunk packets and packets that get sent to all
+// players are only encoded once already.
+void
+send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
+    BeginTimings(SendPackets);
+
+    // NOTE(traks): write the packets straight into the outbound queue if it
+    // has room for a full batch. Otherwise write them to the arena and try to
+    // queue them once we know how many bytes we wrote.
+    size_t max_uncompressed_packet_size = 1 << 20;
+    u8 * direct_batch = BeginPlayerPackets(player->player.connection, max_uncompressed_packet_size);
+    Cursor send_cursor_ = {
+        .data = direct_batch != NULL ? direct_batch : MallocInArena(tick_arena, max_uncompressed_packet_size),
+        .size = max_uncompressed_packet_size
+    };
+    Cursor * send_cursor = &send_cursor_;
+
+    if (!(player->flags & PLAYER_DID_INIT_PACKETS)) {
+        player->flags |= PLAYER_DID_INIT_PACKETS;
+
+        if (PACKET_COMPRESSION_ENABLED) {
+            // send login compression packet
+            begin_packet(send_cursor, 3);
+            WriteVarU32(send_cursor, PACKET_COMPRESSION_THRESHOLD);
+            finish_packet(send_cursor, player);
+
+            player->flags |= PLAYER_PACKET_COMPRESSION;
+        }
+
+        // send game profile packet
+        begin_packet(send_cursor, 2);
+        // @TODO(traks) send UUID
+        WriteU64(send_cursor, 0);
+        WriteU64(send_cursor, player->eid);
+        String username = {
+            .size = player->player.username_size,
+            .data = player->player.username
+        };
+        WriteVarString(send_cursor, username);
+        WriteVarU32(send_cursor, 0); // no properties for now
         finish_packet(send_cursor, player);
 
+        SendLoginPacket(send_cursor, player);
+
+        begin_packet(send_cursor, CBP_UPDATE_ENABLE_FEATURES);
+        WriteVarU32(send_cursor, 1);
+        WriteVarString(send_cursor, STR("minecraft:vanilla"));
+        finish_packet(send_cursor, player);
+
+        begin_packet(send_cursor, CBP_SET_CARRIED_ITEM);
+        WriteU8(send_cursor,
+                player->player.selected_slot - PLAYER_FIRST_HOTBAR_SLOT);
+        finish_packet(send_cursor, player);
+
+        SendTagsPacket(send_cursor, player);
+
         begin_packet(send_cursor, CBP_CUSTOM_PAYLOAD);
         String brand_str = STR("minecraft:brand");
         String brand = STR("Blaze");
@@ -2985,6 +3578,7 @@ send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
         finish_packet(send_cursor, player);
 
         player->player.last_keep_alive_sent_tick = serv->current_tick;
+        player->player.lastKeepAliveSentNanos = NanoTime();
         player->flags &= ~PLAYER_GOT_ALIVE_RESPONSE;
     }
 
@@ -3046,28 +3640,21 @@ send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
 
     BeginTimings(SendTrackedBlockChanges);
     SendTrackedBlockChanges(player, send_cursor, tick_arena);
+    SendTrackedLightChanges(player, send_cursor, tick_arena);
     EndTimings(SendTrackedBlockChanges);
 
     // load and send tracked chunks
     BeginTimings(LoadAndSendChunks);
 
-    // @TODO(traks) Don't send chunks if there are still chunks being sent to
-    // the client. Don't want to overflow the connection with chunks and lag
-    // everything else. Is there any way to figure out if a chunk has been
-    // received by the client? Or is there no way to tell if a chunk is still
-    // buffered by the OS or TCP?
-
-    // TODO(traks): would also be really cool if we could dynamically adjust the
-    // chunk send rate based on the client's bandwidth. For example, send ping
-    // packet then chunk packet, see how long it takes until we get the pong
-    // packet. In case of low bandwidth, we should send chunks less frequently.
-    // In case of high bandwidth, we can send chunks more rapidly.
-
     // We iterate in a spiral around the player, so chunks near the player
     // are processed first. This shortens server join times (since players
     // don't need to wait for the chunk they are in to load) and allows
     // players to move around much earlier.
     int newly_sent_chunks = 0;
+    int max_chunk_sends = GetChunkSendBudget(player);
+    i32 chunkEncodes = 0;
+    i32 maxChunkEncodes = player->player.chunkEncodeCredit;
+    i32 missingChunks = 0;
     int newInterestAdded = 0;
     int chunk_cache_diam = 2 * player->player.chunkCacheRadius + 1;
     int chunk_cache_area = chunk_cache_diam * chunk_cache_diam;
@@ -3090,16 +3677,43 @@ send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
         }
 
         if (!(cacheEntry->flags & PLAYER_CHUNK_SENT)
-                && newly_sent_chunks < MAX_CHUNK_SENDS_PER_TICK) {
+                && newly_sent_chunks < max_chunk_sends) {
             Chunk * ch = GetChunkIfLoaded(pos);
             if (ch != NULL) {
+                // NOTE(traks): leave room for the packets after the chunks
+                i32 roomForPacket = CursorRemaining(send_cursor) >= MAX_CHUNK_PACKET_SIZE + (1 << 18);
+                // NOTE(traks): a cache miss may only ask us to fill the cache
+                // if we're going to write the chunk packet right after
+                i32 canEncode = roomForPacket && chunkEncodes < maxChunkEncodes
+                        && chunkEncodeScheduler.encodesLeft > 0;
+                i32 sent = 0;
                 // send chunk blocks and lighting
-                send_chunk_fully(send_cursor, ch, player, tick_arena);
-                cacheEntry->flags |= PLAYER_CHUNK_SENT;
-                newly_sent_chunks++;
+                if ((player->flags & PLAYER_PACKET_COMPRESSION)
+                        && TryWriteCachedChunkPacket(send_cursor, ch->pos, ch->contentVersion, canEncode)) {
+                    sent = 1;
+                } else if (canEncode) {
+                    i64 encodeStart = NanoTime();
+                    send_chunk_fully(send_cursor, ch, player, tick_arena);
+                    chunkEncodeScheduler.tickEncodeNanos += NanoTime() - encodeStart;
+                    chunkEncodeScheduler.tickEncodes++;
+                    chunkEncodeScheduler.encodesLeft--;
+                    if (chunkEncodeScheduler.encodesLeft == 0) {
+                        chunkEncodeScheduler.lastEncodingPlayerIndex = player - serv->entities;
+                    }
+                    chunkEncodes++;
+                    sent = 1;
+                }
+                if (sent) {
+                    cacheEntry->flags |= PLAYER_CHUNK_SENT;
+                    newly_sent_chunks++;
+                }
             }
         }
 
+        if (!(cacheEntry->flags & PLAYER_CHUNK_SENT)) {
+            missingChunks++;
+        }
+
         off_x += step_x;
         off_z += step_z;
         // change direction of spiral when we hit a corner
@@ -3111,6 +3725,10 @@ send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
         }
     }
 
+    UpdateChunkSendRate(player, max_chunk_sends, newly_sent_chunks);
+    player->player.chunkEncodeCredit -= chunkEncodes;
+    player->player.missingChunkCount = missingChunks;
+
     EndTimings(LoadAndSendChunks);
 
     // send updates in player's own inventory
@@ -3162,119 +3780,9 @@ send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
 
     if (!(player->flags & PLAYER_INITIALISED_TAB_LIST)) {
         player->flags |= PLAYER_INITIALISED_TAB_LIST;
-        if (serv->tab_list_size > 0) {
-            begin_packet(send_cursor, CBP_PLAYER_INFO_UPDATE);
-            u8 actionBits = 0b111111; // everything
-            WriteU8(send_cursor, actionBits);
-            WriteVarU32(send_cursor, serv->tab_list_size);
-
-            for (int i = 0; i < serv->tab_list_size; i++) {
-                entity_id eid = serv->tab_list[i];
-                entity_base * tabListPlayer = resolve_entity(eid);
-                // TODO(traks): If a player disconnects mid tick (e.g. due to a
-                // networking error), this assert can fail, because the player
-                // entity will be gone. Fix this. For example by storing all
-                // required data in the tab list array, so we don't need to
-                // resolve entities.
-                // assert(tabListPlayer->type == ENTITY_PLAYER);
-                // @TODO(traks) write UUID
-                WriteU64(send_cursor, 0);
-                WriteU64(send_cursor, eid);
-                String username = {
-                    .data = tabListPlayer->player.username,
-                    .size = tabListPlayer->player.username_size
-                };
-                WriteVarString(send_cursor, username);
-                WriteVarU32(send_cursor, 0); // num properties
-                WriteU8(send_cursor, 0); // has message signing key
-                WriteVarU32(send_cursor, tabListPlayer->player.gamemode);
-                WriteU8(send_cursor, 1); // listed
-                WriteVarU32(send_cursor, 0); // latency
-                WriteU8(send_cursor, 0); // has display name
-            }
-            finish_packet(send_cursor, player);
-        }
+        SendBroadcast(send_cursor, player, broadcasts + BROADCAST_FULL_TAB_LIST, tick_arena);
     } else {
-        if (serv->tab_list_removed_count > 0) {
-            begin_packet(send_cursor, CBP_PLAYER_INFO_REMOVE);
-            WriteVarU32(send_cursor, serv->tab_list_removed_count);
-
-            for (int i = 0; i < serv->tab_list_removed_count; i++) {
-                entity_id eid = serv->tab_list_removed[i];
-                // @TODO(traks) write UUID
-                WriteU64(send_cursor, 0);
-                WriteU64(send_cursor, eid);
-            }
-            finish_packet(send_cursor, player);
-        }
-        if (serv->tab_list_added_count > 0) {
-            begin_packet(send_cursor, CBP_PLAYER_INFO_UPDATE);
-
-            // NOTE(traks): actions:
-            // 0 = add player
-            // 1 = init chat
-            // 2 = update game mode
-            // 3 = update listed
-            // 4 = update latency
-            // 5 = update display name
-
-            // TODO(traks): init chat?
-
-            u8 actionBits = 0b111111; // everything
-            WriteU8(send_cursor, actionBits);
-            WriteVarU32(send_cursor, serv->tab_list_added_count);
-
-            for (int i = 0; i < serv->tab_list_added_count; i++) {
-                entity_id eid = serv->tab_list_added[i];
-                entity_base * tabListPlayer = resolve_entity(eid);
-                // TODO(traks): If a player disconnects mid tick (e.g. due to a
-                // networking error), this assert can fail, because the player
-                // entity will be gone. Fix this. For example by storing all
-                // required data in the tab list array, so we don't need to
-                // resolve entities.
-                // assert(tabListPlayer->type == ENTITY_PLAYER);
-                // @TODO(traks) write UUID
-                WriteU64(send_cursor, 0);
-                WriteU64(send_cursor, eid);
-
-                // NOTE(traks): after the UUID, write all the data of the player
-                // per action, in order
-
-                String username = {
-                    .data = tabListPlayer->player.username,
-                    .size = tabListPlayer->player.username_size
-                };
-                WriteVarString(send_cursor, username);
-                WriteVarU32(send_cursor, 0); // num properties
-                WriteU8(send_cursor, 0); // has message signing key
-                WriteVarU32(send_cursor, tabListPlayer->player.gamemode);
-                WriteU8(send_cursor, 1); // listed
-                WriteVarU32(send_cursor, 0); // latency
-                WriteU8(send_cursor, 0); // has display name
-            }
-            finish_packet(send_cursor, player);
-        }
-
-        for (int i = 0; i < MAX_ENTITIES; i++) {
-            entity_base * entity = serv->entities + i;
-            if (!(entity->flags & ENTITY_IN_USE)) {
-                continue;
-            }
-            if (entity->type != ENTITY_PLAYER) {
-                continue;
-            }
-
-            if (entity->changed_data & PLAYER_GAMEMODE_CHANGED) {
-                begin_packet(send_cursor, CBP_PLAYER_INFO_UPDATE);
-                WriteVarU32(send_cursor, 0b000100); // action: update gamemode
-                WriteVarU32(send_cursor, 1); // changed entries
-                // @TODO(traks) write uuid
-                WriteU64(send_cursor, 0);
-                WriteU64(send_cursor, entity->eid);
-                WriteVarU32(send_cursor, entity->player.gamemode);
-                finish_packet(send_cursor, player);
-            }
-        }
+        SendBroadcast(send_cursor, player, broadcasts + BROADCAST_TAB_LIST_CHANGES, tick_arena);
     }
 
     EndTimings(SendTabList);
@@ -3354,169 +3862,31 @@ send_packets_to_player(entity_base * player, MemoryArena * tick_arena) {
     // send chat messages
     BeginTimings(SendChat);
 
-    for (int msgIndex = 0; msgIndex < serv->global_msg_count; msgIndex++) {
-        global_msg * msg = serv->global_msgs + msgIndex;
-
-        // @TODO(traks) formatted messages and such
-        unsigned char buf[1024];
-        int buf_index = 0;
-        String prefix = STR("{\"text\":\"");
-        String suffix = STR("\"}");
-
-        memcpy(buf + buf_index, prefix.data, prefix.size);
-        buf_index += prefix.size;
-
-        for (int i = 0; i < msg->size; i++) {
-            if (msg->text[i] == '"' || msg->text[i] == '\\') {
-                buf[buf_index] = '\\';
-                buf_index++;
-            }
-            buf[buf_index] = msg->text[i];
-            buf_index++;
-        }
-
-        memcpy(buf + buf_index, suffix.data, suffix.size);
-        buf_index += suffix.size;
-
-        String jsonMessage = {
-            .size = buf_index,
-            .data = buf,
-        };
-
-        // TODO(traks): use player chat packet for this with annoying signing.
-        // Also will make chat narration work properly as "sender says message"
-        // (see the chat types we define in the login packet).
-        begin_packet(send_cursor, CBP_SYSTEM_CHAT);
-        WriteVarString(send_cursor, jsonMessage);
-        WriteU8(send_cursor, 0); // action bar or chat log
-        // @TODO(traks) write sender UUID. If UUID equals 0, client displays it
-        // regardless of client settings
-        // WriteU64(send_cursor, 0);
-        // WriteU64(send_cursor, 0);
-        finish_packet(send_cursor, player);
-    }
+    SendBroadcast(send_cursor, player, broadcasts + BROADCAST_CHAT, tick_arena);
 
     EndTimings(SendChat);
 
-    // try to write everything to the socket buffer
+    // hand the packets over to the network thread, which compresses and sends
+    // them
 
     if (send_cursor->error != 0) {
         // just disconnect the player
         LogInfo("Failed to create packets");
+        DiscardPlayerPackets(send_cursor->data, send_cursor->index);
         disconnect_player_now(player);
         goto bail;
     }
 
-    BeginTimings(FinalisePackets);
-
-    Cursor final_cursor_ = {
-        .data = player->player.send_buf,
-        .size = player->player.send_buf_size,
-        .index = player->player.send_cursor
-    };
-    Cursor * final_cursor = &final_cursor_;
-
-    send_cursor->size = send_cursor->index;
-    send_cursor->index = 0;
-    while (send_cursor->index != send_cursor->size) {
-        int internal_header = send_cursor->data[send_cursor->index];
-        int size_offset = internal_header & 0x7;
-        int should_compress = internal_header & 0x80;
-
-        send_cursor->index += 1 + size_offset;
-
-        int packet_start = send_cursor->index;
-        i32 packet_size = ReadVarU32(send_cursor);
-        int packet_end = send_cursor->index + packet_size;
-
-        // TODO(traks): these 2 lines are debugging code
-        i32 packetId = ReadVarU32(send_cursor);
-        send_cursor->index = packet_end - packet_size;
-
-        if (should_compress) {
-            // @TODO(traks) handle errors properly
-
-            z_stream zstream;
-            zstream.zalloc = Z_NULL;
-            zstream.zfree = Z_NULL;
-            zstream.opaque = Z_NULL;
-
-            if (deflateInit(&zstream, Z_DEFAULT_COMPRESSION) != Z_OK) {
-                final_cursor->error = 1;
-                break;
-            }
-
-            zstream.next_in = send_cursor->data + send_cursor->index;
-            zstream.avail_in = packet_end - send_cursor->index;
-
-            MemoryArena temp_arena = *tick_arena;
-            // @TODO(traks) appropriate value
-            size_t max_compressed_size = 1 << 19;
-            unsigned char * compressed = MallocInArena(&temp_arena,
-                    max_compressed_size);
-
-            zstream.next_out = compressed;
-            zstream.avail_out = max_compressed_size;
-
-            BeginTimings(Deflate);
-            // i64 deflateTimeStart = NanoTime();
-            if (deflate(&zstream, Z_FINISH) != Z_STREAM_END) {
-                EndTimings(Deflate);
-                final_cursor->error = 1;
-                break;
-            }
-            // i64 deflateTimeEnd = NanoTime();
-            // if (packetId == CBP_LEVEL_CHUNK_WITH_LIGHT) {
-            //     LogInfo("Deflate took %jdµs for size %jd of packet %d", (intmax_t) (deflateTimeEnd - deflateTimeStart) / 1000, (intmax_t) packet_size, packetId);
-            // }
-            EndTimings(Deflate);
-
-            if (deflateEnd(&zstream) != Z_OK) {
-                final_cursor->error = 1;
-                break;
-            }
-
-            if (zstream.avail_in != 0) {
-                final_cursor->error = 1;
-                break;
-            }
-
-            WriteVarU32(final_cursor, VarU32Size(packet_size) + zstream.total_out);
-            WriteVarU32(final_cursor, packet_size);
-            WriteData(final_cursor, compressed, zstream.total_out);
-        } else {
-            // @TODO(traks) should check somewhere that no error occurs
-            WriteData(final_cursor, send_cursor->data + packet_start,
-                    packet_end - packet_start);
-        }
-
-        send_cursor->index = packet_end;
-    }
-
-    EndTimings(FinalisePackets);
-
-    if (final_cursor->error != 0) {
-        // just disconnect the player
-        LogInfo("Failed to finalise packets");
-        disconnect_player_now(player);
-        goto bail;
-    }
-
-    BeginTimings(SystemSend);
-    ssize_t send_size = send(player->player.sock, final_cursor->data,
-            final_cursor->index, 0);
-    EndTimings(SystemSend);
-
-    if (send_size == -1) {
-        // EAGAIN means no data sent
-        if (errno != EAGAIN) {
-            LogErrno("Couldn't send protocol data to player: %s");
+    if (send_cursor->index > 0 && direct_batch != NULL) {
+        CommitPlayerPackets(player->player.connection, send_cursor->index);
+    } else if (send_cursor->index > 0) {
+        if (!QueuePlayerPackets(player->player.connection, send_cursor->data, send_cursor->index)) {
+            // the network thread can't keep up with this player, so just
+            // disconnect them
+            LogInfo("Failed to queue packets");
             disconnect_player_now(player);
+            goto bail;
         }
-    } else {
-        memmove(final_cursor->data, final_cursor->data + send_size,
-                final_cursor->index - send_size);
-        player->player.send_cursor = final_cursor->index - send_size;
     }
 
 bail:
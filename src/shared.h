@@ -31,16 +31,48 @@ static_assert(BITS_PER_BLOCK_STATE <= MAX_BITS_PER_BLOCK_STATE, "Unsupported bit
 
 #define KEEP_ALIVE_TIMEOUT (30 * 20)
 
-// TODO(traks): these values shouldn't only be configurable per player, but
-// there should be global limits too
-
-// @TODO(traks) Currently chunks sometimes don't want to render when sprint
-// flying around in gamemode creative. Increasing this to 4 seems to fix this.
-// Why? What is a good value? Should we base it on player network bandwidth?
-#define MAX_CHUNK_SENDS_PER_TICK (2)
+// TODO(traks): these values should be configurable
+
+// NOTE(traks): chunks sent to a player per tick. The rate adapts to the
+// player's connection: it grows while the connection keeps up and drops by 10%
+// every tick data piles up in the send buffers. Players can save up at most a
+// tick's worth of chunks, or a single chunk if the rate is lower than that.
+#define INITIAL_CHUNK_SEND_RATE (2.0f)
+#define MIN_CHUNK_SEND_RATE (0.25f)
+#define MAX_CHUNK_SEND_RATE (16.0f)
+#define CHUNK_SEND_RATE_STEP (0.25f)
+// NOTE(traks): how long data may wait in the send buffers on top of the round
+// trip time, so gameplay packets don't queue up behind chunks for long
+#define CHUNK_SEND_TARGET_DELAY_SECONDS (0.05f)
+// NOTE(traks): lower bound on the data allowed in the send buffers
+#define MIN_CHUNK_SEND_TARGET_BYTES (1 << 15)
+
+// NOTE(traks): stop sending chunks to a player while more than this many bytes
+// of packets are waiting for the network thread
+#define MAX_QUEUED_PACKET_BYTES_FOR_CHUNKS (1 << 19)
 
 #define MAX_CHUNK_LOADS_PER_TICK (2)
 
+// NOTE(traks): chunk packets built from scratch are expensive, so all players
+// share a global budget of them each tick, based on the time left in the tick.
+// Cached chunk packets are cheap and don't count towards it.
+#define CHUNK_ENCODE_TIME_RESERVE_NANOS (15000000LL)
+#define MIN_CHUNK_ENCODES_PER_TICK (4)
+#define MAX_CHUNK_ENCODES_PER_TICK (512)
+#define INITIAL_CHUNK_ENCODE_NANOS (1000000.0f)
+// NOTE(traks): unused chunk encode credit a player may carry over to the next
+// tick, so players that joined together don't all encode in the same tick
+#define MAX_CHUNK_ENCODE_CREDIT_CARRY (2.0f)
+
+// NOTE(traks): players in higher priority classes get a larger share of the
+// chunk encode budget
+enum player_priority {
+    PLAYER_PRIORITY_NORMAL,
+    PLAYER_PRIORITY_VIP,
+    PLAYER_PRIORITY_STAFF,
+    PLAYER_PRIORITY_COUNT,
+};
+
 // must be power of 2
 #define MAX_ENTITIES (1024)
 
@@ -48,6 +80,9 @@ static_assert(BITS_PER_BLOCK_STATE <= MAX_BITS_PER_BLOCK_STATE, "Unsupported bit
 
 // whether all play packets should be compressed or not
 #define PACKET_COMPRESSION_ENABLED (1)
+// NOTE(traks): packets smaller than this are sent uncompressed, since deflate
+// barely shrinks them. The client gets told about it too.
+#define PACKET_COMPRESSION_THRESHOLD (256)
 
 // NOTE(traks): for block positions: 26 bits X, 26 bits Z, 12 bits Y
 // NOTE(traks): for chunk positions: 22 bits X, 22 bits Z
@@ -71,6 +106,23 @@ static_assert(BITS_PER_BLOCK_STATE <= MAX_BITS_PER_BLOCK_STATE, "Unsupported bit
 // @NOTE(traks) add 2 for extra section above and below the world
 #define LIGHT_SECTIONS_PER_CHUNK (SECTIONS_PER_CHUNK + 2)
 
+// NOTE(traks): the live vanilla height maps. A height map stores for every
+// column 1 + the Y of the highest block that counts for that height map, or
+// MIN_WORLD_Y if there is no such block
+enum HeightMapType {
+    // NOTE(traks): non-air blocks
+    HEIGHT_MAP_WORLD_SURFACE,
+    // NOTE(traks): blocks that block motion
+    HEIGHT_MAP_OCEAN_FLOOR,
+    // NOTE(traks): blocks that block motion or contain fluid
+    HEIGHT_MAP_MOTION_BLOCKING,
+    // NOTE(traks): same as above, but excluding leaves
+    HEIGHT_MAP_MOTION_BLOCKING_NO_LEAVES,
+    HEIGHT_MAP_COUNT,
+};
+
+#define HEIGHT_MAP_ALL_TYPES (((u32) 1 << HEIGHT_MAP_COUNT) - 1)
+
 // in network id order
 enum gamemode {
     GAMEMODE_SURVIVAL,
@@ -1837,6 +1889,8 @@ typedef struct {
     u8 flags;
 } PlayerChunkCacheEntry;
 
+typedef struct PlayerConnection PlayerConnection;
+
 typedef struct {
     entity_id eid;
 
@@ -1877,14 +1931,8 @@ typedef struct {
     // movement and their head rotation. However, we do need to send a players
     // head rotation using the designated packet, otherwise heads won't rotate.
 
-    int sock;
-    unsigned char * rec_buf;
-    int rec_buf_size;
-    int rec_cursor;
-
-    unsigned char * send_buf;
-    int send_buf_size;
-    int send_cursor;
+    // NOTE(traks): owned by a network thread, see network.h
+    PlayerConnection * connection;
 
     // The radius of the client's view distance, excluding the centre chunk,
     // and including an extra outer rim the client doesn't render but uses
@@ -1910,6 +1958,24 @@ typedef struct {
     u8 allowInStatusList;
 
     i64 last_keep_alive_sent_tick;
+    i64 lastKeepAliveSentNanos;
+    // NOTE(traks): includes time spent waiting in the send buffers
+    i64 keepAliveRttNanos;
+
+    // NOTE(traks): adaptive chunk send rate, in chunks per tick
+    float chunkSendRate;
+    float chunkSendCredit;
+    // NOTE(traks): bytes per second the connection delivered when it was busy
+    float bandwidthEstimate;
+    i64 bandwidthSampleTick;
+    i64 bandwidthSampleDeliveredBytes;
+
+    // NOTE(traks): share of the global chunk encode budget, in chunks
+    float chunkEncodeCredit;
+    // NOTE(traks): chunks in the chunk cache that haven't been sent yet
+    i32 missingChunkCount;
+    // @TODO(traks) let server operators assign priority classes
+    u8 priorityClass;
 
     entity_id eid;
 
@@ -2255,6 +2321,9 @@ typedef struct {
     u8 lightBlockingModelByState[MAX_BLOCK_STATES];
     u8 lightReductionByState[MAX_BLOCK_STATES];
     u8 emittedLightByState[MAX_BLOCK_STATES];
+    // NOTE(traks): bit i is set if the block state counts for height map i.
+    // Padded, so height map code can read a few bytes past the last state.
+    u8 heightMapTypesByState[MAX_BLOCK_STATES + 4];
     BlockBehaviours blockBehavioursByType[ACTUAL_BLOCK_TYPE_COUNT];
     u8 lightCanPropagate[BLOCK_MODEL_COUNT * BLOCK_MODEL_COUNT];
 
@@ -2320,9 +2389,20 @@ add_stack_to_player_inventory(entity_base * player, item_stack * to_add);
 void
 tick_player(entity_base * entity, MemoryArena * tick_arena);
 
+i32 ScheduleChunkEncodes(void);
+
+// NOTE(traks): builds the packets sent to joining players that are the same
+// for everyone. Call once the tags, dimension types and biomes are loaded.
+void InitJoinPackets(void);
+// NOTE(traks): picks the SIMD kernels for the CPU, see DetectCpuFeatures
+void InitChunkPacketKernels(void);
+
 void
 send_packets_to_player(entity_base * entity, MemoryArena * tick_arena);
 
+// NOTE(traks): call once all players have been sent their packets for the tick
+void ReleaseBroadcastPackets(void);
+
 void
 register_resource_loc(String resource_loc, i16 id,
         resource_loc_table * table);
@@ -35,6 +35,13 @@ static void * RunThread(void * arg) {
     for (;;) {
         TaskQueueEntry found = PopOrAwaitTaskFromQueue(queue);
         if (found.callback != NULL) {
+            i64 waitNanos = NanoTime() - found.pushNanos;
+            i64 maxWaitNanos = atomic_load_explicit(&queue->maxWaitNanos, memory_order_relaxed);
+            while (waitNanos > maxWaitNanos) {
+                if (atomic_compare_exchange_weak_explicit(&queue->maxWaitNanos, &maxWaitNanos, waitNanos, memory_order_relaxed, memory_order_relaxed)) {
+                    break;
+                }
+            }
             found.callback(found.data);
         }
     }
@@ -74,6 +81,7 @@ i32 PushTaskToQueue(TaskQueue * queue, TaskQueueCallback callback, void * data)
     TaskQueueEntry entry = {
         .callback = callback,
         .data = data,
+        .pushNanos = NanoTime(),
     };
 
     for (;;) {
@@ -83,6 +91,7 @@ i32 PushTaskToQueue(TaskQueue * queue, TaskQueueCallback callback, void * data)
         u32 nextWriteIndex = (writeCommit + 1) % size;
 
         if (nextWriteIndex == readIndex) {
+            atomic_fetch_add_explicit(&queue->pushFailures, 1, memory_order_relaxed);
             return 0;
         }
 
@@ -106,3 +115,32 @@ i32 PushTaskToQueue(TaskQueue * queue, TaskQueueCallback callback, void * data)
         }
     }
 }
+
+i32 TaskQueueFreeCount(TaskQueue * queue) {
+    u32 size = ARRAY_SIZE(queue->entries);
+    u32 writeCommit = atomic_load_explicit(&queue->writeCommit, memory_order_acquire);
+    u32 readIndex = atomic_load_explicit(&queue->readIndex, memory_order_acquire);
+    u32 used = (writeCommit % size + size - readIndex) % size;
+    // NOTE(traks): one slot is always kept empty to distinguish a full queue
+    // from an empty one
+    return size - 1 - used;
+}
+
+TaskQueueStats GetTaskQueueStats(TaskQueue * queue) {
+    u32 size = ARRAY_SIZE(queue->entries);
+    TaskQueueStats res = {0};
+    res.capacity = size - 1;
+    res.depth = res.capacity - TaskQueueFreeCount(queue);
+    res.pushFailures = atomic_load_explicit(&queue->pushFailures, memory_order_relaxed);
+    res.maxWaitNanos = atomic_exchange_explicit(&queue->maxWaitNanos, 0, memory_order_relaxed);
+
+    u32 readIndex = atomic_load_explicit(&queue->readIndex, memory_order_acquire);
+    u32 writeIndex = atomic_load_explicit(&queue->writeIndex, memory_order_acquire);
+    if (readIndex != writeIndex) {
+        // NOTE(traks): the entry may be popped and overwritten while we're
+        // looking at it. That's fine for statistics, we only need a rough idea
+        i64 pushNanos = queue->entries[readIndex].pushNanos;
+        res.oldestWaitNanos = MAX(NanoTime() - pushNanos, 0);
+    }
+    return res;
+}
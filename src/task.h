@@ -10,6 +10,7 @@ typedef void (* TaskQueueCallback)(void * data);
 typedef struct {
     TaskQueueCallback callback;
     void * data;
+    i64 pushNanos;
 } TaskQueueEntry;
 
 typedef struct {
@@ -20,10 +21,30 @@ typedef struct {
     _Atomic u32 readIndex;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+    // NOTE(traks): statistics, so we can size the worker pools based on data
+    // instead of guesswork
+    _Atomic u64 pushFailures;
+    _Atomic i64 maxWaitNanos;
     TaskQueueEntry entries[256];
 } TaskQueue;
 
+typedef struct {
+    i32 capacity;
+    i32 depth;
+    u64 pushFailures;
+    // NOTE(traks): how long the task at the front of the queue has been
+    // waiting for a worker
+    i64 oldestWaitNanos;
+    // NOTE(traks): largest time a task waited for a worker since the previous
+    // call to GetTaskQueueStats
+    i64 maxWaitNanos;
+} TaskQueueStats;
+
 void CreateTaskQueue(TaskQueue * queue, i32 threadCount);
+// NOTE(traks): returns 0 if the queue is full. The caller is responsible for
+// retrying later, e.g. by keeping the work around in its own overflow list.
 i32 PushTaskToQueue(TaskQueue * queue, TaskQueueCallback callback, void * data);
+i32 TaskQueueFreeCount(TaskQueue * queue);
+TaskQueueStats GetTaskQueueStats(TaskQueue * queue);
 
 #endif